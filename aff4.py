@@ -30,7 +30,9 @@ from pyaff4 import container, version
 from pyaff4 import lexicon, logical, escaping
 from pyaff4 import rdfvalue, hashes, utils
 from pyaff4 import block_hasher, data_store, linear_hasher, zip
+from pyaff4 import recovery
 from pyaff4 import aff4_map
+from pyaff4 import statistics
 
 #logging.basicConfig(level=logging.DEBUG)
 
@@ -41,9 +43,7 @@ def printImageMetadata(resolver, volume, image):
     print("\t%s <%s>" % (image.name(), trimVolume(volume.urn, image.urn)))
     with resolver.AFF4FactoryOpen(image.urn) as srcStream:
         if type(srcStream) == aff4_map.AFF4Map2:
-            source_ranges = sorted(srcStream.tree)
-            for n in source_ranges:
-                d = n.data
+            for d in srcStream.GetRanges():
                 print("\t\t[%x,%x] -> %s[%x,%x]" % (
                 d.map_offset, d.length, srcStream.targets[d.target_id], d.target_offset, d.length))
 
@@ -298,8 +298,13 @@ def addPathNamesToVolume(resolver, volume, pathnames, recursive, hashbased):
                     hh = hashes.newImmutableHash(h.hexdigest(), hasher.hashToType[h])
                     resolver.Add(urn, urn, rdfvalue.URN(lexicon.standard.hash), hh)
 
-def addPathNames(container_name, pathnames, recursive, append, hashbased, password):
-    with data_store.MemoryDataStore() as resolver:
+def addPathNames(container_name, pathnames, recursive, append, hashbased, password, max_triples=None):
+    if max_triples is None:
+        resolver = data_store.MemoryDataStore()
+    else:
+        resolver = data_store.SpillingDataStore(max_triples=max_triples)
+
+    with resolver as resolver:
         container_urn = rdfvalue.URN.FromFileName(container_name)
         urn = None
         encryption = False
@@ -330,6 +335,84 @@ def addPathNames(container_name, pathnames, recursive, append, hashbased, passwo
         return urn
 
 
+def recover(container_name):
+    container_urn = rdfvalue.URN.FromFileName(container_name)
+    with data_store.MemoryDataStore() as resolver:
+        volume_urn = recovery.Recover(resolver, container_urn)
+        print("Recovering AFF4Container: file://%s <%s>" % (container_name, volume_urn))
+
+    with container.Container.openURNtoContainer(container_urn) as volume:
+        printVolumeInfo(container_name, volume)
+
+def compact(container_name):
+    container_urn = rdfvalue.URN.FromFileName(container_name)
+    size = os.stat(container_name).st_size
+    (version, lex) = container.Container.identifyURN(container_urn)
+    with data_store.MemoryDataStore(lex) as resolver:
+        resolver.Set(lexicon.transient_graph, container_urn, lexicon.AFF4_STREAM_WRITE_MODE,
+                     rdfvalue.XSDString("random"))
+        with zip.ZipFile.NewZipFile(resolver, version, container_urn) as volume:
+            print("Compacting AFF4Container: file://%s <%s>" % (container_name, volume.urn))
+            volume.Compact()
+
+    print("Reclaimed %d bytes" % (size - os.stat(container_name).st_size))
+
+def printMapStatistics(stats):
+    print("\t%s (Map)" % stats.urn)
+    print("\t\tSize: %d (bytes)" % stats.size)
+    print("\t\tRanges: %d" % stats.ranges)
+    print("\t\tContiguous extents: %d (average %d bytes)" % (
+        stats.extents, stats.AverageExtent()))
+    print("\t\tRange lengths:")
+    for bucket in sorted(stats.length_histogram):
+        print("\t\t\t>= %d: %d" % (1 << bucket, stats.length_histogram[bucket]))
+    print("\t\tBytes by target kind:")
+    for kind, length in stats.kind_bytes.items():
+        print("\t\t\t%s: %d (%.1f%%)" % (kind, length, 100.0 * length / max(stats.size, 1)))
+    print("\t\tBytes by target:")
+    for target, length in stats.target_bytes.items():
+        print("\t\t\t%s: %d" % (target, length))
+
+def printImageStatistics(stats):
+    chunks = stats.Chunks()
+    print("\t%s (ImageStream)" % stats.urn)
+    print("\t\tCompression: %s" % stats.compression)
+    print("\t\tChunks: %d of %d bytes, %d bytes stored" % (
+        chunks, stats.chunk_size, stats.StoredBytes()))
+    print("\t\tCompression ratio: %.2f" % stats.CompressionRatio())
+    print("\t\tRaw chunks: %d (%.1f%%)" % (
+        stats.RawChunks(), 100.0 * stats.RawChunks() / max(chunks, 1)))
+    print("\t\tBevies by raw chunks:")
+    histogram = stats.RawHistogram()
+    for raw in sorted(histogram):
+        print("\t\t\t%d raw: %d" % (raw, histogram[raw]))
+    if VERBOSE:
+        for bevy_id, (bevy_chunks, stored, raw) in enumerate(stats.bevies):
+            print("\t\t\t%08d: ratio %.2f, %d of %d chunks raw" % (
+                bevy_id, stats.CompressionRatio(bevy_id), raw, bevy_chunks))
+
+def stats(container_names):
+    with container.ContainerSet.open(container_names) as volumes:
+        resolver = volumes.resolver
+        for i, volume_urn in enumerate(volumes.volumes):
+            print("AFF4Container: file://%s <%s>" % (container_names[i], volume_urn))
+
+        streams = []
+        for typ in [lexicon.AFF4_MAP_TYPE, lexicon.AFF4_LEGACY_MAP_TYPE,
+                    lexicon.AFF4_SCUDETTE_MAP_TYPE, lexicon.AFF4_IMAGE_TYPE,
+                    lexicon.AFF4_LEGACY_IMAGE_TYPE, lexicon.AFF4_SCUDETTE_IMAGE_TYPE]:
+            for urn in resolver.QueryPredicateObject(lexicon.any, lexicon.AFF4_TYPE,
+                                                     rdfvalue.URN(typ)):
+                if urn not in streams:
+                    streams.append(urn)
+
+        for urn in streams:
+            result = statistics.Analyse(resolver, urn)
+            if isinstance(result, statistics.MapStatistics):
+                printMapStatistics(result)
+            elif isinstance(result, statistics.ImageStatistics):
+                printImageStatistics(result)
+
 def nextOrNone(iterable):
     try:
         return next(iterable)
@@ -459,6 +542,16 @@ def main(argv):
                         help='ingest a zip file into a hash based image')
     parser.add_argument('-e', "--password", nargs=1, action="store",
                         help='provide a password for encryption. This causes an encrypted container to be used.')
+    parser.add_argument("--recover", action="store_true",
+                        help='rebuild the central directory and metadata of a container which was not closed cleanly')
+    parser.add_argument("--compact", action="store_true",
+                        help='rewrite a container to reclaim the space left by removed members')
+    parser.add_argument("--max-triples", type=int, action="store",
+                        help='when creating a logical container, keep at most this many metadata triples in memory and spill the rest to disk')
+    parser.add_argument("--turtle-processes", type=int, action="store",
+                        help='parse large metadata in this many worker processes (0 for one per CPU)')
+    parser.add_argument("--stats", action="store_true",
+                        help='report the fragmentation of maps and compression of image streams. Further volumes of the image may follow the container')
     parser.add_argument('aff4container', help='the pathname of the AFF4 container')
     parser.add_argument('srcFiles', nargs="*", help='source files and folders to add as logical image')
 
@@ -468,10 +561,13 @@ def main(argv):
     global VERBOSE
     VERBOSE = args.verbose
     TERSE = args.terse
+    if args.turtle_processes is not None:
+        data_store.TURTLE_PROCESSES = args.turtle_processes
 
     if args.create_logical == True:
         dest = args.aff4container
-        addPathNames(dest, args.srcFiles, args.recursive, args.append, args.hash, args.password)
+        addPathNames(dest, args.srcFiles, args.recursive, args.append, args.hash, args.password,
+                     args.max_triples)
     elif  args.meta == True:
         dest = args.aff4container
         meta(dest, args.password)
@@ -490,6 +586,14 @@ def main(argv):
     elif args.ingest == True:
         dest = args.aff4container
         ingestZipfile(dest, args.srcFiles, False, args.paranoid)
+    elif args.recover == True:
+        dest = args.aff4container
+        recover(dest)
+    elif args.compact == True:
+        dest = args.aff4container
+        compact(dest)
+    elif args.stats == True:
+        stats([args.aff4container] + args.srcFiles)
 
 
 if __name__ == "__main__":
@@ -313,7 +313,7 @@ class AFF4Stream(AFF4Object):
         self.Write(data)
 
     def tell(self):
-        return self.Tell()
+        return self.TellRead()
 
     def flush(self):
         self.Flush()
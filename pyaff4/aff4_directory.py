@@ -141,14 +141,14 @@ class AFF4Directory(aff4.AFF4Volume):
                     self.storage.Append(
                         lexicon.AFF4_CONTAINER_INFO_TURTLE)) as turtle_stream:
                 if turtle_stream:
-                    self.resolver.LoadFromTurtle(turtle_stream)
+                    self.resolver.LoadFromTurtle(turtle_stream, self.urn)
 
                     # Find all the contained objects and adjust their filenames.
                     for subject in self.resolver.SelectSubjectsByPrefix(
-                            utils.SmartUnicode(self.urn)):
+                            self.urn, utils.SmartUnicode(self.urn)):
 
-                        child_filename = self.resolver.Get(
-                            subject, lexicon.AFF4_DIRECTORY_CHILD_FILENAME)
+                        child_filename = self.resolver.GetUnique(
+                            self.urn, subject, lexicon.AFF4_DIRECTORY_CHILD_FILENAME)
                         if child_filename:
                             self.resolver.Set(lexicon.transient_graph,
                                 subject, lexicon.AFF4_FILE_NAME,
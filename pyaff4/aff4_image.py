@@ -51,6 +51,8 @@ class _CompressorStream(object):
         self.size = 0
         self.bevy_index = []
         self.bevy_length = 0
+        # The CRC32 of the bevy, chained through each chunk as it is read.
+        self.checksum = zip.CRC32Folder()
 
     def tell(self):
         return self.stream.tell()
@@ -80,11 +82,14 @@ class _CompressorStream(object):
         if compressedLen < self.owner.chunk_size - 16:
             self.bevy_index.append((self.bevy_length, compressedLen))
             self.bevy_length += compressedLen
-            return compressed_chunk
+            result = compressed_chunk
         else:
             self.bevy_index.append((self.bevy_length, self.owner.chunk_size))
             self.bevy_length += self.owner.chunk_size
-            return chunk
+            result = chunk
+
+        self.checksum.Update(result)
+        return result
 
 
 class AFF4Image(aff4.AFF4Stream):
@@ -153,6 +158,9 @@ class AFF4Image(aff4.AFF4Stream):
         self.chunk_count_in_bevy = 0
         self.bevy_number = 0
 
+        # The CRC32 of the chunks in the bevy, chained through each chunk.
+        self.bevy_checksum = zip.CRC32Folder()
+
         self.cache = ExpiringDict(max_len=1000, max_age_seconds=10)
 
         # used for identifying in-place writes to bevys
@@ -190,6 +198,10 @@ class AFF4Image(aff4.AFF4Stream):
             raise IOError("Unable to find storage for urn %s" %
                           self.urn)
 
+        if self._CanTransplant(source_stream):
+            self._TransplantBevies(volume_urn, source_stream, progress)
+            return
+
         with self.resolver.AFF4FactoryOpen(volume_urn) as volume:
             # Write a bevy at a time.
             while 1:
@@ -200,8 +212,11 @@ class AFF4Image(aff4.AFF4Stream):
                                   self.chunks_per_segment *
                                   self.chunk_size)
 
+                # The stream checksums each chunk as it makes it, so the
+                # member is not checksummed again while it is copied.
                 with volume.CreateMember(bevy_urn) as bevy:
-                    bevy.WriteStream(stream, progress=progress)
+                    bevy.WriteStream(stream, progress=progress,
+                                     crc32=lambda: stream.checksum.crc32)
 
                 self._write_bevy_index(volume, bevy_urn, stream.bevy_index)
 
@@ -217,6 +232,50 @@ class AFF4Image(aff4.AFF4Stream):
 
         self._write_metadata()
 
+    def _CanTransplant(self, source):
+        """Can the bevies of source be copied into this stream as they are?
+
+        The source must be a complete image stream with the same chunking and
+        compression, and nothing may have been written to this stream yet.
+        """
+        return (isinstance(source, AFF4Image) and not source.IsDirty() and
+                source.readptr == 0 and
+                source.chunk_size == self.chunk_size and
+                source.chunks_per_segment == self.chunks_per_segment and
+                str(source.compression) == str(self.compression) and
+                not self.IsDirty() and self.size == 0 and self.bevy_number == 0)
+
+    def _TransplantBevies(self, volume_urn, source, progress):
+        """Copy the compressed bevies of source without recompressing them.
+
+        Only the bevy indexes are rewritten, in this stream's format.
+        """
+        bevy_size = self.chunk_size * self.chunks_per_segment
+        bevy_count = (source.Size() + bevy_size - 1) // bevy_size
+        if LOGGER.isEnabledFor(logging.INFO):
+            LOGGER.info("Transplanting %d bevies from %s to %s", bevy_count,
+                        source.urn, self.urn)
+
+        with self.resolver.AFF4FactoryOpen(volume_urn) as volume:
+            for bevy_id in range(bevy_count):
+                bevy_urn = self.urn.Append("%08d" % bevy_id)
+                progress.start = bevy_id * bevy_size
+
+                with source.resolver.AFF4FactoryOpen(
+                        source.urn.Append("%08d" % bevy_id),
+                        version=source.version) as source_bevy:
+                    bevy_index = source._parse_bevy_index(source_bevy)
+                    source_bevy.SeekRead(0)
+                    volume.StreamAddMember(bevy_urn, source_bevy,
+                                           progress=progress,
+                                           size=source_bevy.Size())
+
+                self._write_bevy_index(volume, bevy_urn, bevy_index)
+                self.bevy_number += 1
+
+        self.size = self.writeptr = source.Size()
+        self._write_metadata()
+
     def Write(self, data):
         #hexdump(data)
         self.MarkDirty()
@@ -262,6 +321,8 @@ class AFF4Image(aff4.AFF4Stream):
             self.bevy.append(chunk)
             self.bevy_length += self.chunk_size
 
+        self.bevy_checksum.Update(self.bevy[-1])
+
         #self.bevy_index.append((bevy_offset, len(compressed_chunk)))
         #self.bevy.append(compressed_chunk)
         #self.bevy_length += len(compressed_chunk)
@@ -286,7 +347,10 @@ class AFF4Image(aff4.AFF4Stream):
             self._write_bevy_index(volume, bevy_urn, self.bevy_index, flush=True)
 
             with volume.CreateMember(bevy_urn) as bevy:
-                bevy.Write(b"".join(self.bevy))
+                content = b"".join(self.bevy)
+                bevy.Write(content)
+                if self.bevy_checksum.length == len(content):
+                    bevy.SetChecksum(self.bevy_checksum.crc32)
 
                 # We dont need to hold these in memory any more.
                 bevy.FlushAndClose()
@@ -298,6 +362,7 @@ class AFF4Image(aff4.AFF4Stream):
         self.bevy = []
         self.bevy_index = []
         self.bevy_length = 0
+        self.bevy_checksum = zip.CRC32Folder()
 
     def _write_metadata(self):
         volume_urn = self.resolver.GetUnique(lexicon.transient_graph, self.urn, lexicon.AFF4_STORED)
@@ -317,6 +382,23 @@ class AFF4Image(aff4.AFF4Stream):
             self.urn, lexicon.AFF4_IMAGE_COMPRESSION,
             rdfvalue.URN(self.compression))
 
+    def Checkpoint(self):
+        """Record metadata covering the bevies already written.
+
+        Called by the volume when it writes a checkpoint. The stream is only
+        readable up to the end of the last complete bevy, so that is the size
+        we record; Flush() later records the real one.
+        """
+        if not self.IsDirty():
+            return
+
+        self._write_metadata()
+
+        volume_urn = self.resolver.GetUnique(lexicon.transient_graph, self.urn, lexicon.AFF4_STORED)
+        durable_size = self.bevy_number * self.chunks_per_segment * self.chunk_size
+        self.resolver.Set(volume_urn, self.urn, lexicon.AFF4_STREAM_SIZE,
+                          rdfvalue.XSDInteger(durable_size))
+
     def FlushBuffers(self):
         if self.IsDirty():
             # Flush the last chunk.
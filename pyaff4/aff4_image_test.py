@@ -20,6 +20,7 @@ from builtins import range
 import os
 import io
 import unittest
+import zipfile
 
 from pyaff4 import aff4_image
 from pyaff4 import data_store
@@ -124,6 +125,62 @@ class AFF4ImageTest(unittest.TestCase):
                 b"Hello world 04!Hello world 05!Hello worl",
                 image_3.Read(100))
 
+    def testChecksums(self):
+        # The bevies' CRC32s are folded from those of their chunks, by both
+        # Write() and WriteStream().
+        with zipfile.ZipFile(self.filename) as z:
+            self.assertTrue([x for x in z.namelist() if x.endswith("/00000000")])
+            self.assertIsNone(z.testzip())
+
+    def testTransplant(self):
+        version = container.Version(0, 1, "pyaff4")
+        filename = tempfile.gettempdir() + "/aff4_image_test_copy.zip"
+        filename_urn = rdfvalue.URN.FromFileName(filename)
+        try:
+            with data_store.MemoryDataStore() as resolver:
+                with zip.ZipFile.NewZipFile(resolver, version, self.filename_urn) as source_volume:
+                    source_volume_urn = source_volume.urn
+
+                resolver.Set(lexicon.transient_graph, filename_urn, lexicon.AFF4_STREAM_WRITE_MODE,
+                             rdfvalue.XSDString("truncate"))
+                with zip.ZipFile.NewZipFile(resolver, version, filename_urn) as volume:
+                    volume_urn = volume.urn
+                    copy_urn = volume.urn.Append("copy")
+                    with resolver.AFF4FactoryOpen(self.image_urn) as source:
+                        # Compressed chunks are copied, not decompressed.
+                        def doDecompress(cbuffer, chunk_id):
+                            self.fail("Chunk %d decompressed" % chunk_id)
+                        source.doDecompress = doDecompress
+
+                        with aff4_image.AFF4Image.NewAFF4Image(
+                                resolver, copy_urn, volume_urn) as copy:
+                            copy.chunk_size = 10
+                            copy.chunks_per_segment = 3
+                            copy.WriteStream(source)
+
+                        del source.doDecompress
+
+            with data_store.MemoryDataStore() as resolver:
+                with zip.ZipFile.NewZipFile(resolver, version, self.filename_urn):
+                    pass
+                with zip.ZipFile.NewZipFile(resolver, version, filename_urn):
+                    pass
+
+                with resolver.AFF4FactoryOpen(self.image_urn) as source:
+                    expected = source.Read(source.Size())
+
+                with resolver.AFF4FactoryOpen(copy_urn) as copy:
+                    self.assertEquals(copy.Size(), 1500)
+                    self.assertEquals(copy.Read(copy.Size()), expected)
+
+                    bevy_urn = copy_urn.Append("00000049")
+                    with resolver.AFF4FactoryOpen(bevy_urn) as bevy:
+                        with resolver.AFF4FactoryOpen(self.image_urn.Append("00000049")) as source_bevy:
+                            self.assertEquals(bevy.Read(bevy.Size()),
+                                              source_bevy.Read(source_bevy.Size()))
+        finally:
+            os.unlink(filename)
+
 
 if __name__ == '__main__':
     #logging.getLogger().setLevel(logging.DEBUG)
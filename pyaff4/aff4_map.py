@@ -17,8 +17,11 @@ from __future__ import print_function
 from __future__ import unicode_literals
 from builtins import str
 from builtins import object
+from builtins import range as xrange
+from builtins import zip
+import array
+import bisect
 import collections
-import intervaltree
 import logging
 import struct
 import sys
@@ -105,6 +108,345 @@ class Range(collections.namedtuple(
         return self._replace(length=self.length - adjustment)
 
 
+# Serialized ranges are converted this many at a time.
+RECORD_BATCH = 65536
+
+try:
+    array.array("Q")
+    _UINT64 = "Q"
+except ValueError:
+    # Python 2 has no "Q" typecode.
+    _UINT64 = "L"
+
+
+RECORD_SIZE = struct.calcsize(Range.format_str)
+
+
+def _UnpackRecords(data, fields=(0, 1, 2, 3)):
+    """Unpack serialized Range records into map_offset, length, target_offset
+    and target_id arrays.
+
+    fields gives the position of each of these in a record.
+    """
+    count = len(data) // RECORD_SIZE
+
+    # Unpack a batch of records at once and slice out the columns, rather
+    # than unpacking record by record.
+    columns = [array.array(_UINT64), array.array(_UINT64),
+               array.array(_UINT64), array.array("I")]
+    for start in xrange(0, count, RECORD_BATCH):
+        batch = min(RECORD_BATCH, count - start)
+        values = struct.unpack_from(
+            "<" + Range.format_str[1:] * batch, data, start * RECORD_SIZE)
+        for column, field in zip(columns, fields):
+            column.extend(values[field::4])
+
+    return columns
+
+
+def _Continues(range, following):
+    """Is following the contiguous continuation of range?"""
+    return (range.map_end == following.map_offset and
+            range.target_id == following.target_id and
+            range.target_offset + range.length == following.target_offset)
+
+
+class RangeMap(object):
+    """Non-overlapping Ranges, held in parallel arrays sorted by map offset.
+
+    This takes a few dozen bytes per range rather than several objects, and
+    lookups bisect the map offsets.
+    """
+
+    def __init__(self):
+        self.clear()
+
+    def clear(self):
+        self.map_offsets = array.array(_UINT64)
+        self.lengths = array.array(_UINT64)
+        self.target_offsets = array.array(_UINT64)
+        self.target_ids = array.array("I")
+
+    def __len__(self):
+        return len(self.map_offsets)
+
+    def __getitem__(self, index):
+        return Range(self.map_offsets[index], self.lengths[index],
+                     self.target_offsets[index], self.target_ids[index])
+
+    def __iter__(self):
+        for values in zip(self.map_offsets, self.lengths,
+                          self.target_offsets, self.target_ids):
+            yield Range(*values)
+
+    def end(self):
+        if not self.map_offsets:
+            return 0
+        return self.map_offsets[-1] + self.lengths[-1]
+
+    def _FirstEndingAfter(self, offset):
+        """Index of the first range which ends after offset."""
+        index = bisect.bisect_right(self.map_offsets, offset) - 1
+        if index < 0 or self.map_offsets[index] + self.lengths[index] <= offset:
+            index += 1
+        return index
+
+    def Overlapping(self, start, end):
+        """Returns the ranges overlapping [start, end), in order."""
+        result = []
+        index = self._FirstEndingAfter(start)
+        while index < len(self.map_offsets) and self.map_offsets[index] < end:
+            result.append(self[index])
+            index += 1
+
+        return result
+
+    def Add(self, range):
+        """Add a range, replacing whatever it overlaps.
+
+        Ranges it overlaps or touches are merged with it if they continue the
+        same target contiguously, otherwise they are clipped.
+        """
+        if range.length == 0:
+            return
+
+        if range.map_offset >= self.end():
+            self.Append(*range)
+            return
+
+        offsets = self.map_offsets
+
+        # Ranges from lo to hi overlap or touch the new range.
+        lo = self._FirstEndingAfter(range.map_offset - 1) if range.map_offset else 0
+        hi = bisect.bisect_right(offsets, range.map_end)
+
+        before = []
+        after = []
+        if lo < hi:
+            left = self[lo]
+            merged_left = False
+            try:
+                range = range.Merge(left)
+                merged_left = True
+
+                # The merged range may now touch the next range.
+                hi = bisect.bisect_right(offsets, range.map_end)
+            except ValueError:
+                if left.map_offset < range.map_offset:
+                    before.append(left.right_clip(range.map_offset))
+
+            if hi - 1 > lo or not merged_left:
+                right = self[hi - 1]
+                try:
+                    range = range.Merge(right)
+                except ValueError:
+                    if right.map_end > range.map_end:
+                        after.append(right.left_clip(range.map_end))
+
+        self._Splice(lo, hi, before + [range] + after)
+
+    def Append(self, map_offset, length, target_offset, target_id):
+        """Add a range starting at or after the end of the map.
+
+        This is the fast path for ranges arriving in order - the range is
+        merged with the last one if it continues it.
+        """
+        if length == 0:
+            return
+
+        lengths = self.lengths
+        if self.map_offsets:
+            last_end = self.map_offsets[-1] + lengths[-1]
+            if map_offset < last_end:
+                raise ValueError("Range does not follow the end of the map")
+
+            if (map_offset == last_end and self.target_ids[-1] == target_id and
+                    self.target_offsets[-1] + lengths[-1] == target_offset):
+                lengths[-1] += length
+                return
+
+        self.map_offsets.append(map_offset)
+        lengths.append(length)
+        self.target_offsets.append(target_offset)
+        self.target_ids.append(target_id)
+
+    def _Splice(self, lo, hi, ranges):
+        self.map_offsets[lo:hi] = array.array(_UINT64, [x.map_offset for x in ranges])
+        self.lengths[lo:hi] = array.array(_UINT64, [x.length for x in ranges])
+        self.target_offsets[lo:hi] = array.array(_UINT64, [x.target_offset for x in ranges])
+        self.target_ids[lo:hi] = array.array("I", [x.target_id for x in ranges])
+
+    def Load(self, data, fields=(0, 1, 2, 3), merge_adjacent=False):
+        """Replace the ranges with serialized Range records.
+
+        Args:
+          data: Concatenated Range.format_str records.
+          fields: The positions of map_offset, length, target_offset and
+            target_id in each record.
+          merge_adjacent: Merge records which continue the previous one.
+        """
+        columns = _UnpackRecords(data, fields)
+
+        self.clear()
+        map_offsets = self.map_offsets
+        lengths = self.lengths
+        target_offsets = self.target_offsets
+        target_ids = self.target_ids
+
+        last_end = 0
+        for map_offset, length, target_offset, target_id in zip(*columns):
+            if length == 0:
+                continue
+
+            if map_offset < last_end:
+                # Out of order or overlapping - fall back to adding the
+                # records one at a time, later records taking precedence.
+                LOGGER.debug("Map records are not sorted, sorting them")
+                self.clear()
+                for values in zip(*columns):
+                    self.Add(Range(*values))
+                return
+
+            if (merge_adjacent and map_offsets and map_offset == last_end and
+                    target_ids[-1] == target_id and
+                    target_offsets[-1] + lengths[-1] == target_offset):
+                lengths[-1] += length
+            else:
+                map_offsets.append(map_offset)
+                lengths.append(length)
+                target_offsets.append(target_offset)
+                target_ids.append(target_id)
+
+            last_end = map_offset + length
+
+    def Serialize(self):
+        """Returns the ranges as concatenated Range.format_str records."""
+        result = []
+        for start in xrange(0, len(self), RECORD_BATCH):
+            end = start + RECORD_BATCH
+            map_offsets = self.map_offsets[start:end]
+            values = [0] * (4 * len(map_offsets))
+            values[0::4] = map_offsets
+            values[1::4] = self.lengths[start:end]
+            values[2::4] = self.target_offsets[start:end]
+            values[3::4] = self.target_ids[start:end]
+            result.append(struct.pack(
+                "<" + Range.format_str[1:] * len(map_offsets), *values))
+
+        return b"".join(result)
+
+
+class PagedRangeMap(object):
+    """A read-only view of the ranges in a map segment.
+
+    The segment is a sorted array of fixed size records, so it is binary
+    searched a page at a time instead of being loaded. Adjacent records
+    which continue each other are coalesced as they are read.
+    """
+
+    # Records per page, and pages kept in memory.
+    page_records = 4096
+    max_pages = 64
+
+    def __init__(self, resolver, map_urn, size, version=None,
+                 fields=(0, 1, 2, 3), merge_adjacent=False):
+        self.resolver = resolver
+        self.map_urn = map_urn
+        self.version = version
+        self.fields = fields
+        self.merge_adjacent = merge_adjacent
+        self.count = size // RECORD_SIZE
+        self.pages = collections.OrderedDict()
+
+    def __len__(self):
+        return self.count
+
+    def _Page(self, page_number):
+        page = self.pages.pop(page_number, None)
+        if page is None:
+            page_size = self.page_records * RECORD_SIZE
+            with self.resolver.AFF4FactoryOpen(
+                    self.map_urn, version=self.version) as map_stream:
+                map_stream.SeekRead(page_number * page_size)
+                page = _UnpackRecords(map_stream.Read(page_size), self.fields)
+
+            if len(self.pages) >= self.max_pages:
+                self.pages.popitem(last=False)
+
+        self.pages[page_number] = page
+        return page
+
+    def _MapOffset(self, index):
+        return self._Page(index // self.page_records)[0][index % self.page_records]
+
+    def __getitem__(self, index):
+        if index < 0:
+            index += self.count
+        page = self._Page(index // self.page_records)
+        index %= self.page_records
+        return Range(page[0][index], page[1][index], page[2][index], page[3][index])
+
+    def _Ranges(self, index, end=None):
+        """Yield ranges from the index'th record until one starts at end."""
+        last = None
+        while index < self.count:
+            range = self[index]
+            index += 1
+            if end is not None and range.map_offset >= end:
+                break
+
+            if range.length == 0:
+                continue
+
+            if last is not None and self.merge_adjacent and _Continues(last, range):
+                last = last._replace(length=last.length + range.length)
+                continue
+
+            if last is not None:
+                yield last
+            last = range
+
+        if last is not None:
+            yield last
+
+    def __iter__(self):
+        return self._Ranges(0)
+
+    def end(self):
+        index = self.count - 1
+        while index >= 0:
+            range = self[index]
+            if range.length:
+                return range.map_end
+            index -= 1
+
+        return 0
+
+    def Overlapping(self, start, end):
+        """Returns the ranges overlapping [start, end), in order."""
+        # Find the last record starting at or before start.
+        lo = 0
+        hi = self.count
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self._MapOffset(mid) <= start:
+                lo = mid + 1
+            else:
+                hi = mid
+
+        index = max(lo - 1, 0)
+        return [x for x in self._Ranges(index, end) if x.map_end > start]
+
+    def Materialize(self):
+        """Load all the ranges into a RangeMap which can be modified."""
+        with self.resolver.AFF4FactoryOpen(
+                self.map_urn, version=self.version) as map_stream:
+            result = RangeMap()
+            result.Load(map_stream.Read(map_stream.Size()), fields=self.fields,
+                        merge_adjacent=self.merge_adjacent)
+            return result
+
+
 class _MapStreamHelper(object):
 
     def __init__(self, resolver, source, destination):
@@ -113,7 +455,7 @@ class _MapStreamHelper(object):
         self.readptr = 0
         self.source = source
         self.destination = destination
-        self.source_ranges = sorted(source.tree)
+        self.source_ranges = source.GetRanges()
         if not self.source_ranges:
             raise RuntimeError("Source map is empty when calling WriteStream()")
         self.current_range_idx = 0
@@ -133,7 +475,7 @@ class _MapStreamHelper(object):
             if self.current_range_idx >= len(self.source_ranges):
                 break
 
-            current_range = self.source_ranges[self.current_range_idx].data
+            current_range = self.source_ranges[self.current_range_idx]
 
             # Add a range if we are at the beginning of a range.
             if self.range_offset == 0:
@@ -174,13 +516,93 @@ class _MapStreamHelper(object):
 
         return result
 
+def _ContiguousRuns(extents):
+    """Group (target offset, result offset, length) extents, sorted by target
+    offset, into runs which can be read from the target at once."""
+    run = []
+    run_end = None
+    for extent in extents:
+        if run and extent[0] > run_end:
+            yield run
+            run = []
+
+        if not run:
+            run_end = extent[0]
+        run.append(extent)
+        run_end = max(run_end, extent[0] + extent[2])
+
+    if run:
+        yield run
+
+
+def _PlanRead(range_map, start, length, resolve_target):
+    """Plans a read of [start, start + length) from the ranges in range_map.
+
+    resolve_target maps a target id to its (stream, offset, length), as
+    AFF4Map._ResolveTarget does. Returns a zeroed bytearray for the result
+    and, for each target stream, the extents to copy into it as
+    (target offset, result offset, length), sorted by target offset.
+    """
+    ranges = range_map.Overlapping(start, start + length)
+    if not ranges:
+        return bytearray(), {}
+
+    # The result ends with the last range - gaps before it are zeros.
+    end = min(start + length, ranges[-1].map_end)
+    result = bytearray(end - start)
+
+    plan = {}
+    for range in ranges:
+        extent_start = max(range.map_offset, start)
+        extent_length = min(range.map_end, end) - extent_start
+        target_offset = range.target_offset_at_map_offset(extent_start)
+
+        target, base, limit = resolve_target(range.target_id)
+        if limit is not None:
+            extent_length = max(0, min(extent_length, limit - target_offset))
+
+        plan.setdefault(target, []).append((
+            base + target_offset, extent_start - start, extent_length))
+
+    for extents in plan.values():
+        extents.sort()
+
+    return result, plan
+
+
+def _ReadExtents(target_stream, extents, result):
+    """Reads the planned extents from target_stream into result.
+
+    Returns where result has to be cut short because the extent ending it
+    could not be read in full, otherwise len(result).
+    """
+    result_end = len(result)
+    for run in _ContiguousRuns(extents):
+        run_start = run[0][0]
+        run_end = max(x[0] + x[2] for x in run)
+        target_stream.SeekRead(run_start)
+        buffer = target_stream.Read(run_end - run_start) or b""
+
+        # Scatter the run into the result.
+        for target_offset, result_offset, extent_length in run:
+            data = buffer[target_offset - run_start:
+                          target_offset - run_start + extent_length]
+            result[result_offset:result_offset + len(data)] = data
+            if (len(data) < extent_length and
+                    result_offset + extent_length == len(result)):
+                result_end = result_offset + len(data)
+
+    return result_end
+
+
 class AFF4Map(aff4.AFF4Stream):
 
     def __init__(self, *args, **kwargs):
         super(AFF4Map, self).__init__(*args, **kwargs)
         self.targets = []
         self.target_idx_map = {}
-        self.tree = intervaltree.IntervalTree()
+        self.resolved_targets = {}
+        self.range_map = RangeMap()
         self.last_target = None
         try:
             self.version = kwargs["version"]
@@ -204,9 +626,32 @@ class AFF4Map(aff4.AFF4Stream):
             res.properties.writable = volume.properties.writable
             return res
 
+    # The positions of map_offset, length, target_offset and target_id in a
+    # serialized map record.
+    record_fields = (0, 1, 2, 3)
+
     def deserializeMapPoint(self, data):
         return Range.FromSerialized(data)
 
+    def _LoadRanges(self, map_stream, merge_adjacent=False, version=None):
+        if not map_stream.properties.writable:
+            # A read-only map is searched in place rather than loaded.
+            self.range_map = PagedRangeMap(
+                self.resolver, map_stream.urn, map_stream.Size(),
+                version=version, fields=self.record_fields,
+                merge_adjacent=merge_adjacent)
+            return
+
+        self.range_map = RangeMap()
+        self.range_map.Load(map_stream.Read(map_stream.Size()),
+                            fields=self.record_fields,
+                            merge_adjacent=merge_adjacent)
+
+    def _MutableRanges(self):
+        if isinstance(self.range_map, PagedRangeMap):
+            self.range_map = self.range_map.Materialize()
+        return self.range_map
+
     def LoadFromURN(self):
         map_urn = self.urn.Append("map")
         map_idx_urn = self.urn.Append("idx")
@@ -219,64 +664,50 @@ class AFF4Map(aff4.AFF4Stream):
                                 for x in map_idx.Read(map_idx.Size()).splitlines()]
 
             with self.resolver.AFF4FactoryOpen(map_urn) as map_stream:
-                read_length = struct.calcsize(Range.format_str)
-                while 1:
-                    data = map_stream.Read(read_length)
-                    if not data:
-                        break
-                    range = self.deserializeMapPoint(data)
-                    if range.length > 0:
-                        self.tree.addi(range.map_offset, range.map_end, range)
-
+                self._LoadRanges(map_stream)
 
         except IOError:
             traceback.print_exc()
             pass
 
     def Read(self, length):
-        result = b""
-        for interval in sorted(self.tree[self.readptr:self.readptr+length]):
-            range = interval.data
-
-            # The start of the range is ahead of us - we pad with zeros.
-            if range.map_offset > self.readptr:
-                padding = min(length, range.map_offset - self.readptr)
-                result += b"\x00" * padding
-                self.readptr += padding
-                length -= padding
+        result, plan = _PlanRead(self.range_map, self.readptr, length,
+                                 self._ResolveTarget)
 
-            if length == 0:
-                break
-
-            target = self.targets[range.target_id]
-            length_to_read_in_target = min(length, range.map_end - self.readptr)
-
-            bytes_read = 0
+        # Where the result is cut short if the last range can not be read.
+        result_end = len(result)
+        for target, extents in plan.items():
             try:
                 with self.resolver.AFF4FactoryOpen(target, version=self.version) as target_stream:
-                    target_stream.SeekRead(
-                        range.target_offset_at_map_offset(self.readptr))
-
-                    buffer = target_stream.Read(length_to_read_in_target)
-                    if buffer == None:
-                        bytes_read = 0
-                    else:
-                        bytes_read = len(buffer)
-                        result += buffer
+                    result_end = min(result_end, _ReadExtents(
+                        target_stream, extents, result))
 
             except IOError:
                 traceback.print_exc()
                 LOGGER.debug("*** Stream %s not found. Substituting zeros. ***",
-                             target_stream)
-                result += b"\x00" * length_to_read_in_target
-            finally:
-                length -= bytes_read
-                self.readptr += bytes_read
+                             target)
+
+        result = bytes(result[:result_end])
+        self.readptr += len(result)
+        return result
+
+    def _ResolveTarget(self, target_id):
+        """Returns the (stream, offset, length) the target refers to.
+
+        Hash and byte range targets (e.g. from hash based logical images)
+        resolve to a slice of the block store, which is then read directly.
+        Other targets are read as they are, with a length of None.
+        """
+        result = self.resolved_targets.get(target_id)
+        if result is None:
+            target = self.targets[target_id]
+            result = self.resolver.ResolveReference(target) or (target, 0, None)
+            self.resolved_targets[target_id] = result
 
         return result
 
     def Size(self):
-        return self.tree.end()
+        return self.range_map.end()
 
     def AddRange(self, map_offset, target_offset, length, target):
         """Add a new mapping range."""
@@ -288,97 +719,87 @@ class AFF4Map(aff4.AFF4Stream):
             target_id = self.target_idx_map[target] = len(self.targets)
             self.targets.append(target)
 
-        range = Range(map_offset, length, target_offset, target_id)
-
-        # Try to merge with the left interval.
-        left_interval = self.tree[range.map_offset-1]
-        if left_interval:
-            left_interval = left_interval.pop()
-
-            try:
-                range = range.Merge(left_interval.data)
-            except ValueError:
-                left_range = left_interval.data.right_clip(range.map_offset)
-                # If the interval has not changed, then adding it to three will
-                # not result in an additional interval (since the tree tries to
-                # de-dup intervals). Therefore we will end up removing the
-                # interval completely below. Therefore if clipping the interval
-                # does not change it, we must discard the interval completely.
-                if left_range == left_interval.data:
-                    left_interval = None
-                else:
-                    self.tree.addi(
-                        left_range.map_offset,
-                        left_range.map_end,
-                        left_range)
-
-        # Try to merge with the right interval.
-        right_interval = self.tree[range.map_end+1]
-        if right_interval:
-            right_interval = right_interval.pop()
+        self._MutableRanges().Add(
+            Range(map_offset, length, target_offset, target_id))
+        self.MarkDirty()
 
-            try:
-                range = range.Merge(right_interval.data)
-            except ValueError:
-                right_range = right_interval.data.left_clip(range.map_end)
-                if right_range == right_interval.data:
-                    right_interval = None
-                else:
-                    self.tree.addi(
-                        right_range.map_offset,
-                        right_range.map_end,
-                        right_range)
-
-        # Remove the left and right intervals now. This must be done at this
-        # point to allow for the case where left interval == right interval
-        # (i.e. the same interval intersects both start and end).
-        if left_interval:
-            self.tree.remove(left_interval)
-
-        if right_interval and right_interval != left_interval:
-            self.tree.remove(right_interval)
-
-        # Remove any intervals inside this range.
-        self.tree.remove_envelop(range.map_offset, range.map_end)
-
-        # Add the new interval.
-        if range.length > 0:
-            self.tree[range.map_offset:range.map_end] = range
+    def AddRanges(self, ranges):
+        """Add many mapping ranges at once.
 
-        self.MarkDirty()
+        ranges yields (map_offset, target_offset, length, target) tuples, as
+        passed to AddRange(). Ranges starting at or after the end of the map
+        are appended directly, so a map built in order costs little per range.
+        Any others are merged as by AddRange().
+        """
+        range_map = self._MutableRanges()
+        target_idx_map = self.target_idx_map
+        target = target_id = None
+        end = range_map.end()
+        for map_offset, target_offset, length, range_target in ranges:
+            if range_target is not target:
+                rdfvalue.AssertURN(range_target)
+                target = range_target
+                target_id = target_idx_map.get(target)
+                if target_id is None:
+                    target_id = target_idx_map[target] = len(self.targets)
+                    self.targets.append(target)
+
+            if map_offset >= end:
+                range_map.Append(map_offset, length, target_offset, target_id)
+                end = map_offset + length if length else end
+            else:
+                range_map.Add(Range(map_offset, length, target_offset, target_id))
+                end = range_map.end()
+
+        if target is not None:
+            self.last_target = target
+            self.MarkDirty()
+
+    def _write_map_segments(self):
+        # Get the volume we are stored on.
+        volume_urn = self.resolver.GetUnique(lexicon.transient_graph, self.urn, lexicon.AFF4_STORED)
+        with self.resolver.AFF4FactoryOpen(volume_urn) as volume:
+            # Replace the segments written by an earlier checkpoint.
+            map_urn = self.urn.Append("map")
+            idx_urn = self.urn.Append("idx")
+            existing = [x for x in (map_urn, idx_urn) if volume.ContainsMember(x)]
+            if existing:
+                volume.RemoveMembers(existing)
+
+            with volume.CreateMember(map_urn) as map_stream:
+                map_stream.Write(self.range_map.Serialize())
+
+            self.resolver.Close(map_stream)
+            with volume.CreateMember(idx_urn) as idx_stream:
+                idx_stream.Write(b"\n".join(
+                    [x.SerializeToString().encode("utf-8") for x in self.targets]))
+
+            self.resolver.Close(idx_stream)
+            #for target in self.targets:
+            #    # for cross containterne references, opening the target wont work
+            #    # so we enclose this in a try/catch
+            #    try:
+            #        # dont do this for hash references
+            #        if target.SerializeToString().startswith("aff4:sha512"):
+            #            continue
+            #
+            #        # Looks like the following is API misuse - we should let the Close happen automatically
+            #        #with self.resolver.AFF4FactoryOpen(target) as stream:
+            #        #    traceback.print_exc()
+            #        #    pass
+            #        #self.resolver.Close(stream)
+            #    except:
+            #        traceback.print_exc()
+            #        pass
+
+    def Checkpoint(self):
+        """Write the ranges added so far, for the volume's checkpoint."""
+        if self.IsDirty():
+            self._write_map_segments()
 
     def Flush(self):
         if self.IsDirty():
-            # Get the volume we are stored on.
-            volume_urn = self.resolver.GetUnique(lexicon.transient_graph, self.urn, lexicon.AFF4_STORED)
-            with self.resolver.AFF4FactoryOpen(volume_urn) as volume:
-                with volume.CreateMember(self.urn.Append("map")) as map_stream:
-                    for interval in self.tree:
-                        map_stream.Write(interval.data.Serialize())
-
-                self.resolver.Close(map_stream)
-                with volume.CreateMember(self.urn.Append("idx")) as idx_stream:
-                    idx_stream.Write(b"\n".join(
-                        [x.SerializeToString().encode("utf-8") for x in self.targets]))
-
-                self.resolver.Close(idx_stream)
-                #for target in self.targets:
-                #    # for cross containterne references, opening the target wont work
-                #    # so we enclose this in a try/catch
-                #    try:
-                #        # dont do this for hash references
-                #        if target.SerializeToString().startswith("aff4:sha512"):
-                #            continue
-                #
-                #        # Looks like the following is API misuse - we should let the Close happen automatically
-                #        #with self.resolver.AFF4FactoryOpen(target) as stream:
-                #        #    traceback.print_exc()
-                #        #    pass
-                #        #self.resolver.Close(stream)
-                #    except:
-                #        traceback.print_exc()
-                #        pass
-
+            self._write_map_segments()
 
         return super(AFF4Map, self).Flush()
 
@@ -389,15 +810,52 @@ class AFF4Map(aff4.AFF4Stream):
             # helper, otherwise we just copy the source into our data stream and
             # create a single range over the whole stream.
             if isinstance(source, AFF4Map):
-                data_stream.WriteStream(
-                    _MapStreamHelper(self.resolver, source, self), progress)
+                if not self._CopyPackedTarget(source, data_stream, progress):
+                    data_stream.WriteStream(
+                        _MapStreamHelper(self.resolver, source, self), progress)
             else:
+                start = data_stream.Size()
                 data_stream.WriteStream(source, progress)
 
                 # Add a single range to cover the bulk of the image.
-                self.AddRange(0, data_stream.Size(), data_stream.Size(),
+                self.AddRange(0, start, data_stream.Size() - start,
                               data_stream.urn)
 
+    def _CopyPackedTarget(self, source, data_stream, progress):
+        """Copy a map whose ranges lay out a single target from its start.
+
+        The data stream is then a copy of the whole target, which an image
+        stream can take over bevy by bevy (see AFF4Image.WriteStream) rather
+        than reading it through the map. Returns False if source is not laid
+        out like this.
+        """
+        ranges = source.GetRanges()
+        if not ranges or any(x.target_id != ranges[0].target_id for x in ranges):
+            return False
+
+        expected_offset = 0
+        for range in ranges:
+            if range.target_offset != expected_offset:
+                return False
+            expected_offset += range.length
+
+        try:
+            target_stream = source.resolver.AFF4FactoryOpen(
+                source.targets[ranges[0].target_id], version=source.version)
+        except IOError:
+            return False
+
+        with target_stream:
+            if target_stream.Size() != expected_offset:
+                return False
+
+            target_stream.SeekRead(0)
+            data_stream.WriteStream(target_stream, progress)
+
+        self.AddRanges((x.map_offset, x.target_offset, x.length, data_stream.urn)
+                       for x in ranges)
+        return True
+
     def GetBackingStream(self):
         """Returns the URN of the backing data stream of this map."""
         if self.targets:
@@ -446,12 +904,13 @@ class AFF4Map(aff4.AFF4Stream):
         return len(data)
 
     def GetRanges(self):
-        return sorted([x.data for x in self.tree])
+        return list(self.range_map)
 
     def Clear(self):
         self.targets = []
         self.target_idx_map.clear()
-        self.tree.clear()
+        self.resolved_targets.clear()
+        self.range_map = RangeMap()
 
     def Close(self):
         pass
@@ -459,6 +918,7 @@ class AFF4Map(aff4.AFF4Stream):
 
 # Rekall/libAFF4 accidentally swapped the struct in Evimetry's update map
 class ScudetteAFF4Map(AFF4Map):
+    record_fields = (0, 2, 1, 3)
 
     def deserializeMapPoint(self, data):
         # swap them back
@@ -479,77 +939,39 @@ class AFF4Map2(AFF4Map):
                                 for x in map_idx.Read(map_idx.Size()).splitlines()]
 
             with self.resolver.AFF4FactoryOpen(map_urn, version=self.version) as map_stream:
-                format_str = "<QQQI"
-                bufsize = map_stream.Size()
-                buf = map_stream.Read(bufsize)
-
-                read_length = struct.calcsize(Range.format_str)
-
-                lastUpperOffset = -1
-                lastLowerOffset =  -1
-                lastLength = -1
-                lastTarget = -1
-
-                offset = 0
-                while offset < bufsize:
-                    (upperOffset, length, lowerOffset, target) = struct.unpack_from(format_str, buf, offset)
-                    offset += read_length
-
-                    if lastUpperOffset == -1:
-                        lastUpperOffset = upperOffset
-                        lastLowerOffset = lowerOffset
-                        lastLength = length
-                        lastTarget = target
-                        continue
-
-                    if lastUpperOffset + lastLength == upperOffset and lastLowerOffset + lastLength == lowerOffset and lastTarget == target:
-                        # these are adjoining
-                        lastLength = lastLength + length
-                        continue
-                    else:
-                        range = Range.FromList([lastUpperOffset, lastLength, lastLowerOffset, lastTarget])
-                        if range.length > 0:
-                            self.tree.addi(range.map_offset, range.map_end, range)
-                        lastUpperOffset = upperOffset
-                        lastLowerOffset = lowerOffset
-                        lastLength = length
-                        lastTarget = target
-
-                range = Range.FromList([lastUpperOffset, lastLength, lastLowerOffset, lastTarget])
-                if range.length > 0:
-                    self.tree.addi(range.map_offset, range.map_end, range)
+                self._LoadRanges(map_stream, merge_adjacent=True,
+                                 version=self.version)
 
         except IOError:
             # we get IOErrors here on creation from scratch. This is safe and expected.
             pass
 
-def isByteRangeARN(urn):
+def parseByteRangeARN(urn):
+    """Split a byte range ARN (aff4://stream[0x10:0x20]) into the target
+    stream, offset and length. Returns None if urn is not one."""
     if not urn.startswith("aff4://"):
-        return False
+        return None
     if not urn.endswith("]"):
-        return False
+        return None
     try:
         (target, rangepair) = urn.split("[")
         rangepair = rangepair[0:len(rangepair) - 1]
         (offset, length) = rangepair.split(":")
 
-        offset = int(offset, 16)
-        length = int(length, 16)
-        return True
+        return (target, int(offset, 16), int(length, 16))
     except:
-        return False
+        return None
+
+def isByteRangeARN(urn):
+    return parseByteRangeARN(urn) is not None
 
 class ByteRangeARN(aff4.AFF4Stream):
 
     def __init__(self, version, resolver=None, urn=None):
         super(ByteRangeARN, self).__init__(
             resolver=resolver, urn=urn)
-        (target, rangepair) = urn.SerializeToString().split("[")
-        rangepair = rangepair[0:len(rangepair)-1]
-        (offset, length) = rangepair.split(":")
-        self.target = target
-        self.offset = int(offset,16)
-        self.length = int(length,16)
+        (self.target, self.offset, self.length) = parseByteRangeARN(
+            urn.SerializeToString())
         self.version = version
 
 
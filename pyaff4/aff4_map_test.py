@@ -181,6 +181,112 @@ class AFF4MapTest(unittest.TestCase):
             self.assertEquals(len(ranges), 1)
             self.assertEquals(ranges[0].length, 40)
 
+    def testRangeMapLoad(self):
+        ranges = [aff4_map.Range(0, 10, 100, 0),
+                  aff4_map.Range(10, 10, 110, 0),
+                  aff4_map.Range(20, 0, 0, 1),
+                  aff4_map.Range(30, 10, 0, 1)]
+        data = b"".join(x.Serialize() for x in ranges)
+
+        range_map = aff4_map.RangeMap()
+        range_map.Load(data)
+        self.assertEquals(len(range_map), 3)
+        self.assertEquals(range_map.Serialize(),
+                          b"".join(ranges[i].Serialize() for i in (0, 1, 3)))
+
+        # Adjacent records continuing the same target are merged.
+        range_map.Load(data, merge_adjacent=True)
+        self.assertEquals(len(range_map), 2)
+        self.assertEquals(range_map[0].length, 20)
+        self.assertEquals(range_map.end(), 40)
+        self.assertEquals([x.map_offset for x in range_map.Overlapping(15, 31)],
+                          [0, 30])
+
+        # Unsorted, overlapping records are sorted and clipped.
+        range_map.Load(ranges[3].Serialize() + aff4_map.Range(0, 35, 0, 2).Serialize())
+        self.assertEquals([(x.map_offset, x.length, x.target_id) for x in range_map],
+                          [(0, 35, 2), (35, 5, 1)])
+
+    def testPagedMap(self):
+        version = container.Version(1, 1, "pyaff4")
+        target = rdfvalue.URN("aff4://target")
+        with data_store.MemoryDataStore() as resolver:
+            resolver.Set(lexicon.transient_graph, self.filename_urn, lexicon.AFF4_STREAM_WRITE_MODE,
+                         rdfvalue.XSDString("random"))
+
+            with zip.ZipFile.NewZipFile(resolver, version, self.filename_urn) as zip_file:
+                map_urn = zip_file.urn.Append("paged")
+                with aff4_map.AFF4Map.NewAFF4Map(resolver, map_urn, zip_file.urn) as image:
+                    # Sparse ranges, so each is a record of its own.
+                    for i in range(1000):
+                        image.AddRange(i * 100, i * 100 // 2, 50, target)
+
+        # Opened read-only, the map is paged in rather than loaded.
+        with data_store.MemoryDataStore() as resolver:
+            with zip.ZipFile.NewZipFile(resolver, version, self.filename_urn):
+                with resolver.AFF4FactoryOpen(map_urn) as image:
+                    self.assertTrue(isinstance(image.range_map, aff4_map.PagedRangeMap))
+                    image.range_map.page_records = 16
+
+                    ranges = image.GetRanges()
+                    self.assertEquals(ranges, list(image.range_map.Materialize()))
+                    self.assertEquals(image.Size(), 99950)
+
+                    for offset in [0, 49, 50, 160, 55555, 99949]:
+                        expected = [x for x in ranges
+                                    if x.map_end > offset and x.map_offset < offset + 300]
+                        self.assertEquals(
+                            image.range_map.Overlapping(offset, offset + 300), expected)
+
+                    # Modifying the map loads it.
+                    image.AddRange(0, 0, 10, target)
+                    self.assertTrue(isinstance(image.range_map, aff4_map.RangeMap))
+
+    def testAddRanges(self):
+        a = rdfvalue.URN("aff4://a")
+        b = rdfvalue.URN("aff4://b")
+        ranges = [(i * 20, i * 10, 10, a) for i in range(1000)]
+        ranges += [(10, 10, 10, a), (15, 0, 10, b), (20000, 10000, 10, a),
+                   (20010, 10010, 0, b)]
+
+        bulk = aff4_map.AFF4Map(data_store.MemoryDataStore())
+        bulk.AddRanges(iter(ranges))
+
+        single = aff4_map.AFF4Map(data_store.MemoryDataStore())
+        for x in ranges:
+            single.AddRange(*x)
+
+        self.assertEquals(bulk.GetRanges(), single.GetRanges())
+        self.assertEquals(bulk.targets, single.targets)
+        self.assertEquals(len(bulk.GetRanges()), 1002)
+        self.assertEquals(bulk.Size(), 20010)
+
+    def testBatchedRead(self):
+        resolver = data_store.MemoryDataStore()
+        reads = []
+
+        class CountingStream(aff4_file.AFF4MemoryStream):
+            def Read(self, length):
+                reads.append(length)
+                return super(CountingStream, self).Read(length)
+
+        with resolver.CachePut(CountingStream(resolver)) as source:
+            source.Write(b"".join(b"%04d" % i for i in range(1000)))
+
+        # Map the source in reverse order of 4 byte blocks, with a gap.
+        image = aff4_map.AFF4Map(resolver)
+        for i in range(500):
+            image.AddRange(i * 4, (999 - i) * 4, 4, source.urn)
+        image.AddRange(2004, 0, 4, source.urn)
+
+        del reads[:]
+        data = image.Read(2008)
+        expected = b"".join(b"%04d" % (999 - i) for i in range(500))
+        self.assertEquals(data, expected + b"\x00" * 4 + b"0000")
+
+        # The adjacent blocks are fetched from the source in one read.
+        self.assertEquals(sorted(reads), [4, 2000])
+
     def testCreateMapStream(self):
         resolver = data_store.MemoryDataStore()
         version = container.Version(1, 1, "pyaff4")
@@ -117,20 +117,18 @@ class Validator(object):
     def validateContainerMultiPart(self, urn_a, urn_b):
         # in this simple example, we assume that both files passed are
         # members of the Container
-        (version, lex) = container.Container.identifyURN(urn_a)
-        resolver = data_store.MemoryDataStore(lex)
-
-        with zip.ZipFile.NewZipFile(resolver, version, urn_a) as zip_filea:
-            with zip.ZipFile.NewZipFile(resolver, version, urn_b) as zip_fileb:
-                if lex == lexicon.standard:
-                    self.delegate = InterimStdValidator(resolver, lex, self.listener)
-                elif lex == lexicon.legacy:
-                    self.delegate = PreStdValidator(resolver, lex, self.listener)
-                else:
-                    raise ValueError
+        with container.ContainerSet([urn_a, urn_b]) as volumes:
+            resolver = volumes.resolver
+            lex = volumes.lexicon
+            if lex == lexicon.standard:
+                self.delegate = InterimStdValidator(resolver, lex, self.listener)
+            elif lex == lexicon.legacy:
+                self.delegate = PreStdValidator(resolver, lex, self.listener)
+            else:
+                raise ValueError
 
-                self.delegate.volume_arn = zip_filea.urn
-                self.delegate.doValidateContainer()
+            self.delegate.volume_arn = volumes.volumes[0]
+            self.delegate.doValidateContainer()
 
     def validateBlockMapHash(self, mapStreamURI, imageStreamURI):
         storedHash = next(self.resolver.QuerySubjectPredicate(
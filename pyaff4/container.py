@@ -25,6 +25,7 @@ from pyaff4 import hashes
 from pyaff4 import lexicon
 from pyaff4 import aff4_map
 from pyaff4 import rdfvalue
+from pyaff4 import triple_store
 from pyaff4 import aff4
 from pyaff4 import escaping
 from pyaff4.aff4_metadata import RDFObject
@@ -36,6 +37,7 @@ import yaml
 import uuid
 import base64
 import fastchunking
+import multiprocessing
 
 class Image(object):
     def __init__(self, image, resolver, dataStream):
@@ -99,10 +101,7 @@ class Container(object):
     @staticmethod
     def identifyURN(urn, resolver=None):
         if resolver == None:
-            if data_store.HAS_HDT:
-                resolver = data_store.HDTAssistedDataStore(lexicon.standard)
-            else:
-                resolver = data_store.MemoryDataStore(lexicon.standard)
+            resolver = data_store.IndexedDataStore(lexicon.standard)
 
         with resolver as resolver:
             with zip.ZipFile.NewZipFile(resolver, Version(0,1,"pyaff4"), urn) as zip_file:
@@ -183,11 +182,14 @@ class Container(object):
                 
 
     @staticmethod
-    def openURNtoContainer(urn, mode=None):
-            if data_store.HAS_HDT:
-                resolver = data_store.HDTAssistedDataStore(lexicon.standard)
-            else:
+    def openURNtoContainer(urn, mode=None, lazy=False):
+            if mode == "+":
                 resolver = data_store.MemoryDataStore(lexicon.standard)
+            elif lazy:
+                # Only parse the metadata the caller queries.
+                resolver = data_store.LazyDataStore(lexicon.standard)
+            else:
+                resolver = data_store.IndexedDataStore(lexicon.standard)
 
             (version, lex) = Container.identifyURN(urn, resolver=resolver)
 
@@ -272,6 +274,143 @@ class Container(object):
         else:
             return False
 
+# The lexicons a volume may be identified with. Worker processes return the
+# index, as lexicons are compared by identity.
+_LEXICONS = (lexicon.standard, lexicon.standard11, lexicon.scudette,
+             lexicon.legacy)
+
+
+class _LoadedVolume(object):
+    """The metadata of one volume, as loaded by a worker process."""
+
+    def __init__(self, resolver, volume, version, lex):
+        self.urn = volume.urn
+        self.version = version
+        self.lexicon = _LEXICONS.index(lex)
+        self.store = resolver.store
+        self.transient_store = resolver.transient_store
+        self.loadedVolumes = resolver.loadedVolumes
+        self.turtle_versions = resolver.turtle_versions
+        self.aff4NS = resolver.aff4NS
+
+        # The streams this volume holds the data of: those stored as members,
+        # or with members named after them (image bevies, map segments). The
+        # block hashes and metadata of a stream may be in other volumes too,
+        # but they have an extension.
+        names = set()
+        for member in volume.members:
+            names.add(member.value)
+            parent, _, name = member.value.rpartition("/")
+            if "." not in name:
+                names.add(parent)
+        self.streams = [x for x in self.store if x in names]
+
+    def __getstate__(self):
+        # Worker processes pass back the live triples as Columns, which
+        # pickle far smaller than the stores.
+        state = self.__dict__.copy()
+        state["store"] = triple_store.Columns(self.store)
+        state["transient_store"] = triple_store.Columns(self.transient_store)
+        return state
+
+
+def _LoadVolume(urn):
+    urn = rdfvalue.URN(urn)
+    resolver = data_store.MemoryDataStore(lexicon.standard)
+    (version, lex) = Container.identifyURN(urn, resolver=resolver)
+
+    # Only the central directory is read again - the metadata is loaded.
+    resolver.lexicon = lex
+    with zip.ZipFile.NewZipFile(resolver, version, urn) as volume:
+        return _LoadedVolume(resolver, volume, version, lex)
+
+
+class ContainerSet(object):
+    """A set of AFF4 volumes opened into one resolver.
+
+    Usage:
+      with ContainerSet.open(["disk_1.aff4", "disk_2.aff4"]) as volumes:
+          with volumes.resolver.AFF4FactoryOpen(image_urn) as image:
+              ...
+
+    The streams of one volume may refer to streams in the others (stripes,
+    appended sessions, incremental images), which resolve as the resolver
+    holds the metadata of all of them.
+
+    The volumes are identified and their metadata parsed in this process,
+    unless processes asks for a pool of worker processes (0 for one per CPU),
+    so opening a set costs about as much as opening its largest volume. The
+    pool is only for programs which ask for it, as it must not fork while
+    holding threads, nor spawn without a __main__ guard. The resolver uses the
+    lexicon of the first volume.
+    """
+
+    def __init__(self, urns, processes=1):
+        urns = [rdfvalue.URN(x) for x in urns]
+        if not urns:
+            raise ValueError("At least one volume is required")
+
+        loaded = self._LoadVolumes(urns, processes)
+        self.version = loaded[0].version
+        self.lexicon = _LEXICONS[loaded[0].lexicon]
+        self.resolver = data_store.MemoryDataStore(self.lexicon)
+
+        # The URN of the volume holding each stream's data.
+        self.stream_volumes = {}
+        for volume in loaded:
+            self.resolver.Merge(volume)
+            for stream in volume.streams:
+                self.stream_volumes.setdefault(stream, volume.urn)
+
+        # Keep the volumes open, like Container does.
+        self.zip_files = [
+            zip.ZipFile.NewZipFile(self.resolver, loaded[i].version, urns[i])
+            for i in range(len(urns))]
+        self.volumes = [x.urn for x in self.zip_files]
+        self.closed = False
+
+    @staticmethod
+    def _LoadVolumes(urns, processes):
+        if processes == 0:
+            processes = multiprocessing.cpu_count()
+        processes = min(processes, len(urns))
+
+        if processes <= 1:
+            return [_LoadVolume(x.value) for x in urns]
+
+        pool = multiprocessing.Pool(processes)
+        try:
+            return pool.map(_LoadVolume, [x.value for x in urns])
+        finally:
+            pool.close()
+            pool.join()
+
+    @staticmethod
+    def open(filenames, processes=1):
+        """Public method to open a set of files as AFF4 volumes."""
+        return ContainerSet([rdfvalue.URN.FromFileName(x) for x in filenames],
+                            processes=processes)
+
+    def VolumeFor(self, stream_urn):
+        """The URN of the volume holding the data of stream_urn, or None."""
+        return self.stream_volumes.get(rdfvalue.URN(stream_urn).value)
+
+    def Close(self):
+        if self.closed:
+            return
+        self.closed = True
+
+        for zip_file in self.zip_files:
+            self.resolver.Return(zip_file)
+        self.resolver.Flush()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        self.Close()
+
+
 class PhysicalImageContainer(Container):
     def __init__(self, backing_store, zip_file, version, volumeURN, resolver, lex, image, dataStream):
         super(PhysicalImageContainer, self).__init__(backing_store, zip_file, version, volumeURN, resolver, lex)
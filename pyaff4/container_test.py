@@ -1,5 +1,6 @@
 from __future__ import print_function
 from __future__ import unicode_literals
+import hashlib
 import os
 import unittest
 
@@ -15,6 +16,31 @@ class ContainerTest(unittest.TestCase):
         self.assertEqual(fd.urn,
                          u"aff4://fcbfdce7-4488-4677-abf6-08bc931e195b")
 
+    @hashing_test.conditional_on_images
+    def testContainerSet(self):
+        filenames = [hashing_test.stripedLinearA, hashing_test.stripedLinearB]
+        for processes in [1, 2]:
+            with container.ContainerSet.open(filenames, processes=processes) as volumes:
+                self.assertEqual(volumes.volumes, [
+                    u"aff4://7cbb47d0-b04c-42bc-8c04-87b7782739ad",
+                    u"aff4://51725cd9-3769-4be7-a8ab-94e3ea62bf9a"])
+
+                # Each volume holds one of the image streams, and describes
+                # both.
+                self.assertEqual(
+                    volumes.VolumeFor(u"aff4://a04a9189-5e92-4024-a577-37d6cfa72594"),
+                    volumes.volumes[0])
+                self.assertEqual(
+                    volumes.VolumeFor(u"aff4://3bf0bd14-1ef9-4185-8b0a-2c7d511b4d30"),
+                    volumes.volumes[1])
+
+                # The map in the first volume reads from both.
+                with volumes.resolver.AFF4FactoryOpen(
+                        u"aff4://2dd04819-73c8-40e3-a32b-fdddb0317eac") as image_map:
+                    data = image_map.Read(image_map.Size())
+                    self.assertEqual(hashlib.sha1(data).hexdigest(),
+                                     u"7d3d27f667f95f7ec5b9d32121622c0f4b60b48d")
+
 
 if __name__ == '__main__':
     unittest.main()
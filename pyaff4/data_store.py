@@ -20,6 +20,10 @@ from builtins import str
 from builtins import object
 from os.path import expanduser
 import collections
+import errno
+import hashlib
+import heapq
+import io
 import logging
 import rdflib
 import re
@@ -31,6 +35,8 @@ import subprocess
 import sys
 import types
 import binascii
+import bisect
+import multiprocessing
 
 from rdflib import URIRef
 from itertools import chain
@@ -46,23 +52,34 @@ from pyaff4 import aff4_map
 from pyaff4 import aff4_image, encrypted_stream
 from pyaff4 import escaping
 from pyaff4 import turtle, hexdump
-from pyaff4.zip import ZIP_DEFLATE, ZIP_STORED
+from pyaff4 import spill_store
+from pyaff4 import triple_index
+from pyaff4 import triple_store
+from pyaff4.zip import ZIP_DEFLATE, ZIP_STORED, FileWrapper
 from pyaff4.lexicon import transient_graph, XSD_NAMESPACE, any
 from pyaff4.aff4_map import isByteRangeARN
 
 LOGGER = logging.getLogger("pyaff4")
-HAS_HDT = False
-try:
-    import hdt
-    from hdt import HDTDocument
-    HAS_HDT = True
-except:
-    pass
+# Where IndexedDataStore caches the metadata index of each volume.
+INDEX_CACHE_DIR = os.path.join(expanduser("~"), ".aff4")
+# The default bound on the triples SpillingDataStore keeps in memory per graph.
+SPILL_MAX_TRIPLES = 1000000
+# Volumes with at least this many bytes of turtle metadata have it parsed by a
+# pool of TURTLE_PROCESSES worker processes (one per CPU if 0). The pool is
+# only used when a program asks for it (e.g. aff4.py --turtle-processes), as
+# it must not fork while holding threads, nor spawn without a __main__ guard.
+PARALLEL_TURTLE_SIZE = 4 * 1024 * 1024
+TURTLE_PROCESSES = 1
+# aff4 URN strings which are already in the form the store keys them by: no
+# empty, "." or ".." path segments, query or fragment. Normalizing every
+# subject of a large volume is slow, so these are used as they are.
+NORMAL_URN = re.compile(
+    r"aff4:(?://[^/?#;\s\[\]@:]+)?(?:(?!\.\.?(?:/|\Z))[^/?#;\s]+)?"
+    r"(?:/(?!\.\.?(?:/|\Z))[^/?#;\s]+)*\Z")
 
 # Coerce rdflib to use
 rdflib.term._toPythonMapping[URIRef(XSD_NAMESPACE + 'hexBinary')] = lambda s: binascii.unhexlify(s)
 
-#HAS_HDT = False
 def CHECK(condition, error):
     if not condition:
         raise RuntimeError(error)
@@ -149,6 +166,11 @@ class AFF4ObjectCache(object):
             return True
         return False
 
+    def Objects(self):
+        """All the objects in the cache, whether in use or not."""
+        return [entry.aff4_obj for entry in
+                list(self.in_use.values()) + list(self.lru_map.values())]
+
     def Get(self, urn):
         key = rdfvalue.URN(urn).SerializeToString()
         #LOGGER.debug("Getting %s from cache" % key)
@@ -266,8 +288,11 @@ class MemoryDataStore(object):
     def __init__(self, lex=lexicon.standard, parent=None):
         self.lexicon = lex
         self.loadedVolumes = []
-        self.store = collections.OrderedDict()
-        self.transient_store = collections.OrderedDict()
+
+        # URNs are interned once, so both graphs hold integer ids.
+        self.urns = triple_store.Interner()
+        self.store = triple_store.TripleStore(self.urns)
+        self.transient_store = triple_store.TripleStore(self.urns)
         if parent == None:
             self.ObjectCache = AFF4ObjectCache(10)
         else:
@@ -275,6 +300,12 @@ class MemoryDataStore(object):
         self.flush_callbacks = {}
         self.parent = parent
 
+        # Hash and byte range references resolved to (stream, offset, length).
+        self.reference_cache = {}
+
+        # The version of the store which the turtle of each volume matches.
+        self.turtle_versions = {}
+
         if self.lexicon == lexicon.legacy:
             self.streamFactory = stream_factory.PreStdStreamFactory(
                 self, self.lexicon)
@@ -304,7 +335,9 @@ class MemoryDataStore(object):
             cb()
 
     def DeleteSubject(self, subject):
-        self.store.pop(rdfvalue.URN(subject), None)
+        subject = self.urns.Lookup(subject)
+        if subject is not None:
+            self.store.RemoveSubject(subject)
 
     def CacheContains(self, arn):
         return self.ObjectCache.Contains(arn)
@@ -352,165 +385,123 @@ class MemoryDataStore(object):
 
     def DumpToTurtle(self, zipcontainer, ):
         infoARN = escaping.urn_from_member_name(u"information.turtle", zipcontainer.urn, zipcontainer.version)
-        mode = self.GetUnique(lexicon.transient_graph, zipcontainer.backing_store_urn, lexicon.AFF4_STREAM_WRITE_MODE)
-        if mode == "random":
-            # random mode is used for appending to encrypted streams, where the stream size changes
-            # snapshot mode creates the situation where we have multiple versions of the stream object
-            # mashed together, and we cant tell the most recent
-            turtle_append_mode="latest"
-        else:
-            # in append mode, we assume that each time we append, we are adding to the container, rather
-            # than modifying any existing objects in the container. Because of this, we get to save multiple
-            # independent copies of the turtle from each run, and join them together as text for efficiency
-            turtle_append_mode="snapshot"
-
-        if not zipcontainer.ContainsMember(infoARN):
-            with zipcontainer.CreateZipSegment(u"information.turtle") as turtle_segment:
-                turtle_segment.compression_method = ZIP_STORED
-
-                result = self._DumpToTurtle(zipcontainer.urn)
-                turtle_segment.write(utils.SmartStr(result))
-                turtle_segment.Flush()
-            turtle_segment.Close()
-        else:
-            # append to an existng container
-            self.invalidateCachedMetadata(zipcontainer)
-            if turtle_append_mode == "latest":
-                zipcontainer.RemoveMember(infoARN)
-                with zipcontainer.CreateZipSegment(u"information.turtle") as turtle_segment:
-                    turtle_segment.compression_method = ZIP_STORED
-
-                    result = self._DumpToTurtle(zipcontainer.urn)
-                    turtle_segment.write(utils.SmartStr(result))
-                    turtle_segment.Flush()
-                turtle_segment.Close()
+        if zipcontainer.ContainsMember(infoARN):
+            # Nothing to write if the volume's turtle is what we have.
+            since = self.turtle_versions.get(zipcontainer.urn)
+            if since is not None and not self._ChangedSince(since):
                 return
 
-            explodedTurtleDirectivesARN = escaping.urn_from_member_name(u"information.turtle/directives", zipcontainer.urn, zipcontainer.version)
-            if not zipcontainer.ContainsMember(explodedTurtleDirectivesARN):
-                # this is the first append operation. Create the chunked turtle structures
-                with zipcontainer.OpenZipSegment(u"information.turtle") as turtle_segment:
-                    currentTurtleBytes= streams.ReadAll(turtle_segment)
-                    currentturtle = utils.SmartUnicode(currentTurtleBytes)
-                    #hexdump.hexdump(currentTurtleBytes)
-                    (directives_txt, triples_txt) = turtle.toDirectivesAndTripes(currentturtle)
-                    with zipcontainer.CreateZipSegment(u"information.turtle/directives") as directives_segment:
-                        directives_segment.compression_method = ZIP_DEFLATE
-                        directives_segment.write(utils.SmartStr(directives_txt))
-                        directives_segment.Flush()
-                    directives_segment.Close()
-                    with zipcontainer.CreateZipSegment(u"information.turtle/%08d" % 0) as turtle_chunk_segment:
-                        turtle_chunk_segment.compression_method = ZIP_DEFLATE
-                        turtle_chunk_segment.write(utils.SmartStr(triples_txt))
-                        turtle_chunk_segment.Flush()
-                    self.Close(turtle_chunk_segment)
-                turtle_segment.Close()
-
-                (current_directives_txt, current_triples_txt) = turtle.toDirectivesAndTripes(utils.SmartUnicode(self._DumpToTurtle(zipcontainer.urn)))
-                directives_difference = turtle.difference(directives_txt, current_directives_txt)
-                if not len(directives_difference) == 0:
-                    directives_txt = directives_txt + u"\r\n" + directives_difference
-                    with zipcontainer.CreateZipSegment(u"information.turtle/directives") as directives_segment:
-                        directives_segment.compression_method = ZIP_DEFLATE
-                        directives_segment.write(utils.SmartStr(directives_txt))
-                        directives_segment.Flush()
-                    directives_segment.Close()
-
-                current_turtle_chunk_arn = rdfvalue.URN(u"%s/information.turtle/%08d" % (zipcontainer.urn, 1))
-                with zipcontainer.CreateMember(current_turtle_chunk_arn) as turtle_segment:
-                    turtle_segment.compression_method = ZIP_DEFLATE
-                    turtle_segment.write(utils.SmartStr(current_triples_txt))
-                    turtle_segment.Flush()
-                self.Close(turtle_segment)
-
-                zipcontainer.RemoveSegment(u"information.turtle")
-                with zipcontainer.CreateZipSegment(u"information.turtle") as turtle_segment:
-                    turtle_segment.compression_method = ZIP_STORED
-                    turtle_segment.write(utils.SmartStr(directives_txt + "\r\n\r\n"))
-
-                    turtleContainerIndex = 0
-                    while True:
-                        current_turtle_chunk_arn = rdfvalue.URN(u"%s/information.turtle/%08d" % (zipcontainer.urn, turtleContainerIndex))
-
-                        if zipcontainer.ContainsMember(current_turtle_chunk_arn):
-                            with zipcontainer.OpenMember(current_turtle_chunk_arn) as turtle_chunk_segment:
-                                turtle_chunk_txt = utils.SmartUnicode(streams.ReadAll(turtle_chunk_segment))
-                                turtle_segment.write(utils.SmartStr(turtle_chunk_txt + u"\r\n"))
-                            turtleContainerIndex += 1
-
-                        else:
-                            break
-                    turtle_segment.Flush()
-                turtle_segment.Close()
-            else:
-                # more than one append as already occurred
-                turtleContainerIndex = 0
-                while True:
-                    turtleARN = escaping.urn_from_member_name(u"information.turtle/%08d" % turtleContainerIndex,
-                                                                                zipcontainer.urn, zipcontainer.version)
-                    if not zipcontainer.ContainsMember(turtleARN):
-                        break
-                    turtleContainerIndex = turtleContainerIndex + 1
-
-                with zipcontainer.OpenZipSegment(u"information.turtle/directives") as directives_segment:
-                    directives_txt = utils.SmartUnicode(streams.ReadAll(directives_segment))
-
-                (current_directives_txt, current_triples_txt) = turtle.toDirectivesAndTripes(utils.SmartUnicode(self._DumpToTurtle(zipcontainer.urn)))
-                directives_difference = turtle.difference(directives_txt, current_directives_txt)
-
-                if len(directives_difference) > 0:
-                    directives_txt = directives_txt + u"\r\n" + u"\r\n".join(directives_difference)
-                    with zipcontainer.CreateZipSegment(u"information.turtle/directives") as directives_segment:
-                        directives_segment.compression_method = ZIP_DEFLATE
-                        directives_segment.write(utils.SmartStr(directives_txt))
-                        directives_segment.Flush()
-                    directives_segment.Close()
-
-                with zipcontainer.CreateZipSegment(u"information.turtle/%08d" % turtleContainerIndex) as turtle_segment:
-                    turtle_segment.compression_method = ZIP_DEFLATE
-                    turtle_segment.write(utils.SmartStr(current_triples_txt))
-                    turtle_segment.Flush()
-                turtle_segment.Close()
-
-                with zipcontainer.CreateZipSegment(u"information.turtle") as turtle_segment:
-                    turtle_segment.compression_method = ZIP_DEFLATE
-                    turtle_segment.write(utils.SmartStr(directives_txt + u"\r\n\r\n"))
-
-                    turtleContainerIndex = 0
-                    while True:
-                        turtleARN = escaping.urn_from_member_name(u"information.turtle/%08d" % turtleContainerIndex,
-                                                                  zipcontainer.urn, zipcontainer.version)
-                        if zipcontainer.ContainsMember(turtleARN):
-                            with zipcontainer.OpenZipSegment(
-                                u"information.turtle/%08d" % turtleContainerIndex) as turtle_chunk_segment:
-                                turtle_chunk_txt = utils.SmartUnicode(streams.ReadAll(turtle_chunk_segment))
-                                turtle_segment.write(utils.SmartStr(turtle_chunk_txt + u"\r\n"))
-                            turtleContainerIndex += 1
-                        else:
-                            break
-                    turtle_segment.Flush()
-                turtle_segment.Close()
-
-    def _DumpToTurtle(self, volumeurn, verbose=False):
-        g = rdflib.Graph()
-        g.bind("aff4", rdflib.Namespace(self.lexicon.base))
+            # A file opened for appending only grows, so each session appends
+            # a delta holding the subjects it changed, and readers join them
+            # at load time. information.turtle is only rewritten (with the
+            # deltas folded in) once they outgrow it, so the volume grows with
+            # the metadata rather than with the metadata of every session.
+            # Files which can be rewritten in place always get a whole
+            # information.turtle.
+            self.invalidateCachedMetadata(zipcontainer)
+            deltas = list(self._TurtleDeltas(zipcontainer))
+            mode = self.GetUnique(lexicon.transient_graph,
+                                  zipcontainer.backing_store_urn,
+                                  lexicon.AFF4_STREAM_WRITE_MODE)
+            if (since is not None and str(mode) == "append" and
+                    self._MemberSize(zipcontainer, deltas) <
+                    self._MemberSize(zipcontainer, [u"information.turtle"])):
+                delta = lexicon.AFF4_CONTAINER_INFO_TURTLE_DELTA % len(deltas)
+                self._WriteTurtleSegment(zipcontainer, delta, ZIP_DEFLATE, since=since)
+                self.turtle_versions[zipcontainer.urn] = self.store.version
+                return
 
-        # looks like rdflib has some problems with re-constituting subjects using @base
-        # comment out for now
-        #volumeNamespace = rdflib.Namespace(volumeurn.value + "/")
-        #volumeBase = volumeurn.value + "/"
+            for delta in deltas:
+                zipcontainer.RemoveSegment(delta)
+            zipcontainer.RemoveMember(infoARN)
+
+        self._WriteTurtleSegment(zipcontainer, u"information.turtle", ZIP_STORED)
+        self.turtle_versions[zipcontainer.urn] = self.store.version
+
+    def _MemberSize(self, zip, names):
+        """The uncompressed size of the named members of a volume."""
+        result = 0
+        for name in names:
+            member = zip.members.get(
+                escaping.urn_from_member_name(name, zip.urn, zip.version))
+            if member is not None:
+                result += member.file_size
+        return result
 
-        for urn, items in self.store.items():
-            urn = utils.SmartUnicode(urn)
-            type = items.get(utils.SmartUnicode(lexicon.AFF4_TYPE))
+    def CheckpointTurtle(self, zipcontainer, since=None):
+        """The turtle for a checkpoint record of a volume.
+
+        Returns the turtle of the subjects changed after the store version
+        since (or of all of them) and the store version it matches.
+        """
+        result = io.BytesIO()
+        if since is None or self._ChangedSince(since):
+            self._WriteTurtle(result, zipcontainer.urn, since=since)
+        return result.getvalue(), self.store.version
+
+    def _WriteTurtleSegment(self, zipcontainer, name, compression_method, since=None):
+        with zipcontainer.CreateZipSegment(name) as turtle_segment:
+            turtle_segment.compression_method = compression_method
+
+            self._WriteTurtle(turtle_segment, zipcontainer.urn, since=since)
+            turtle_segment.Flush()
+        turtle_segment.Close()
+
+    def _ChangedSince(self, version):
+        """Whether any subject changed after the store version."""
+        return bool(self.store.ChangedSince(version))
+
+    def _TurtleDeltas(self, zip):
+        """Yields the names of the turtle deltas appended to a volume."""
+        index = 0
+        while True:
+            name = lexicon.AFF4_CONTAINER_INFO_TURTLE_DELTA % index
+            if not zip.ContainsSegment(name):
+                break
+            yield name
+            index += 1
 
+    def _DumpToTurtle(self, volumeurn, verbose=False):
+        result = io.BytesIO()
+        self._WriteTurtle(result, volumeurn, verbose=verbose)
+        return utils.SmartUnicode(result.getvalue())
+
+    def _TurtleSubjects(self, since=None):
+        """Yields (subject, [(predicate, [values])]) of the subjects to write.
+
+        These are all the subjects, or those changed after the store version
+        since.
+        """
+        strings = self.urns.strings
+        if since is None:
+            subjects = self.store.SubjectIds()
+        else:
+            subjects = self.store.ChangedSince(since)
+        for subject in subjects:
+            yield strings[subject], [(strings[attr], values) for attr, values
+                                     in self.store.Items(subject)]
+
+    def _WriteTurtle(self, stream, volumeurn, verbose=False, since=None):
+        """Writes the turtle of the store to a stream, a subject at a time.
+
+        If since (a store version) is given only the subjects changed after it
+        are written.
+        """
+        writer = turtle.TurtleWriter(stream, {
+            "aff4": self.lexicon.base,
+            "rdf": lexicon.RDF_NAMESPACE,
+            "rdfs": "http://www.w3.org/2000/01/rdf-schema#",
+            "xml": "http://www.w3.org/XML/1998/namespace",
+            "xsd": lexicon.XSD_NAMESPACE})
+
+        for urn, items in self._TurtleSubjects(since):
             # only dump objects and pseudo map entries
-            if type is None:
+            if lexicon.AFF4_TYPE not in [x[0] for x in items]:
                 if not urn.startswith(u"aff4:sha512:"):
                     continue
 
-            for attr, value in list(items.items()):
-                attr = utils.SmartUnicode(attr)
+            subject_items = []
+            for attr, value in items:
                 # We suppress certain facts which can be deduced from the file
                 # format itself. This ensures that we do not have conflicting
                 # data in the data store. The data in the data store is a
@@ -519,59 +510,205 @@ class MemoryDataStore(object):
                     if attr.startswith(lexicon.AFF4_VOLATILE_NAMESPACE):
                         continue
 
-                if not isinstance(value, list):
-                    value = [value]
+                value = [x for x in value if not self._should_ignore(urn, attr, x)]
+                if value:
+                    subject_items.append((attr, value))
 
-                for item in value:
-                    if self._should_ignore(urn, attr, item):
-                        continue
-                    g.add((rdflib.URIRef(urn), rdflib.URIRef(attr), item.GetRaptorTerm()))
+            writer.WriteSubject(urn, subject_items)
 
-        #result = g.serialize(format='turtle', base=volumeNamespace)
-        result = g.serialize(format='turtle')
-        result = utils.SmartUnicode(result)
-        #basestart = "@base <%s> .\r\n" % (volumeBase)
-        #result = basestart + result
-
-        return result
+        writer.Flush()
 
     def loadMetadata(self, zip):
-        # Load the turtle metadata.
-        #if zip.urn not in self.loadedVolumes:
-        with zip.OpenZipSegment("information.turtle") as fd:
-            self.LoadFromTurtle(fd, zip.urn)
-            self.loadedVolumes.append(zip.urn)
+        # Load the turtle metadata, unless it is already here (e.g. merged
+        # from another store by a ContainerSet).
+        if zip.urn in self.loadedVolumes:
+            return
+
+        names = ["information.turtle"] + list(self._TurtleDeltas(zip))
+        if zip.checkpoint_turtle and not zip.ContainsSegment(names[0]):
+            # A new volume which was never closed.
+            names = []
+
+        if names and not self._LoadTurtleInParallel(zip, names[:1]):
+            with zip.OpenZipSegment(names[0]) as fd:
+                self.LoadFromTurtle(fd, zip.urn)
+        for name in names[1:]:
+            with zip.OpenZipSegment(name) as fd:
+                self._LoadTurtleDelta(streams.ReadAll(fd), zip.urn)
+        self._LoadCheckpointTurtle(zip)
+        self.loadedVolumes.append(zip.urn)
+
+        # Appends to the volume only need to write what changes from here.
+        self.turtle_versions[zip.urn] = self.store.version
+
+    def _LoadCheckpointTurtle(self, zip):
+        """Loads the turtle of the checkpoint records a volume was read from."""
+        for data in zip.checkpoint_turtle:
+            if data:
+                self._LoadTurtleDelta(data, zip.urn)
+
+    def _LoadTurtleDelta(self, data, volume_arn):
+        """Loads a turtle delta (of a session or a checkpoint record).
+
+        A delta holds the whole of each subject it mentions, so replaces what
+        was loaded for them before.
+        """
+        delta = MemoryDataStore(self.lexicon)
+        delta.LoadFromTurtle(io.BytesIO(data), volume_arn)
+        for subject in delta.store.SubjectIds():
+            self.DeleteSubject(delta.urns.strings[subject])
+        self.LoadFromTurtle(io.BytesIO(data), volume_arn)
+
+    def _LoadTurtleInParallel(self, zip, names):
+        """Parses turtle members of a volume in a pool of worker processes.
+
+        Each member is split into pieces (see turtle.SplitRanges), so one
+        large member is parsed in parallel. Workers read their piece from the
+        volume file themselves. The triples are added in the order they are in the
+        members, as LoadFromTurtle() would add them.
+
+        Returns False, having done nothing, if no pool was asked for, the
+        members are too small to be worth it or are not stored in a file.
+        """
+        processes = TURTLE_PROCESSES
+        if processes == 0:
+            processes = multiprocessing.cpu_count()
+
+        size = self._MemberSize(zip, names)
+
+        # Daemonic processes (e.g. the workers of a ContainerSet) can not
+        # start processes of their own.
+        if (processes < 2 or size < PARALLEL_TURTLE_SIZE or
+                multiprocessing.current_process().daemon or
+                not zip.backing_store_urn.value.startswith("file:")):
+            return False
+
+        filename = zip.backing_store_urn.ToFilename()
+        pieces = []
+        for name in names:
+            with zip.OpenZipSegment(name) as fd:
+                if not isinstance(fd.fd, FileWrapper):
+                    # Compressed members are only held in memory.
+                    return False
+
+                offset = fd.fd.slice_offset
+                header, ranges = turtle.SplitRanges(
+                    fd, size // (processes * 4))
+                for start, end in ranges:
+                    pieces.append((filename, offset, header if start else 0,
+                                   start, end, zip.urn.value))
+
+        if len(pieces) < 2:
+            return False
+
+        pool = multiprocessing.Pool(min(processes, len(pieces)))
+        try:
+            # imap() yields the results in order, as they are ready.
+            for parsed in pool.imap(_ParseTurtle, pieces):
+                self._AddParsedTurtle(parsed, zip.urn)
+        finally:
+            pool.close()
+            pool.join()
+
+        return True
+
+    def _AddParsedTurtle(self, parsed, volume_arn):
+        """Adds the triples a worker process parsed from a volume's turtle."""
+        self.store.Extend(parsed.store)
+        self.transient_store.Extend(parsed.transient_store)
+        self._SetNamespaces(parsed.namespaces)
+
+    def Merge(self, other):
+        """Adds all the triples of another MemoryDataStore to this one.
+
+        The other store's metadata loaded from volumes counts as loaded here.
+        Its triples are taken over rather than copied, so the other store
+        should be dropped afterwards. Its stores may also be Columns, as
+        passed back by another process.
+        """
+        if (not len(self.urns) and
+                isinstance(other.store, triple_store.TripleStore)):
+            # Nothing here yet, so the other store's ids can be kept as well.
+            self.urns = other.store.interner
+            self.store = other.store
+            self.transient_store = other.transient_store
+            self.turtle_versions.update(other.turtle_versions)
+        else:
+            for store, other_store in ((self.store, other.store),
+                                       (self.transient_store, other.transient_store)):
+                if not isinstance(other_store, triple_store.Columns):
+                    other_store = triple_store.Columns(other_store)
+                store.Extend(other_store)
+
+        for volume_urn in other.loadedVolumes:
+            if volume_urn not in self.loadedVolumes:
+                self.loadedVolumes.append(volume_urn)
+
+        if other.aff4NS is not None:
+            self.aff4NS = other.aff4NS
 
     def LoadFromTurtle(self, stream, volume_arn):
+        # Stream the triples in, unless the turtle uses syntax only rdflib
+        # reads. Triples added before the reader gave up are added again, which
+        # is harmless.
+        start = stream.tell()
+        try:
+            reader = turtle.TurtleReader(stream)
+            self._AddTurtleTriples(reader, volume_arn)
+            namespaces = list(reader.namespaces.values())
+        except turtle.UnsupportedSyntax as e:
+            LOGGER.debug("Parsing turtle with rdflib: %s", e)
+            stream.seek(start)
+            namespaces = self._LoadFromTurtleWithRdflib(stream, volume_arn)
+
+        self._SetNamespaces(namespaces)
+
+    def _SetNamespaces(self, namespaces):
+        # look for the AFF4 namespace defined in the turtle
+        for b in namespaces:
+            if (str(b) == lexicon.AFF4_NAMESPACE or
+                str(b) == lexicon.AFF4_LEGACY_NAMESPACE):
+                self.aff4NS = rdflib.URIRef(b)
+
+    def _AddTurtleTriples(self, triples, volume_arn):
+        type_attr = utils.SmartUnicode(lexicon.AFF4_TYPE)
+        image_type = rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE)
+        if volume_arn == transient_graph:
+            store = self.transient_store
+        else:
+            store = self.store
+        intern = self.urns.Intern
+
+        for urn, attr, value in triples:
+            if attr == type_attr and value == image_type:
+                self.Add(lexicon.transient_graph, urn, lexicon.AFF4_STORED, volume_arn)
+            store.Add(intern(urn), intern(attr), value)
+
+    def _LoadFromTurtleWithRdflib(self, stream, volume_arn):
         data = streams.ReadAll(stream)
         g = rdflib.Graph()
         g.parse(data=data, format="turtle")
 
-        for urn, attr, value in g:
-            urn = utils.SmartUnicode(urn)
-            attr = utils.SmartUnicode(attr)
-            serialized_value = value
+        def Triples():
+            for urn, attr, value in g:
+                urn = utils.SmartUnicode(urn)
+                attr = utils.SmartUnicode(attr)
+                serialized_value = value
 
-            if isinstance(value, rdflib.URIRef):
-                value = rdfvalue.URN(utils.SmartUnicode(serialized_value))
-            elif value.datatype in registry.RDF_TYPE_MAP:
-                dt = value.datatype
-                value = registry.RDF_TYPE_MAP[value.datatype](
-                    serialized_value)
+                if isinstance(value, rdflib.URIRef):
+                    value = rdfvalue.URN(utils.SmartUnicode(serialized_value))
+                elif value.datatype in registry.RDF_TYPE_MAP:
+                    value = registry.RDF_TYPE_MAP[value.datatype](
+                        serialized_value)
 
-            else:
-                # Default to a string literal.
-                value = rdfvalue.XSDString(value)
+                else:
+                    # Default to a string literal.
+                    value = rdfvalue.XSDString(value)
 
-            if attr == rdfvalue.URN(lexicon.AFF4_TYPE) and value == rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE):
-                self.Add(lexicon.transient_graph, urn, lexicon.AFF4_STORED, volume_arn)
-            self.Add(volume_arn, urn, attr, value)
+                yield urn, attr, value
 
-        # look for the AFF4 namespace defined in the turtle
-        for (_, b) in g.namespace_manager.namespaces():
-            if (str(b) == lexicon.AFF4_NAMESPACE or
-                str(b) == lexicon.AFF4_LEGACY_NAMESPACE):
-                self.aff4NS = b
+        self._AddTurtleTriples(Triples(), volume_arn)
+        return [b for (_, b) in g.namespace_manager.namespaces()]
 
     def AFF4FactoryOpen(self, urn, version=None):
         urn = rdfvalue.URN(urn)
@@ -637,40 +774,66 @@ class MemoryDataStore(object):
         obj.Prepare()
         return obj
 
+    def ResolveReference(self, urn):
+        """Resolve a hash (aff4:sha512:...) or byte range reference.
+
+        Returns (stream urn, offset, length) of the bytes it refers to, or None
+        if urn is an ordinary stream. Resolutions are cached, as the blocks
+        behind a reference never move.
+        """
+        # Work with the raw values - byte range suffixes do not survive URL
+        # parsing.
+        key = rdfvalue.URN(urn).value
+        result = self.reference_cache.get(key)
+        if result is not None:
+            return result
+
+        if key.startswith("aff4:sha512"):
+            bytestream_reference_id = self.GetUnique(
+                lexicon.any, rdfvalue.URN(key), rdfvalue.URN(lexicon.standard.dataStream))
+            if bytestream_reference_id is None:
+                return None
+            key_reference = bytestream_reference_id.value
+        else:
+            key_reference = key
+
+        result = aff4_map.parseByteRangeARN(key_reference)
+        if result is not None:
+            result = (rdfvalue.URN(result[0]), result[1], result[2])
+            self.reference_cache[key] = result
+
+        return result
+
     def Dump(self, verbose=False):
         print(utils.SmartUnicode(self.DumpToTurtle(verbose=verbose)))
         self.ObjectCache.Dump()
 
     def isImageStream(self, subject):
-        try:
-            po = self.store[subject]
-            if po == None:
-                return False
-            else:
-                o = po[lexicon.AFF4_TYPE]
-                if o == None:
-                    return False
-                else:
-                    if type(o) == type([]):
-                        for ent in o:
-                            if ent.value == lexicon.AFF4_LEGACY_IMAGE_TYPE or ent.value == lexicon.AFF4_IMAGE_TYPE :
-                                return True
-                        return False
-                    else:
-                        if o.value == lexicon.AFF4_LEGACY_IMAGE_TYPE or o.value == lexicon.AFF4_IMAGE_TYPE :
-                            return True
-                        else:
-                            return False
-        except:
+        subject = self.urns.Lookup(subject)
+        attribute = self.urns.Lookup(lexicon.AFF4_TYPE)
+        if subject is None or attribute is None:
             return False
 
+        for o in self.store.Values(subject, attribute):
+            if o.value == lexicon.AFF4_LEGACY_IMAGE_TYPE or o.value == lexicon.AFF4_IMAGE_TYPE:
+                return True
+        return False
+
+    def _Stores(self, graph):
+        if graph == lexicon.any or graph == None:
+            return (self.store, self.transient_store)
+        elif graph == transient_graph:
+            return (self.transient_store,)
+        else:
+            return (self.store,)
+
     # FIXME: This is a big API breaking change - we simply can not
     # change the type we are returning from Get() depending on random
     # factors. We need to make the store _always_ hold a list for all
     # members.
     def Add(self, graph, subject, attribute, value):
-        subject = rdfvalue.URN(subject).SerializeToString()
-        attribute = rdfvalue.URN(attribute).SerializeToString()
+        subject = self.urns.Intern(subject)
+        attribute = self.urns.Intern(attribute)
         CHECK(isinstance(value, rdfvalue.RDFValue), "Value must be an RDFValue")
 
         if graph == transient_graph:
@@ -678,23 +841,11 @@ class MemoryDataStore(object):
         else:
             store = self.store
 
-        if attribute not in store.setdefault(
-                subject, collections.OrderedDict()):
-            store.get(subject)[attribute] = value
-        else:
-            oldvalue = store.get(subject)[attribute]
-            t = type(oldvalue)
-            if  t != type([]):
-                if value != oldvalue:
-                    store.get(subject)[attribute] = [oldvalue, value]
-            else:
-                if value not in oldvalue:
-                    oldvalue.append(value)
-
+        store.Add(subject, attribute, value)
 
     def Set(self, graph, subject, attribute, value):
-        subject = rdfvalue.URN(subject).SerializeToString()
-        attribute = rdfvalue.URN(attribute).SerializeToString()
+        subject = self.urns.Intern(subject)
+        attribute = self.urns.Intern(attribute)
         CHECK(isinstance(value, rdfvalue.RDFValue), "Value must be an RDFValue")
 
         if graph == transient_graph:
@@ -702,30 +853,26 @@ class MemoryDataStore(object):
         else:
             store = self.store
 
-        store.setdefault(subject, {})[attribute] = value
+        store.Set(subject, attribute, value)
 
     # return a list of results
     def Get(self, graph, subject, attribute):
-        subject = rdfvalue.URN(subject).SerializeToString()
-        attribute = rdfvalue.URN(attribute).SerializeToString()
+        subject = self.urns.Lookup(subject)
+        attribute = self.urns.Lookup(attribute)
+        if subject is None or attribute is None:
+            return [None]
 
         if graph == lexicon.any or graph == None:
-            resa = self.transient_store.get(subject, {}).get(attribute)
-            resb = self.store.get(subject, {}).get(attribute)
-            return utils.asList(resa, resb)
-
+            res = (self.transient_store.Values(subject, attribute) +
+                   self.store.Values(subject, attribute))
         elif graph == transient_graph:
-            res = self.transient_store.get(subject, {}).get(attribute)
-            if isinstance(res, list):
-                return res
-            else:
-                return [res]
+            res = self.transient_store.Values(subject, attribute)
         else:
-            res = self.store.get(subject, {}).get(attribute)
-            if isinstance(res, list):
-                return res
-            else:
-                return [res]
+            res = self.store.Values(subject, attribute)
+
+        if not res:
+            return [None]
+        return res
 
     # return a single result or None
     def GetUnique(self, graph, subject, attribute):
@@ -740,83 +887,74 @@ class MemoryDataStore(object):
             return res
 
     def QuerySubject(self, graph, subject_regex=None):
-        subject_regex = re.compile(utils.SmartStr(subject_regex))
-
-        if graph == lexicon.any or graph == None:
-            storeitems = chain(six.iteritems(self.store), six.iteritems(self.transient_store))
-        elif graph == transient_graph:
-            storeitems = six.iteritems(self.transient_store)
-        else:
-            storeitems = six.iteritems(self.store)
+        prefix = ""
+        if subject_regex is not None:
+            subject_regex = utils.SmartUnicode(subject_regex)
+            # Only the subjects starting with the literal prefix of the regex
+            # can match it.
+            prefix = triple_store.LiteralPrefix(subject_regex)
+            subject_regex = re.compile(subject_regex)
+
+        for store in self._Stores(graph):
+            if prefix:
+                subjects = store.SubjectsWithPrefix(prefix)
+            else:
+                subjects = store
 
-        for subject in storeitems:
-            if subject_regex is not None and subject_regex.match(subject):
-                yield rdfvalue.URN().UnSerializeFromString(subject)
+            for subject in subjects:
+                if subject_regex is None or subject_regex.match(subject):
+                    yield rdfvalue.URN(subject)
 
     def QueryPredicate(self, graph, predicate):
         """Yields all subjects which have this predicate."""
-        predicate = utils.SmartStr(predicate)
-
-        if graph == lexicon.any or graph == None:
-            storeitems = chain(six.iteritems(self.store), six.iteritems(self.transient_store))
-        elif graph == transient_graph:
-            storeitems = six.iteritems(self.transient_store)
-        else:
-            storeitems = six.iteritems(self.store)
-
-        for subject, data in storeitems:
-            for pred, values in six.iteritems(data):
-                if pred == predicate:
-                    if type(values) != type([]):
-                        values = [values]
-                    for value in values:
-                        yield (rdfvalue.URN().UnSerializeFromString(subject),
-                               rdfvalue.URN().UnSerializeFromString(predicate),
-                               value)
+        predicate_id = self.urns.Lookup(predicate)
+        if predicate_id is None:
+            return
 
+        predicate = self.urns.strings[predicate_id]
+        for store in self._Stores(graph):
+            for subject, row in store.Scan(predicate_id):
+                yield (rdfvalue.URN(self.urns.strings[subject]),
+                       rdfvalue.URN(predicate),
+                       store.Value(row))
 
     def QueryPredicateObject(self, graph, predicate, object):
-        predicate = utils.SmartUnicode(predicate)
+        predicate = self.urns.Lookup(predicate)
+        if predicate is None:
+            return
 
-        if graph == lexicon.any or graph == None:
-            storeitems = chain(six.iteritems(self.store), six.iteritems(self.transient_store))
-        elif graph == transient_graph:
-            storeitems = six.iteritems(self.transient_store)
+        # URN values are found through the index. Literals are compared with
+        # the predicate's other values.
+        if isinstance(object, (rdfvalue.URN, six.string_types)):
+            object_id = self.urns.Lookup(object)
         else:
-            storeitems = six.iteritems(self.store)
+            object_id = None
 
-        for subject, data in list(storeitems):
-            for pred, value in list(data.items()):
-                if pred == predicate:
-                    if type(value) != type([]):
-                        value = [value]
+        for store in self._Stores(graph):
+            subjects = []
+            seen = set()
+            if object_id is not None:
+                for subject, _ in store.Match(predicate, object_id):
+                    if subject not in seen:
+                        seen.add(subject)
+                        subjects.append(subject)
 
-                    if object in value:
-                        yield rdfvalue.URN(subject)
+            for subject, row in store.Match(predicate, None):
+                if subject not in seen and store.Value(row) == object:
+                    seen.add(subject)
+                    subjects.append(subject)
 
-    def QuerySubjectPredicateInternal(self, store, subject, predicate):
-        if subject in store:
-            predicateValues = store[subject]
-            if predicate in predicateValues:
-                storeValues = predicateValues[predicate]
-                if type(storeValues) != type([]):
-                    yield storeValues
-                else:
-                    for val in storeValues:
-                        yield val
+            for subject in subjects:
+                yield rdfvalue.URN(self.urns.strings[subject])
 
+    def QuerySubjectPredicateInternal(self, store, subject, predicate):
+        subject = self.urns.Lookup(subject)
+        predicate = self.urns.Lookup(predicate)
+        if subject is not None and predicate is not None:
+            for val in store.Values(subject, predicate):
+                yield val
 
     def QuerySubjectPredicate(self, graph, subject, predicate):
-        if isinstance(subject, rdfvalue.URN):
-            subject = subject.SerializeToString()
-        else:
-            subject = utils.SmartUnicode(subject)
-
-        if isinstance(predicate, rdfvalue.URN):
-            predicate = predicate.SerializeToString()
-        else:
-            predicate = utils.SmartUnicode(predicate)
-
         if graph == lexicon.any or graph == None:
             for val in self.QuerySubjectPredicateInternal(self.transient_store, subject, predicate):
                 yield val
@@ -833,197 +971,927 @@ class MemoryDataStore(object):
     def SelectSubjectsByPrefix(self, graph, prefix):
         prefix = utils.SmartUnicode(prefix)
 
-        if graph == lexicon.any or graph == None:
-            storeitems = chain(six.iteritems(self.store), six.iteritems(self.transient_store))
-        elif graph == transient_graph:
-            storeitems = six.iteritems(self.transient_store)
-        else:
-            storeitems = six.iteritems(self.store)
-
-        for subject, predicateDict in storeitems:
-            if subject.startswith(prefix):
+        for store in self._Stores(graph):
+            for subject in store.SubjectsWithPrefix(prefix):
                 yield rdfvalue.URN(subject)
 
     def QueryPredicatesBySubject(self, graph, subject):
-        subject = utils.SmartUnicode(subject)
+        subject = self.urns.Lookup(subject)
+        if subject is None:
+            return
 
         if graph == transient_graph:
             store = self.transient_store
         else:
             store = self.store
 
-        for pred, value in list(store.get(subject, {}).items()):
-            yield (rdfvalue.URN().UnSerializeFromString(pred), value)
+        for pred, values in store.Items(subject):
+            if len(values) == 1:
+                values = values[0]
+            yield (rdfvalue.URN(self.urns.strings[pred]), values)
 
     def invalidateCachedMetadata(self, zip):
         pass
 
-# With large information.turtle files, the in-memory database performs
-# horribly. This is a faster way. http://www.rdfhdt.org
-class HDTAssistedDataStore(MemoryDataStore):
-    def __init__(self, lex=lexicon.standard):
-        super(HDTAssistedDataStore, self).__init__(lex=lex)
-        self.hdt = None
+class _ParsedTurtle(object):
+    """The triples parsed from a piece of turtle by a worker process."""
 
-    def invalidateCachedMetadata(self, zip):
-        aff4cache = os.path.join(expanduser("~"), ".aff4")
-        cached_turtle = os.path.join(aff4cache, "%s.hdt" % str(zip.urn)[7:])
-        cached_turtle_index = cached_turtle + ".index.v1-1"
-        for f in [cached_turtle, cached_turtle_index]:
-            if os.path.exists(f):
-                LOGGER.debug("Invalidating HDT index %s" % f)
-                os.unlink(f)
-
-    def createHDTviaLib(self, zip, cached_turtle):
-        try:
-            temp = tempfile.NamedTemporaryFile(delete=False)
-            LOGGER.debug("Creating HDT index %s" % cached_turtle)
-            LOGGER.debug("Creating temp turtle file for import %s" % temp.name)
-            try:
-                with zip.OpenZipSegment("information.turtle") as fd:
-                    streams.WriteAll(fd, temp)
-                temp.close()
-            except Exception as e:
-                # no turtle yet
-                return
+    def __init__(self, resolver):
+        self.store = triple_store.Columns(resolver.store)
+        self.transient_store = triple_store.Columns(resolver.transient_store)
+        self.namespaces = []
+        if resolver.aff4NS is not None:
+            self.namespaces.append(str(resolver.aff4NS))
 
-            doc = hdt.generate_hdt(temp.name, "aff4://foo")
-            retcode = doc.save_to_hdt(cached_turtle)
 
-            if retcode != 0:
-                print("rdf2hdt failed", -retcode, file=sys.stderr)
-            else:
-                pass
+def _ParseTurtle(piece):
+    filename, offset, header, start, end, volume_urn = piece
+    with open(filename, "rb") as fd:
+        fd.seek(offset)
+        data = fd.read(header)
+        fd.seek(offset + start)
+        data += fd.read(end - start)
 
-        except:
-            traceback.print_exc()
-            raise Exception("rdf2dht failed. Please make data_store.HAS_HDT=False until this is fixed. ")
+    resolver = MemoryDataStore()
+    resolver.LoadFromTurtle(io.BytesIO(data), rdfvalue.URN(volume_urn))
+    return _ParsedTurtle(resolver)
 
-        finally:
-            os.unlink(temp.name)
 
+# With large information.turtle files, parsing dominates the time taken to open
+# a volume. This resolver parses it once, and keeps a binary index of it.
+class IndexedDataStore(MemoryDataStore):
+    """A resolver which reads the metadata of volumes from cached indexes.
+
+    The first time a volume is opened for reading its turtle is parsed and
+    written to an index (see triple_index) in INDEX_CACHE_DIR. Later opens map
+    the index instead, as long as the central directory shows the same turtle
+    members. Queries combine the triples of the indexes with those held in
+    memory, and values Set() or subjects deleted since hide the indexed ones.
+
+    Volumes opened for writing are loaded into memory, since their metadata is
+    rewritten from there.
+    """
+
+    def __init__(self, lex=lexicon.standard, parent=None):
+        super(IndexedDataStore, self).__init__(lex=lex, parent=parent)
+        self.indexes = collections.OrderedDict()
+
+        # Index terms of the subjects deleted, and the (subject, predicate)
+        # pairs Set(), since the indexes were opened.
+        self.deleted = set()
+        self.replaced = set()
+
+    def _IndexPath(self, zip):
+        return os.path.join(INDEX_CACHE_DIR, "%s.index" % str(zip.urn)[7:])
+
+    def _IndexKey(self, zip):
+        """A digest of the central directory entries of the volume's turtle."""
+        digest = hashlib.sha256(utils.SmartStr(zip.urn.value))
+        for name in ["information.turtle"] + list(self._TurtleDeltas(zip)):
+            info = zip.members[escaping.urn_from_member_name(
+                name, zip.urn, zip.version)]
+            digest.update(utils.SmartStr("%s %d %d %d %d\n" % (
+                name, info.local_header_offset, info.compress_size,
+                info.file_size, info.crc32)))
+        return digest.digest()
+
+    def invalidateCachedMetadata(self, zip):
+        path = self._IndexPath(zip)
+        if os.path.exists(path):
+            LOGGER.debug("Invalidating metadata index %s" % path)
+            os.unlink(path)
 
     def loadMetadata(self, zip):
-        # Load the turtle metadata.
-        aff4cache = os.path.join(expanduser("~"), ".aff4")
-        if not os.path.exists(aff4cache):
+        if (zip.properties.writable or zip.checkpoint_turtle or
+                not zip.ContainsSegment("information.turtle")):
+            if zip.urn in self.indexes:
+                self._LoadIndex(zip.urn)
+            return super(IndexedDataStore, self).loadMetadata(zip)
+
+        if zip.urn in self.loadedVolumes:
+            return
+
+        index = self._OpenIndex(zip)
+        if index is None:
+            return
+
+        self.indexes[zip.urn] = index
+        self.loadedVolumes.append(zip.urn)
+        self._SetNamespaces(index.namespaces)
+
+        # As LoadFromTurtle does, note the volume which stores each image.
+        type_id = index.Lookup(lexicon.AFF4_TYPE)
+        image_id = index.Lookup(lexicon.AFF4_IMAGE_TYPE)
+        if type_id is not None and image_id is not None:
+            for subject in index.Match(type_id, image_id):
+                self.Add(lexicon.transient_graph, index.Term(subject),
+                         lexicon.AFF4_STORED, zip.urn)
+
+    def _OpenIndex(self, zip):
+        """The index of a volume, built if it is missing or stale.
+
+        Returns None if the index can not be written, in which case the
+        metadata is loaded into memory instead.
+        """
+        key = self._IndexKey(zip)
+        path = self._IndexPath(zip)
+        if os.path.exists(path):
             try:
-                os.makedirs(aff4cache)
+                index = triple_index.TripleIndex(path)
+                if index.key == key:
+                    return index
+                index.Close()
+            except (IOError, OSError, triple_index.InvalidIndex) as e:
+                LOGGER.debug("Rebuilding metadata index %s: %s", path, e)
+
+        LOGGER.debug("Creating metadata index %s" % path)
+        parsed = MemoryDataStore(self.lexicon)
+        MemoryDataStore.loadMetadata(parsed, zip)
+
+        strings = parsed.urns.strings
+        triples = ((strings[subject], strings[predicate], value)
+                   for subject in parsed.store.SubjectIds()
+                   for predicate, values in parsed.store.Items(subject)
+                   for value in values)
+        namespaces = []
+        if parsed.aff4NS is not None:
+            namespaces.append(str(parsed.aff4NS))
+
+        try:
+            try:
+                os.makedirs(INDEX_CACHE_DIR)
             except OSError as exc:  # Guard against race condition
                 if exc.errno != errno.EEXIST:
                     raise
-        cached_turtle = os.path.join(aff4cache, "%s.hdt" % str(zip.urn)[7:])
-        if not os.path.exists(cached_turtle):
-            self.createHDTviaLib(zip, cached_turtle)
 
-        if os.path.exists(cached_turtle):
-            # assume we have a HDT cache of turtle at this point
-            self.hdt = HDTDocument(cached_turtle)
+            triple_index.Write(path, triples, key, namespaces)
+            return triple_index.TripleIndex(path)
+        except (IOError, OSError) as e:
+            LOGGER.info("Unable to write metadata index %s: %s", path, e)
+            self.Merge(parsed)
+            return None
+
+    def _LoadIndex(self, volume_urn):
+        """Moves the triples of a volume's index into memory."""
+        index = self.indexes.pop(volume_urn)
+        intern = self.urns.Intern
+        for subject_id in index.Subjects():
+            subject = index.Term(subject_id)
+            if subject in self.deleted:
+                continue
+
+            for predicate_id, objects in index.Items(subject_id):
+                predicate = index.Term(predicate_id)
+                if (subject, predicate) in self.replaced:
+                    continue
+                for value in objects:
+                    self.store.Add(intern(subject), intern(predicate),
+                                   index.Value(value))
+
+        index.Close()
+        self.turtle_versions[volume_urn] = self.store.version
+
+    def _Term(self, urn):
+        """The index term of a URN or string."""
+        urn_id = self.urns.Lookup(urn)
+        if urn_id is not None:
+            return self.urns.strings[urn_id]
+        return triple_store.Normalize(utils.SmartUnicode(urn))
+
+    def _InMemory(self, subject):
+        subject_id = self.urns.ids.get(subject)
+        return subject_id is not None and subject_id in self.store.heads
+
+    def _IndexValues(self, subject, predicate):
+        """The indexed values of (subject, predicate) which are not hidden."""
+        if subject in self.deleted or (subject, predicate) in self.replaced:
+            return []
+
+        result = []
+        for index in self.indexes.values():
+            subject_id = index.Lookup(subject)
+            predicate_id = index.Lookup(predicate)
+            if subject_id is not None and predicate_id is not None:
+                for value in index.Objects(subject_id, predicate_id):
+                    result.append(index.Value(value))
+        return result
 
+    def _StoreValues(self, subject, predicate):
+        """The values of (subject, predicate) outside the transient graph."""
+        subject = self._Term(subject)
+        predicate = self._Term(predicate)
+        result = self._IndexValues(subject, predicate)
+        for value in self.QuerySubjectPredicateInternal(self.store, subject, predicate):
+            if value not in result:
+                result.append(value)
+        return result
+
+    def _IndexSubjects(self, prefix=""):
+        """Yields the indexed subjects which are not deleted or in memory."""
+        seen = set()
+        for index in self.indexes.values():
+            if prefix:
+                subjects = index.SubjectsWithPrefix(prefix)
+            else:
+                subjects = (index.Term(x) for x in index.Subjects())
+
+            for subject in subjects:
+                if (subject in seen or subject in self.deleted or
+                        self._InMemory(subject)):
+                    continue
+                if len(self.indexes) > 1:
+                    seen.add(subject)
+                yield subject
+
+    def DeleteSubject(self, subject):
+        super(IndexedDataStore, self).DeleteSubject(subject)
+        if self.indexes:
+            self.deleted.add(self._Term(subject))
+
+    def Set(self, graph, subject, attribute, value):
+        super(IndexedDataStore, self).Set(graph, subject, attribute, value)
+        if graph != transient_graph and self.indexes:
+            self.replaced.add((self._Term(subject), self._Term(attribute)))
+
+    def isImageStream(self, subject):
+        if not self.indexes:
+            return super(IndexedDataStore, self).isImageStream(subject)
+
+        for o in self._StoreValues(subject, lexicon.AFF4_TYPE):
+            if o.value == lexicon.AFF4_LEGACY_IMAGE_TYPE or o.value == lexicon.AFF4_IMAGE_TYPE:
+                return True
+        return False
+
+    def Get(self, graph, subject, attribute):
+        if graph == transient_graph or not self.indexes:
+            return super(IndexedDataStore, self).Get(graph, subject, attribute)
+
+        res = list(self.QuerySubjectPredicate(graph, subject, attribute))
+        if not res:
+            return [None]
+        return res
+
+    def QuerySubjectPredicate(self, graph, subject, predicate):
+        if graph == transient_graph or not self.indexes:
+            for val in super(IndexedDataStore, self).QuerySubjectPredicate(
+                    graph, subject, predicate):
+                yield val
+            return
+
+        if graph == lexicon.any or graph == None:
+            for val in self.QuerySubjectPredicateInternal(self.transient_store, subject, predicate):
+                yield val
+        for val in self._StoreValues(subject, predicate):
+            yield val
 
-    # this implementation currently not tested
-    # and it is super ugly. We are materializing all triples just to
-    # list all the subjects.
-    # TODO: Implement subject iterator in pyHDT
     def QuerySubject(self, graph, subject_regex=None):
-        if graph == transient_graph:
-            yield super(HDTAssistedDataStore, self).QuerySubject(transient_graph, subject_regex)
+        for subject in super(IndexedDataStore, self).QuerySubject(graph, subject_regex):
+            yield subject
 
-        subject_regex = re.compile(utils.SmartStr(subject_regex))
-        (triples, cardinality) = self.hdt.search_triples("", "?", "?")
-        seen_subject = []
+        if graph == transient_graph or not self.indexes:
+            return
 
-        for (s,p,o) in triples:
-            if subject_regex is not None and subject_regex.match(s):
-                if s not in seen_subject:
-                    seen_subject.add(s)
-                    yield rdfvalue.URN().UnSerializeFromString(s)
+        prefix = ""
+        if subject_regex is not None:
+            subject_regex = utils.SmartUnicode(subject_regex)
+            prefix = triple_store.LiteralPrefix(subject_regex)
+            subject_regex = re.compile(subject_regex)
 
-        for s in super(HDTAssistedDataStore, self).QuerySubject(graph, subject_regex=subject_regex):
-            if s not in seen_subject:
-                seen_subject.add(s)
-                yield s
+        for subject in self._IndexSubjects(prefix):
+            if subject_regex is None or subject_regex.match(subject):
+                yield rdfvalue.URN(subject)
+
+    def SelectSubjectsByPrefix(self, graph, prefix):
+        for subject in super(IndexedDataStore, self).SelectSubjectsByPrefix(graph, prefix):
+            yield subject
+
+        if graph == transient_graph or not self.indexes:
+            return
+
+        for subject in self._IndexSubjects(utils.SmartUnicode(prefix)):
+            yield rdfvalue.URN(subject)
 
-    # not yet implemented
     def QueryPredicate(self, graph, predicate):
-        if graph == transient_graph:
-            yield super(HDTAssistedDataStore, self).QueryPredicate(transient_graph, predicate)
+        for result in super(IndexedDataStore, self).QueryPredicate(graph, predicate):
+            yield result
+
+        if graph == transient_graph or not self.indexes:
+            return
 
-        yield super(HDTAssistedDataStore, self).QueryPredicate(graph, predicate)
+        predicate = self._Term(predicate)
+        for index in self.indexes.values():
+            predicate_id = index.Lookup(predicate)
+            if predicate_id is None:
+                continue
 
-    def QueryPredicateObject(self, graph, predicate, object):
-        (triples, cardinality) = self.hdt.search_triples("", predicate, object)
+            for subject_id, value in index.Scan(predicate_id):
+                subject = index.Term(subject_id)
+                if subject in self.deleted or (subject, predicate) in self.replaced:
+                    continue
 
-        for (s,p,o) in triples:
-            yield rdfvalue.URN(s)
+                value = index.Value(value)
+                if self._InMemory(subject) and value in list(
+                        self.QuerySubjectPredicateInternal(self.store, subject, predicate)):
+                    continue
+                yield rdfvalue.URN(subject), rdfvalue.URN(predicate), value
 
-        for subject in super(HDTAssistedDataStore, self).QueryPredicateObject(graph, predicate, object):
+    def QueryPredicateObject(self, graph, predicate, object):
+        seen = set()
+        for subject in super(IndexedDataStore, self).QueryPredicateObject(
+                graph, predicate, object):
+            seen.add(subject.value)
             yield subject
 
-    def Get(self, graph, subject, attribute):
-        if self.hdt == None:
-            return super(HDTAssistedDataStore, self).Get(graph, subject, attribute)
-        else:
-            # we use a set here as we some implementations might pass up an object from
-            # the persisted graph and the transient graph. The set lets us remove duplicates
-            res = set(self.QuerySubjectPredicate(graph, subject, attribute))
-            if len(res) == 1:
-                return list(res)
-            return list(res)
+        if graph == transient_graph or not self.indexes:
+            return
 
-    def QuerySubjectPredicate(self, graph, subject, predicate):
-        for o in super(HDTAssistedDataStore, self).QuerySubjectPredicate(graph, subject, predicate):
-            yield o
+        predicate = self._Term(predicate)
+        if isinstance(object, (rdfvalue.URN, six.string_types)):
+            term = self._Term(object)
+        else:
+            term = triple_index.EncodeValue(object)
+
+        for index in self.indexes.values():
+            predicate_id = index.Lookup(predicate)
+            object_id = index.Lookup(term)
+            if predicate_id is None or object_id is None:
+                continue
+
+            for subject_id in index.Match(predicate_id, object_id):
+                subject = index.Term(subject_id)
+                if (subject in seen or subject in self.deleted or
+                        (subject, predicate) in self.replaced):
+                    continue
+                seen.add(subject)
+                yield rdfvalue.URN(subject)
 
-        if self.hdt == None:
+    def QueryPredicatesBySubject(self, graph, subject):
+        if graph == transient_graph or not self.indexes:
+            for result in super(IndexedDataStore, self).QueryPredicatesBySubject(
+                    graph, subject):
+                yield result
             return
 
+        items = collections.OrderedDict()
+        term = self._Term(subject)
+        if term not in self.deleted:
+            for index in self.indexes.values():
+                subject_id = index.Lookup(term)
+                if subject_id is None:
+                    continue
+                for predicate_id, objects in index.Items(subject_id):
+                    predicate = index.Term(predicate_id)
+                    if (term, predicate) not in self.replaced:
+                        items.setdefault(predicate, []).extend(
+                            index.Value(x) for x in objects)
+
+        subject_id = self.urns.Lookup(subject)
+        if subject_id is not None:
+            for predicate, values in self.store.Items(subject_id):
+                existing = items.setdefault(self.urns.strings[predicate], [])
+                existing.extend(x for x in values if x not in existing)
+
+        for predicate, values in items.items():
+            if len(values) == 1:
+                values = values[0]
+            yield (rdfvalue.URN(predicate), values)
+
+
+# Acquisitions of millions of files hold more metadata than fits in memory
+# until the volume is closed and its turtle written out.
+class SpillingDataStore(MemoryDataStore):
+    """A resolver which keeps at most max_triples triples of each graph in
+    memory.
+
+    When a graph grows past that bound the subjects changed longest ago are
+    moved to a SpillStore on disk (in spill_dir, or sqlite's temporary
+    directory) until half of it is left, and the URNs only they used are
+    forgotten. Writing to a spilled subject brings it back into memory, while
+    reads and queries are answered from both.
+    """
+
+    PERSISTENT = 0
+    TRANSIENT = 1
+
+    def __init__(self, lex=lexicon.standard, parent=None,
+                 max_triples=SPILL_MAX_TRIPLES, spill_dir=None):
+        super(SpillingDataStore, self).__init__(lex=lex, parent=parent)
+        self.max_triples = max_triples
+        self.spill_dir = spill_dir
+        self.spill = spill_store.SpillStore(spill_dir)
+
+    def _Graph(self, graph):
         if graph == transient_graph:
+            return self.transient_store, self.TRANSIENT
+        return self.store, self.PERSISTENT
+
+    def _Graphs(self, graph):
+        """The (store, graph number) pairs to read, in the order Get() does."""
+        if graph == lexicon.any or graph == None:
+            return ((self.transient_store, self.TRANSIENT),
+                    (self.store, self.PERSISTENT))
+        return (self._Graph(graph),)
+
+    def _Key(self, urn):
+        """The string a URN is spilled under."""
+        urn_id = self.urns.Lookup(urn)
+        if urn_id is not None:
+            return self.urns.strings[urn_id]
+        if isinstance(urn, rdfvalue.URN):
+            urn = urn.value
+        return triple_store.Normalize(utils.SmartUnicode(urn))
+
+    def _InMemory(self, store, subject):
+        subject_id = self.urns.Lookup(subject)
+        return subject_id is not None and subject_id in store.heads
+
+    def _Fault(self, store, graph, subject):
+        """Moves a spilled subject back into memory."""
+        if not len(self.spill) or self._InMemory(store, subject):
             return
 
-        if isinstance(subject, rdfvalue.URN):
-            subject = subject.SerializeToString()
+        taken = self.spill.Take(graph, self._Key(subject))
+        if taken is None:
+            return
+
+        version, items = taken
+        intern = self.urns.Intern
+        subject_id = intern(subject)
+        for predicate, values in items:
+            predicate_id = intern(predicate)
+            for value in values:
+                store.Add(subject_id, predicate_id, value)
+
+        # Coming back is not a change to write out.
+        store.changed[subject_id] = version
+
+    def _Bound(self, store, graph):
+        if len(store.predicates) > self.max_triples:
+            self._Spill(store, graph)
+
+    def _Spill(self, store, graph):
+        """Spills the least recently changed subjects of a store."""
+        strings = self.urns.strings
+        counts = dict((x, len(store.Rows(x))) for x in store.heads)
+        live = sum(counts.values())
+        spilled = 0
+        for subject in sorted(store.heads, key=store.changed.get):
+            if live <= self.max_triples // 2:
+                break
+
+            self.spill.Put(graph, strings[subject], store.changed[subject],
+                           [(strings[p], values) for p, values in store.Items(subject)])
+            store.RemoveSubject(subject)
+            live -= counts[subject]
+            spilled += 1
+
+        self.spill.Commit()
+        store.Compact()
+
+        # The other store may still index subjects deleted from it, whose
+        # strings are about to be forgotten.
+        for other in (self.store, self.transient_store):
+            if other is not store:
+                other.DropRemovedSubjects()
+        self.urns.Retain(self.store.ReferencedIds() |
+                         self.transient_store.ReferencedIds())
+        LOGGER.debug("Spilled %d subjects to disk", spilled)
+
+    def _Values(self, store, graph, subject, attribute):
+        if self._InMemory(store, subject):
+            attribute_id = self.urns.Lookup(attribute)
+            if attribute_id is None:
+                return []
+            return store.Values(self.urns.Lookup(subject), attribute_id)
+
+        if not len(self.spill):
+            return []
+        return self.spill.Values(graph, self._Key(subject), self._Key(attribute))
+
+    def Add(self, graph, subject, attribute, value):
+        store, number = self._Graph(graph)
+        self._Fault(store, number, subject)
+        super(SpillingDataStore, self).Add(graph, subject, attribute, value)
+        self._Bound(store, number)
+
+    def Set(self, graph, subject, attribute, value):
+        store, number = self._Graph(graph)
+        self._Fault(store, number, subject)
+        super(SpillingDataStore, self).Set(graph, subject, attribute, value)
+        self._Bound(store, number)
+
+    def DeleteSubject(self, subject):
+        super(SpillingDataStore, self).DeleteSubject(subject)
+        if len(self.spill):
+            self.spill.Remove(self.PERSISTENT, self._Key(subject))
+
+    def _AddTurtleTriples(self, triples, volume_arn):
+        store, number = self._Graph(volume_arn)
+
+        def Triples():
+            for i, triple in enumerate(triples):
+                if not i % 4096:
+                    self._Bound(store, number)
+                self._Fault(store, number, triple[0])
+                yield triple
+
+        super(SpillingDataStore, self)._AddTurtleTriples(Triples(), volume_arn)
+        self._Bound(store, number)
+
+    def _AddParsedTurtle(self, parsed, volume_arn):
+        # A triple at a time, so the graph is kept within its bound. The
+        # transient triples are added again from the persistent ones.
+        self._AddTurtleTriples(parsed.store, volume_arn)
+        self._SetNamespaces(parsed.namespaces)
+
+    def Merge(self, other):
+        for store, number, other_store in (
+                (self.store, self.PERSISTENT, other.store),
+                (self.transient_store, self.TRANSIENT, other.transient_store)):
+            if isinstance(other_store, triple_store.Columns):
+                other_store = set(other_store.strings[x]
+                                  for x in other_store.subjects)
+            for subject in other_store:
+                self._Fault(store, number, subject)
+
+        super(SpillingDataStore, self).Merge(other)
+        self._Bound(self.store, self.PERSISTENT)
+        self._Bound(self.transient_store, self.TRANSIENT)
+
+    def isImageStream(self, subject):
+        for o in self._Values(self.store, self.PERSISTENT, subject, lexicon.AFF4_TYPE):
+            if o.value == lexicon.AFF4_LEGACY_IMAGE_TYPE or o.value == lexicon.AFF4_IMAGE_TYPE:
+                return True
+        return False
+
+    def Get(self, graph, subject, attribute):
+        res = []
+        for store, number in self._Graphs(graph):
+            res.extend(self._Values(store, number, subject, attribute))
+
+        if not res:
+            return [None]
+        return res
+
+    def QuerySubjectPredicateInternal(self, store, subject, predicate):
+        for val in self._Values(store, self._Number(store), subject, predicate):
+            yield val
+
+    def QueryPredicatesBySubject(self, graph, subject):
+        store, number = self._Graph(graph)
+        if self._InMemory(store, subject) or not len(self.spill):
+            for result in super(SpillingDataStore, self).QueryPredicatesBySubject(
+                    graph, subject):
+                yield result
+            return
+
+        for pred, values in self.spill.Items(number, self._Key(subject)):
+            if len(values) == 1:
+                values = values[0]
+            yield (rdfvalue.URN(pred), values)
+
+    def _Number(self, store):
+        if store is self.transient_store:
+            return self.TRANSIENT
+        return self.PERSISTENT
+
+    # Queries collect their results before yielding any, since a store may be
+    # compacted by a write made while the caller iterates. Spilled subjects
+    # are older, so they come first.
+    def _SubjectsWithPrefix(self, graph, prefix):
+        result = []
+        for store in self._Stores(graph):
+            # Both are sorted.
+            result.extend(heapq.merge(
+                list(store.SubjectsWithPrefix(prefix)),
+                self.spill.Subjects(self._Number(store), prefix)))
+        return result
+
+    def QuerySubject(self, graph, subject_regex=None):
+        prefix = ""
+        if subject_regex is not None:
+            subject_regex = utils.SmartUnicode(subject_regex)
+            prefix = triple_store.LiteralPrefix(subject_regex)
+            subject_regex = re.compile(subject_regex)
+
+        if prefix:
+            subjects = self._SubjectsWithPrefix(graph, prefix)
         else:
-            subject = utils.SmartUnicode(subject)
+            subjects = []
+            for store in self._Stores(graph):
+                subjects.extend(self.spill.Subjects(self._Number(store)))
+                subjects.extend(store)
 
-        if isinstance(predicate, rdfvalue.URN):
-            predicate = predicate.SerializeToString()
+        for subject in subjects:
+            if subject_regex is None or subject_regex.match(subject):
+                yield rdfvalue.URN(subject)
+
+    def SelectSubjectsByPrefix(self, graph, prefix):
+        for subject in self._SubjectsWithPrefix(graph, utils.SmartUnicode(prefix)):
+            yield rdfvalue.URN(subject)
+
+    def QueryPredicate(self, graph, predicate):
+        result = []
+        if len(self.spill):
+            key = self._Key(predicate)
+            for store in self._Stores(graph):
+                for subject, value in self.spill.Scan(self._Number(store), key):
+                    result.append((rdfvalue.URN(subject), rdfvalue.URN(key), value))
+
+        result.extend(super(SpillingDataStore, self).QueryPredicate(graph, predicate))
+        for item in result:
+            yield item
+
+    def QueryPredicateObject(self, graph, predicate, object):
+        result = []
+        if len(self.spill):
+            key = self._Key(predicate)
+            for store in self._Stores(graph):
+                number = self._Number(store)
+                subjects = []
+                if isinstance(object, (rdfvalue.URN, six.string_types)):
+                    subjects.extend(self.spill.Match(number, key, self._Key(object)))
+                for subject, value in self.spill.Literals(number, key):
+                    if value == object and subject not in subjects:
+                        subjects.append(subject)
+                result.extend(rdfvalue.URN(x) for x in subjects)
+
+        result.extend(super(SpillingDataStore, self).QueryPredicateObject(
+            graph, predicate, object))
+        for subject in result:
+            yield subject
+
+    def _ChangedSince(self, version):
+        if super(SpillingDataStore, self)._ChangedSince(version):
+            return True
+        for _ in self.spill.ChangedSince(self.PERSISTENT, version):
+            return True
+        return False
+
+    def _TurtleSubjects(self, since=None):
+        for result in super(SpillingDataStore, self)._TurtleSubjects(since):
+            yield result
+
+        if since is None:
+            subjects = self.spill.Subjects(self.PERSISTENT)
         else:
-            predicate = utils.SmartUnicode(predicate)
+            subjects = self.spill.ChangedSince(self.PERSISTENT, since)
+        for subject in subjects:
+            yield subject, self.spill.Items(self.PERSISTENT, subject)
+
+    def _WriteTurtleSegment(self, zipcontainer, name, compression_method, since=None):
+        # The turtle of every spilled subject would not fit in a segment's
+        # memory buffer either, so it is written aside and streamed in.
+        with tempfile.TemporaryFile(dir=self.spill_dir) as fd:
+            self._WriteTurtle(fd, zipcontainer.urn, since=since)
+            fd.seek(0)
+
+            with zipcontainer.CreateZipSegment(name) as turtle_segment:
+                turtle_segment.compression_method = compression_method
+                turtle_segment.WriteStream(fd)
+            turtle_segment.Close()
+
+
+# Opening a volume only needs a handful of its subjects, however much metadata
+# it holds.
+class LazyDataStore(MemoryDataStore):
+    """A resolver which parses the metadata of volumes as it is queried.
 
-        (triples, cardinality) = self.hdt.search_triples(subject, predicate, "")
+    Loading a volume only finds the subject blocks of its turtle (see
+    turtle.BlockIndex). A subject's blocks are parsed the first time it is read
+    or written. Queries by predicate or value parse the blocks which mention
+    the predicate or value, and queries by subject list the unparsed subjects
+    without parsing them.
 
-        for (s,p,o) in triples:
-            if o.startswith("\""):
-                # it is a literal
-                (v,t) = o.split("^^")
-                v = v.replace("\"", "")
-                t = t[1:len(t)-1]
+    Turtle laid out otherwise, and the metadata of volumes opened for writing,
+    are parsed as MemoryDataStore does.
+    """
 
-                datatype = rdflib.URIRef(t)
-                if datatype in registry.RDF_TYPE_MAP:
-                    o = registry.RDF_TYPE_MAP[datatype](v)
+    def __init__(self, lex=lexicon.standard, parent=None):
+        super(LazyDataStore, self).__init__(lex=lex, parent=parent)
+
+        # (volume urn, BlockIndex) of each turtle member, and the unparsed
+        # blocks of each subject as [(volume urn, BlockIndex, block)].
+        self.block_indexes = []
+        self.pending = {}
+        self.sorted_pending = None
+
+    @staticmethod
+    def _Key(urn):
+        """The string the store keys a URN by."""
+        if isinstance(urn, rdfvalue.URN):
+            urn = urn.value
+        urn = utils.SmartUnicode(urn)
+        if NORMAL_URN.match(urn):
+            return urn
+        return triple_store.Normalize(urn)
+
+    def loadMetadata(self, zip):
+        if zip.properties.writable or zip.checkpoint_turtle:
+            return super(LazyDataStore, self).loadMetadata(zip)
+
+        if zip.urn in self.loadedVolumes:
+            return
+
+        deltas = list(self._TurtleDeltas(zip))
+        for name in ["information.turtle"] + deltas:
+            with zip.OpenZipSegment(name) as fd:
+                data = streams.ReadAll(fd)
+
+            try:
+                index = turtle.BlockIndex(data)
+            except turtle.UnsupportedSyntax as e:
+                LOGGER.debug("Parsing %s of %s: %s", name, zip.urn, e)
+                if name in deltas:
+                    self._LoadTurtleDelta(data, zip.urn)
                 else:
-                    # Default to a string literal.
-                    o = rdfvalue.XSDString(v)
-            elif o.startswith("<"):
-                o = rdfvalue.URN(utils.SmartUnicode(o))
-            elif o.startswith("aff4://"):
-                o = rdfvalue.URN(utils.SmartUnicode(o))
-            else:
-                o = rdfvalue.URN(utils.SmartUnicode(o))
+                    self.LoadFromTurtle(io.BytesIO(data), zip.urn)
+                continue
+
+            self._SetNamespaces(index.namespaces.values())
+            self.block_indexes.append((zip.urn, index))
+            replaced = set()
+            for block, subject in enumerate(index.subjects):
+                key = self._Key(subject)
+                if name in deltas and key not in replaced:
+                    # A delta holds the whole of each subject it mentions, so
+                    # what was loaded for them before is dropped unparsed.
+                    replaced.add(key)
+                    self.pending.pop(key, None)
+                    super(LazyDataStore, self).DeleteSubject(subject)
+                self.pending.setdefault(key, []).append((zip.urn, index, block))
+            self.sorted_pending = None
+
+        self.loadedVolumes.append(zip.urn)
+        self.turtle_versions[zip.urn] = self.store.version
+
+    def _ParseKey(self, key):
+        blocks = self.pending.pop(key, None)
+        if blocks is None:
+            return
 
-            yield o
+        if not self.pending:
+            self.block_indexes = []
+            self.sorted_pending = None
 
+        for volume_urn, index, block in blocks:
+            stream = io.BytesIO(index.Block(block))
+            strays = []
+            try:
+                reader = turtle.TurtleReader(stream)
+                self._AddTurtleTriples(self._Strays(
+                    reader, index.subjects[block], strays), volume_urn)
+            except turtle.UnsupportedSyntax as e:
+                LOGGER.debug("Parsing turtle with rdflib: %s", e)
+                stream.seek(0)
+                self._LoadFromTurtleWithRdflib(stream, volume_urn)
+
+            if strays:
+                # The block is not the whole of its subject's statements, so
+                # the index can not be trusted.
+                LOGGER.debug("Parsing all the metadata, as %s is in the block "
+                             "of %s", strays[0], index.subjects[block])
+                self._ParseAll()
+
+    @staticmethod
+    def _Strays(triples, subject, strays):
+        """Yields triples, noting those of subjects other than subject."""
+        for triple in triples:
+            if triple[0] != subject:
+                strays.append(triple[0])
+            yield triple
+
+    def _Parse(self, subject):
+        """Parses the blocks of a subject, if any are pending."""
+        if self.pending:
+            self._ParseKey(self._Key(subject))
+
+    def _ParseAll(self):
+        for key in list(self.pending):
+            self._ParseKey(key)
+
+    def _ParseMentions(self, iri):
+        """Parses the pending subjects whose blocks may mention an IRI."""
+        if not self.pending:
+            return
 
-    def SelectSubjectsByPrefix(self, graph, prefix):
-        if graph == transient_graph:
-            yield super(HDTAssistedDataStore, self).SelectSubjectsByPrefix(transient_graph, prefix)
+        iri = utils.SmartUnicode(iri)
+        subjects = []
+        for _, index in self.block_indexes:
+            subjects.extend(index.subjects[x] for x in index.Mentions(iri))
+
+        for subject in subjects:
+            self._Parse(subject)
+
+    def _ParseGraph(self, graph, predicate=None):
+        """Parses what the transient graph would hold about predicate.
+
+        The volume which stores each image is only noted as its type is
+        parsed.
+        """
+        if graph != lexicon.any and graph != None and graph != transient_graph:
+            return
+        if predicate is None or predicate == lexicon.AFF4_STORED:
+            self._ParseMentions(lexicon.AFF4_IMAGE_TYPE)
+
+    def _PendingSubjects(self, prefix=""):
+        """The unparsed subjects which start with prefix, in order."""
+        if not self.pending:
+            return []
+
+        if self.sorted_pending is None:
+            self.sorted_pending = sorted(self.pending)
+
+        keys = self.sorted_pending
+        result = []
+        i = bisect.bisect_left(keys, prefix)
+        while i < len(keys) and keys[i].startswith(prefix):
+            if keys[i] in self.pending:
+                result.append(keys[i])
+            i += 1
+        return result
+
+    def Add(self, graph, subject, attribute, value):
+        self._Parse(subject)
+        super(LazyDataStore, self).Add(graph, subject, attribute, value)
+
+    def Set(self, graph, subject, attribute, value):
+        self._Parse(subject)
+        super(LazyDataStore, self).Set(graph, subject, attribute, value)
+
+    def DeleteSubject(self, subject):
+        self._Parse(subject)
+        super(LazyDataStore, self).DeleteSubject(subject)
+
+    def Merge(self, other):
+        self._ParseAll()
+        if isinstance(other, LazyDataStore):
+            other._ParseAll()
+        super(LazyDataStore, self).Merge(other)
 
-        yield super(HDTAssistedDataStore, self).SelectSubjectsByPrefix(graph, prefix)
+    def isImageStream(self, subject):
+        self._Parse(subject)
+        return super(LazyDataStore, self).isImageStream(subject)
+
+    def Get(self, graph, subject, attribute):
+        self._Parse(subject)
+        return super(LazyDataStore, self).Get(graph, subject, attribute)
+
+    def QuerySubjectPredicate(self, graph, subject, predicate):
+        self._Parse(subject)
+        return super(LazyDataStore, self).QuerySubjectPredicate(
+            graph, subject, predicate)
 
     def QueryPredicatesBySubject(self, graph, subject):
+        self._Parse(subject)
+        return super(LazyDataStore, self).QueryPredicatesBySubject(graph, subject)
+
+    # Queries collect their results before yielding any, since the caller may
+    # parse more subjects into the store while it iterates.
+    def QuerySubject(self, graph, subject_regex=None):
+        self._ParseGraph(graph)
+        result = list(super(LazyDataStore, self).QuerySubject(graph, subject_regex))
+        if graph == transient_graph or not self.pending:
+            return iter(result)
+
+        prefix = ""
+        if subject_regex is not None:
+            subject_regex = utils.SmartUnicode(subject_regex)
+            prefix = triple_store.LiteralPrefix(subject_regex)
+            subject_regex = re.compile(subject_regex)
+
+        pending = [rdfvalue.URN(x) for x in self._PendingSubjects(prefix)
+                   if subject_regex is None or subject_regex.match(x)]
+        if prefix:
+            # Both are sorted.
+            return heapq.merge(result, pending)
+        return chain(result, pending)
+
+    def SelectSubjectsByPrefix(self, graph, prefix):
+        self._ParseGraph(graph)
+        result = list(super(LazyDataStore, self).SelectSubjectsByPrefix(graph, prefix))
         if graph == transient_graph:
-            yield super(HDTAssistedDataStore, self).QueryPredicatesBySubject(transient_graph, subject)
+            return iter(result)
+
+        return heapq.merge(result, [rdfvalue.URN(x) for x in
+                                    self._PendingSubjects(utils.SmartUnicode(prefix))])
+
+    def QueryPredicate(self, graph, predicate):
+        self._ParseGraph(graph, predicate)
+        if graph != transient_graph:
+            self._ParseMentions(predicate)
+        return iter(list(super(LazyDataStore, self).QueryPredicate(graph, predicate)))
+
+    def QueryPredicateObject(self, graph, predicate, object):
+        self._ParseGraph(graph, predicate)
+        if graph != transient_graph:
+            if isinstance(object, (rdfvalue.URN, six.string_types)):
+                self._ParseMentions(object)
+            else:
+                self._ParseMentions(predicate)
+        return iter(list(super(LazyDataStore, self).QueryPredicateObject(
+            graph, predicate, object)))
 
-        yield super(HDTAssistedDataStore, self).QueryPredicatesBySubject(graph, subject)
\ No newline at end of file
+    def _TurtleSubjects(self, since=None):
+        self._ParseAll()
+        return super(LazyDataStore, self)._TurtleSubjects(since)
@@ -16,11 +16,13 @@ from __future__ import unicode_literals
 
 from future import standard_library
 standard_library.install_aliases()
+from builtins import range
 from pyaff4 import aff4
 from pyaff4 import data_store
 from pyaff4 import lexicon
 from pyaff4 import rdfvalue
 from pyaff4 import streams
+from pyaff4 import triple_store
 import unittest
 
 import io
@@ -65,6 +67,214 @@ class DataStoreTest(unittest.TestCase):
             lexicon.AFF4_IMAGE_COMPRESSION_SNAPPY))
         self.assertEquals(res, b"foo")
 
+    def testInterning(self):
+        volume_urn = rdfvalue.URN("aff4://volume")
+        image_type = rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE)
+        for i in range(3):
+            subject = "aff4://volume/image%d" % i
+            self.store.Add(volume_urn, subject, lexicon.AFF4_TYPE, image_type)
+            self.store.Add(volume_urn, subject, lexicon.AFF4_TYPE, image_type)
+            self.store.Set(volume_urn, subject, lexicon.AFF4_STREAM_SIZE,
+                           rdfvalue.XSDInteger(i))
+            self.store.Set(volume_urn, subject, lexicon.AFF4_STREAM_SIZE,
+                           rdfvalue.XSDInteger(i * 10))
+
+        # Subjects and predicates may be given as strings or URNs.
+        subject = rdfvalue.URN("aff4://volume/image2")
+        self.assertEquals(self.store.Get(None, subject, lexicon.AFF4_TYPE),
+                          [image_type])
+        result = self.store.GetUnique(
+            None, subject, rdfvalue.URN(lexicon.AFF4_STREAM_SIZE))
+        self.assertEquals(type(result), rdfvalue.XSDInteger)
+        self.assertEquals(result, 20)
+        self.assertEquals(self.store.Get(None, subject, lexicon.AFF4_STORED),
+                          [None])
+
+        self.assertEquals(
+            list(self.store.QueryPredicateObject(
+                None, lexicon.AFF4_TYPE, image_type)),
+            [rdfvalue.URN("aff4://volume/image%d" % i) for i in range(3)])
+
+        self.store.DeleteSubject(subject)
+        self.assertEquals(self.store.Get(None, subject, lexicon.AFF4_TYPE),
+                          [None])
+
+        # The other store interns URNs in another order.
+        other = data_store.MemoryDataStore()
+        other.Add(volume_urn, "aff4://other", lexicon.AFF4_STORED, volume_urn)
+        other.Add(volume_urn, self.hello_urn, lexicon.AFF4_STORED, volume_urn)
+        self.store.Merge(other)
+        self.assertEquals(
+            self.store.Get(None, self.hello_urn, lexicon.AFF4_STORED), [volume_urn])
+        self.assertEquals(
+            self.store.GetUnique(None, self.hello_urn, lexicon.AFF4_TYPE), "bar")
+
+    def testIndexes(self):
+        volume_urn = rdfvalue.URN("aff4://volume")
+        image_type = rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE)
+        map_type = rdfvalue.URN(lexicon.AFF4_MAP_TYPE)
+        subjects = [rdfvalue.URN("aff4://volume/stream%d" % i) for i in range(4)]
+        for subject in subjects:
+            self.store.Set(volume_urn, subject, lexicon.AFF4_TYPE, image_type)
+
+        # Overwritten and deleted values drop out of the index.
+        self.store.Set(volume_urn, subjects[1], lexicon.AFF4_TYPE, map_type)
+        self.store.Set(volume_urn, subjects[2], lexicon.AFF4_TYPE, map_type)
+        self.store.Set(volume_urn, subjects[2], lexicon.AFF4_TYPE, image_type)
+        self.store.DeleteSubject(subjects[3])
+
+        self.assertEquals(
+            list(self.store.QueryPredicateObject(
+                volume_urn, lexicon.AFF4_TYPE, lexicon.AFF4_IMAGE_TYPE)),
+            [subjects[0], subjects[2]])
+        self.assertEquals(
+            list(self.store.QueryPredicateObject(
+                volume_urn, lexicon.AFF4_TYPE, map_type)),
+            [subjects[1]])
+
+        # Literals match by value.
+        self.assertEquals(
+            list(self.store.QueryPredicateObject(
+                None, lexicon.AFF4_TYPE, rdfvalue.XSDString("bar"))),
+            [self.hello_urn])
+
+        self.assertEquals(
+            [(x[0], x[2]) for x in self.store.QueryPredicate(
+                volume_urn, lexicon.AFF4_TYPE)],
+            [(self.hello_urn, rdfvalue.XSDString("bar")),
+             (subjects[0], image_type), (subjects[1], map_type),
+             (subjects[2], image_type)])
+
+    def testManyValues(self):
+        volume_urn = rdfvalue.URN("aff4://volume")
+        contains = lexicon.AFF4_NAMESPACE + "contains"
+        members = [volume_urn.Append("member%d" % i) for i in range(100)]
+        for i, member in enumerate(members):
+            self.store.Add(volume_urn, volume_urn, contains, member)
+            self.store.Set(volume_urn, volume_urn, lexicon.AFF4_STREAM_SIZE,
+                           rdfvalue.XSDInteger(i))
+
+        # Values already held are not added again.
+        self.store.Add(volume_urn, volume_urn, contains, members[5])
+        self.store.Add(volume_urn, volume_urn, lexicon.AFF4_STREAM_SIZE,
+                       rdfvalue.XSDInteger(99))
+        self.assertEquals(self.store.Get(volume_urn, volume_urn, contains), members)
+        self.assertEquals(
+            self.store.Get(volume_urn, volume_urn, lexicon.AFF4_STREAM_SIZE), [99])
+
+        # A subject added again after it was deleted only has its new values.
+        self.store.DeleteSubject(volume_urn)
+        self.store.Add(volume_urn, volume_urn, contains, members[1])
+        self.assertEquals(self.store.Get(volume_urn, volume_urn, contains),
+                          [members[1]])
+
+    def testSubjectPrefix(self):
+        volume_urn = rdfvalue.URN("aff4://volume")
+        for name in ["b/2", "a/1", "b/1", "b2", "a/2", "b/10"]:
+            self.store.Set(volume_urn, volume_urn.Append(name),
+                           lexicon.AFF4_STORED, volume_urn)
+
+        self.assertEquals(
+            list(self.store.SelectSubjectsByPrefix(volume_urn, "aff4://volume/b/")),
+            [volume_urn.Append(x) for x in ["b/1", "b/10", "b/2"]])
+
+        # Subjects added or removed after a query are seen by the next one.
+        self.store.Set(volume_urn, volume_urn.Append("b/0"),
+                       lexicon.AFF4_STORED, volume_urn)
+        self.store.DeleteSubject(volume_urn.Append("b/10"))
+        self.assertEquals(
+            list(self.store.SelectSubjectsByPrefix(volume_urn, "aff4://volume/b/")),
+            [volume_urn.Append(x) for x in ["b/0", "b/1", "b/2"]])
+
+        self.assertEquals(
+            list(self.store.QuerySubject(volume_urn, r"aff4://volume/b/\d$")),
+            [volume_urn.Append(x) for x in ["b/0", "b/1", "b/2"]])
+        self.assertEquals(
+            list(self.store.QuerySubject(volume_urn, "aff4://volume/[ab]/2")),
+            [volume_urn.Append(x) for x in ["a/2", "b/2"]])
+        self.assertEquals(
+            list(self.store.QuerySubject(volume_urn, "aff4://hello|aff4://volume/a/1")),
+            [self.hello_urn, volume_urn.Append("a/1")])
+
+    def testLiteralPrefix(self):
+        self.assertEquals(triple_store.LiteralPrefix("aff4://a/b.*"), "aff4://a/b")
+        self.assertEquals(triple_store.LiteralPrefix(r"^aff4://a\.b\d"), "aff4://a.b")
+        self.assertEquals(triple_store.LiteralPrefix("aff4://ab?c"), "aff4://a")
+        self.assertEquals(triple_store.LiteralPrefix("aff4://a|b"), "")
+        self.assertEquals(triple_store.LiteralPrefix("(?i)aff4"), "")
+
+
+class SpillingDataStoreTest(DataStoreTest):
+    """The same tests, with all but the most recent subjects on disk."""
+
+    def setUp(self):
+        self.hello_urn = rdfvalue.URN("aff4://hello")
+        self.store = data_store.SpillingDataStore(max_triples=2)
+        self.store.Set(None,
+            self.hello_urn, rdfvalue.URN(lexicon.AFF4_IMAGE_COMPRESSION_SNAPPY),
+            rdfvalue.XSDString("foo"))
+
+        self.store.Set(None,
+            self.hello_urn, rdfvalue.URN(lexicon.AFF4_TYPE),
+            rdfvalue.XSDString("bar"))
+
+    def tearDown(self):
+        self.store.spill.Close()
+
+    def testSpill(self):
+        volume_urn = rdfvalue.URN("aff4://volume")
+        image_type = rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE)
+        subjects = [volume_urn.Append("image%d" % i) for i in range(10)]
+        for i, subject in enumerate(subjects):
+            self.store.Set(volume_urn, subject, lexicon.AFF4_TYPE, image_type)
+            self.store.Set(volume_urn, subject, lexicon.AFF4_STREAM_SIZE,
+                           rdfvalue.XSDInteger(i))
+
+        # Older subjects are on disk, and their URNs forgotten.
+        self.assertLessEqual(len(self.store.store.predicates), 2)
+        self.assertIsNone(self.store.urns.Lookup(subjects[0]))
+        self.assertEquals(
+            self.store.GetUnique(volume_urn, subjects[0], lexicon.AFF4_STREAM_SIZE), 0)
+
+        # Writing to a spilled subject brings it back, without counting it as
+        # changed until it is.
+        version = self.store.store.version
+        self.store.Set(volume_urn, subjects[3], lexicon.AFF4_STREAM_SIZE,
+                       rdfvalue.XSDInteger(30))
+        self.store.Add(volume_urn, subjects[4], lexicon.AFF4_TYPE, image_type)
+        self.assertEquals(
+            [x[0] for x in self.store._TurtleSubjects(version)],
+            [subjects[3].value])
+
+        new_store = data_store.MemoryDataStore()
+        data = self.store._DumpToTurtle(volume_urn)
+        new_store.LoadFromTurtle(io.BytesIO(data.encode('utf-8')), volume_urn)
+        self.assertEquals(
+            sorted(new_store.QueryPredicateObject(
+                volume_urn, lexicon.AFF4_TYPE, image_type)), subjects)
+        for i, size in ((3, 30), (4, 4), (9, 9)):
+            self.assertEquals(new_store.GetUnique(
+                volume_urn, subjects[i], lexicon.AFF4_STREAM_SIZE), size)
+
+    def testSpillDeleted(self):
+        # Spilling one graph forgets the URNs of subjects deleted from the
+        # other.
+        volume_urn = rdfvalue.URN("aff4://volume")
+        store = data_store.SpillingDataStore(max_triples=10)
+        try:
+            deleted = volume_urn.Append("deleted")
+            store.Add(volume_urn, deleted, lexicon.AFF4_STREAM_SIZE,
+                      rdfvalue.XSDInteger(1))
+            store.DeleteSubject(deleted)
+            for i in range(30):
+                store.Set(lexicon.transient_graph, volume_urn.Append("transient%d" % i),
+                          lexicon.AFF4_STREAM_SIZE, rdfvalue.XSDInteger(i))
+
+            self.assertIsNone(store.urns.Lookup(deleted))
+            self.assertEquals(list(store.QuerySubject(volume_urn, volume_urn)), [])
+        finally:
+            store.spill.Close()
+
 
 class AFF4ObjectCacheMock(data_store.AFF4ObjectCache):
     def GetKeys(self):
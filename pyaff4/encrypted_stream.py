@@ -71,6 +71,11 @@ class RandomImageStream(AFF4SImage):
         self.chunk_count_in_bevy += 1
         self.currentLCA += 1
 
+    def Checkpoint(self):
+        # Bevies are rewritten in place, so there is no durable prefix to
+        # describe.
+        pass
+
     def IsFull(self):
         return self.chunk_count_in_bevy >= self.chunks_per_segment and len(self.buffer) > 0
 
@@ -0,0 +1,191 @@
+from __future__ import unicode_literals
+# Copyright 2019 Schatz Forensic Pty Ltd. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License"); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+# WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+# License for the specific language governing permissions and limitations under
+# the License.
+
+"""Incremental re-acquisition of a device against an earlier image of it.
+
+The source is hashed a chunk at a time and compared with the chunk hashes of
+the baseline image. Only the chunks which changed are stored in the new image's
+data stream. The new map points the unchanged chunks at wherever the baseline
+keeps them, which is usually in another container, so the baseline's container
+must be loaded into the same resolver to read the new image.
+
+The chunk hashes of every incremental image are stored next to its map, so the
+next acquisition only needs to read the baseline when it has none (e.g. the
+first, full, image). Chunks are matched by SHA-256, since a chunk taken to be
+unchanged is never read again; SHA-1 has practical chosen-prefix collisions.
+
+The digests of an image are kept as one byte string, DIGEST_SIZE bytes per
+chunk, rather than an object per chunk.
+"""
+from builtins import object
+from builtins import range
+import hashlib
+import logging
+
+from pyaff4 import aff4
+from pyaff4 import aff4_map
+from pyaff4 import lexicon
+
+LOGGER = logging.getLogger("pyaff4")
+
+DEFAULT_CHUNK_SIZE = 32 * 1024
+
+DIGEST_SIZE = hashlib.sha256().digest_size
+
+# Ranges are added to the map this many at a time.
+RANGE_BATCH = 65536
+
+# Stored chunk hashes are written this many bytes at a time.
+HASH_WRITE_SIZE = 1024 * 1024
+
+
+def BlockHashesURN(image_urn, chunk_size):
+    """The member holding the SHA-256 of each chunk of image_urn."""
+    return image_urn.Append("blockHashes.%d.sha256" % chunk_size)
+
+
+def LoadBlockHashes(resolver, image_urn, chunk_size):
+    """Returns the SHA-256 digests of the chunk_size chunks of an image, one
+    after the other in a byte string.
+
+    Uses the hashes stored by an incremental acquisition if there are any,
+    otherwise reads and hashes the whole image.
+    """
+    try:
+        with resolver.AFF4FactoryOpen(BlockHashesURN(image_urn, chunk_size)) as stored:
+            return stored.Read(stored.Size())
+    except IOError:
+        pass
+
+    if LOGGER.isEnabledFor(logging.INFO):
+        LOGGER.info("Hashing baseline %s", image_urn)
+
+    result = bytearray()
+    with resolver.AFF4FactoryOpen(image_urn) as image:
+        image.SeekRead(0)
+        while True:
+            chunk = image.Read(chunk_size)
+            if not chunk:
+                break
+            result += hashlib.sha256(chunk).digest()
+
+    return result
+
+
+class IncrementalImager(object):
+    """Writes an image of a source, storing only what changed since baseline.
+
+    Usage:
+      imager = IncrementalImager(resolver, volume.urn, image_urn, baseline_urn)
+      imager.WriteStream(device)
+
+    The baseline image (and its container) must be open in resolver.
+    """
+
+    def __init__(self, resolver, volume_urn, image_urn, baseline_urn,
+                 chunk_size=DEFAULT_CHUNK_SIZE):
+        self.resolver = resolver
+        self.volume_urn = volume_urn
+        self.image_urn = image_urn
+        self.baseline_urn = baseline_urn
+        self.chunk_size = chunk_size
+
+        # Bytes read from the source and bytes stored in this image.
+        self.size = 0
+        self.changed = 0
+
+    def _BaselineRanges(self, baseline, offset, length):
+        """Ranges mapping [offset, offset + length) to the baseline's data."""
+        if not isinstance(baseline, aff4_map.AFF4Map):
+            return [(offset, offset, length, baseline.urn)]
+
+        # Point at the baseline's own targets, so a chain of incremental
+        # images never reads through more than one map.
+        result = []
+        for range in baseline.range_map.Overlapping(offset, offset + length):
+            start = max(range.map_offset, offset)
+            end = min(range.map_end, offset + length)
+            result.append((start, range.target_offset_at_map_offset(start),
+                           end - start, baseline.targets[range.target_id]))
+
+        return result
+
+    def WriteStream(self, source, progress=None):
+        if progress is None:
+            progress = aff4.EMPTY_PROGRESS
+
+        baseline_hashes = LoadBlockHashes(self.resolver, self.baseline_urn,
+                                          self.chunk_size)
+        hashes = bytearray()
+
+        with self.resolver.AFF4FactoryOpen(self.baseline_urn) as baseline, \
+                aff4_map.AFF4Map.NewAFF4Map(
+                    self.resolver, self.image_urn, self.volume_urn) as image_map:
+            with self.resolver.AFF4FactoryOpen(
+                    image_map.GetBackingStream()) as data_stream:
+                ranges = []
+                chunk = None
+                while True:
+                    last_chunk = chunk
+                    chunk = source.read(self.chunk_size)
+                    if not chunk:
+                        break
+
+                    digest = hashlib.sha256(chunk).digest()
+                    offset = len(hashes)
+                    hashes += digest
+
+                    if baseline_hashes[offset:offset + DIGEST_SIZE] == digest:
+                        # Unchanged - this may be no ranges at all if the
+                        # baseline has a gap here.
+                        ranges.extend(self._BaselineRanges(
+                            baseline, self.size, len(chunk)))
+                    else:
+                        ranges.append((self.size, data_stream.TellWrite(),
+                                       len(chunk), data_stream.urn))
+                        data_stream.Write(chunk)
+                        self.changed += len(chunk)
+
+                    self.size += len(chunk)
+                    progress.Report(self.size)
+
+                    if len(ranges) >= RANGE_BATCH:
+                        image_map.AddRanges(ranges)
+                        ranges = []
+
+                image_map.AddRanges(ranges)
+
+                # The map ends with its last range, so a gap at the end of the
+                # image must be stored for the image to keep its size.
+                if last_chunk is not None and image_map.Size() < self.size:
+                    offset = self.size - len(last_chunk)
+                    image_map.AddRange(offset, data_stream.TellWrite(),
+                                       len(last_chunk), data_stream.urn)
+                    data_stream.Write(last_chunk)
+                    self.changed += len(last_chunk)
+
+            with self.resolver.AFF4FactoryOpen(self.volume_urn) as volume:
+                with volume.CreateMember(BlockHashesURN(
+                        self.image_urn, self.chunk_size)) as stored:
+                    # A block at a time, rather than copying all of them.
+                    for i in range(0, len(hashes), HASH_WRITE_SIZE):
+                        stored.Write(bytes(hashes[i:i + HASH_WRITE_SIZE]))
+
+            self.resolver.Add(self.volume_urn, self.image_urn,
+                              lexicon.standard.dependentStream, self.baseline_urn)
+
+        if LOGGER.isEnabledFor(logging.INFO):
+            LOGGER.info("Incremental image %s: %d of %d bytes changed",
+                        self.image_urn, self.changed, self.size)
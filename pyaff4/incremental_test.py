@@ -0,0 +1,112 @@
+from __future__ import unicode_literals
+# Copyright 2019 Schatz Forensic Pty Ltd. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License"); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+# WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+# License for the specific language governing permissions and limitations under
+# the License.
+
+from future import standard_library
+standard_library.install_aliases()
+from builtins import range
+import io
+import os
+import shutil
+import tempfile
+import unittest
+
+from pyaff4 import aff4_map
+from pyaff4 import data_store
+from pyaff4 import incremental
+from pyaff4 import lexicon
+from pyaff4 import rdfvalue
+from pyaff4 import zip
+from pyaff4 import plugins
+from pyaff4 import version
+
+
+class IncrementalImagerTest(unittest.TestCase):
+    chunk_size = 1024
+    data = b"".join(b"Block %08d." % i for i in range(6000))[:64 * chunk_size]
+
+    def setUp(self):
+        self.root = tempfile.mkdtemp()
+        self.filenames = [os.path.join(self.root, "image%d.aff4" % i)
+                          for i in range(3)]
+        self.image_urns = [rdfvalue.URN("aff4://f4b1e3e2-6ad6-4fa2-9d6e-2b1c0a5f%04d" % i)
+                           for i in range(3)]
+
+    def tearDown(self):
+        shutil.rmtree(self.root)
+
+    def _open_volumes(self, resolver, count, writable=None):
+        for i in range(count):
+            urn = rdfvalue.URN.FromFileName(self.filenames[i])
+            if i == writable:
+                resolver.Set(lexicon.transient_graph, urn,
+                             lexicon.AFF4_STREAM_WRITE_MODE,
+                             rdfvalue.XSDString("truncate"))
+
+            with zip.ZipFile.NewZipFile(resolver, version.aff4v10, urn) as volume:
+                volume_urn = volume.urn
+
+        return volume_urn
+
+    def _changed(self, data, chunks):
+        data = bytearray(data)
+        for chunk in chunks:
+            offset = chunk * self.chunk_size + 7
+            data[offset:offset + 5] = b"XXXXX"
+        return bytes(data)
+
+    def testIncremental(self):
+        # The full image.
+        with data_store.MemoryDataStore() as resolver:
+            volume_urn = self._open_volumes(resolver, 1, writable=0)
+            with aff4_map.AFF4Map.NewAFF4Map(
+                    resolver, self.image_urns[0], volume_urn) as image:
+                image.WriteStream(io.BytesIO(self.data))
+
+        # Against the full image, which has to be hashed.
+        data_1 = self._changed(self.data, [3, 40])
+        with data_store.MemoryDataStore() as resolver:
+            volume_urn = self._open_volumes(resolver, 2, writable=1)
+            imager = incremental.IncrementalImager(
+                resolver, volume_urn, self.image_urns[1], self.image_urns[0],
+                chunk_size=self.chunk_size)
+            imager.WriteStream(io.BytesIO(data_1))
+            self.assertEquals(imager.changed, 2 * self.chunk_size)
+
+        # Against the first increment, which has its hashes stored. The source
+        # has also grown.
+        data_2 = self._changed(data_1, [5, 10]) + b"Z" * 100
+        with data_store.MemoryDataStore() as resolver:
+            volume_urn = self._open_volumes(resolver, 3, writable=2)
+            imager = incremental.IncrementalImager(
+                resolver, volume_urn, self.image_urns[2], self.image_urns[1],
+                chunk_size=self.chunk_size)
+            imager.WriteStream(io.BytesIO(data_2))
+            self.assertEquals(imager.changed, 2 * self.chunk_size + 100)
+
+        with data_store.MemoryDataStore() as resolver:
+            self._open_volumes(resolver, 3)
+            images = [self.data, data_1, data_2]
+            for i, expected in enumerate(images):
+                with resolver.AFF4FactoryOpen(self.image_urns[i]) as image:
+                    self.assertEquals(image.Size(), len(expected))
+                    self.assertEquals(image.Read(len(expected)), expected)
+
+            # Unchanged chunks point straight at the full image's data.
+            with resolver.AFF4FactoryOpen(self.image_urns[2]) as image:
+                self.assertFalse(self.image_urns[1] in image.targets)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -64,6 +64,8 @@ AFF4_CONTAINS = (AFF4_NAMESPACE + "contains")
 # Each container should have this file which contains the URN of the container.
 AFF4_CONTAINER_DESCRIPTION = "container.description"
 AFF4_CONTAINER_INFO_TURTLE = "information.turtle"
+# Metadata added by each later append session, read after information.turtle.
+AFF4_CONTAINER_INFO_TURTLE_DELTA = "information.turtle/delta%08d"
 AFF4_CONTAINER_INFO_YAML = "information.yaml"
 
 # AFF4 ZipFile containers.
@@ -79,6 +81,10 @@ AFF4_STREAM_ORIGINAL_FILENAME = (AFF4_NAMESPACE + "original_filename")
 # Can be "read", "truncate", "append"
 AFF4_STREAM_WRITE_MODE = (AFF4_VOLATILE_NAMESPACE + "writable")
 
+# The AFF4 version of an open volume, so it can be reopened after it leaves
+# the object cache.
+AFF4_VOLUME_VERSION = (AFF4_VOLATILE_NAMESPACE + "version")
+
 # FileBackedObjects are either marked explicitly or using the file:// scheme.
 AFF4_FILE_TYPE = (AFF4_NAMESPACE + "file")
 
@@ -21,8 +21,12 @@ from pyaff4 import container
 from pyaff4 import data_store
 from pyaff4 import hashes
 from pyaff4 import lexicon
+from pyaff4 import striped
 from pyaff4 import zip
 
+# Bytes read at a time from images striped across several volumes.
+MULTI_READ_SIZE = 8 * 1024 * 1024
+
 
 class LinearHasher(object):
     def __init__(self, listener=None):
@@ -50,20 +54,18 @@ class LinearHasher(object):
             return self.delegate.doHash(mapURI, hashDataType)
 
     def hashMulti(self, urna, urnb, mapURI, hashDataType):
-        (version, lex) = container.Container.identifyURN(urna)
-        resolver = data_store.MemoryDataStore(lex)
-
-        with zip.ZipFile.NewZipFile(resolver, version, urna) as zip_filea:
-            with zip.ZipFile.NewZipFile(resolver, version, urnb) as zip_fileb:
-                if lex == lexicon.standard:
-                    self.delegate = InterimStdLinearHasher(resolver, lex, self.listener)
-                elif lex == lexicon.legacy:
-                    self.delegate = PreStdLinearHasher(resolver, lex, self.listener)
-                else:
-                    raise ValueError
-
-                self.delegate.volume_arn = zip_filea.urn
-                return self.delegate.doHash(mapURI, hashDataType)
+        # Each part is read by its own thread, so read a few stripes at once.
+        hash = hashes.new(hashDataType)
+        with striped.StripedImageReader([urna, urnb], mapURI) as mapStream:
+            remaining = mapStream.Size()
+            while remaining > 0:
+                toRead = min(MULTI_READ_SIZE, remaining)
+                data = mapStream.Read(toRead)
+                assert len(data) == toRead
+                remaining -= len(data)
+                hash.update(data)
+
+        return hashes.newImmutableHash(hash.hexdigest(), hashDataType)
 
     def doHash(self, mapURI, hashDataType):
         hash = hashes.new(hashDataType)
@@ -0,0 +1,252 @@
+from __future__ import unicode_literals
+# Copyright 2019 Schatz Forensic Pty Ltd. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License"); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+# WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+# License for the specific language governing permissions and limitations under
+# the License.
+
+"""Recovery of AFF4 volumes which were not closed cleanly.
+
+If the writer is interrupted before the volume is flushed, the zip central
+directory (and usually information.turtle) is never written. The members
+themselves are intact, so we rebuild the central directory from the local
+file headers and re-derive the metadata of the image streams and maps from
+their bevies, indexes and map segments.
+"""
+from builtins import str
+import logging
+import re
+import struct
+import zlib
+
+import snappy
+
+from pyaff4 import aff4_map
+from pyaff4 import lexicon
+from pyaff4 import rdfvalue
+from pyaff4 import utils
+from pyaff4 import zip
+
+LOGGER = logging.getLogger("pyaff4")
+
+# Bevies of AFF4 Standard image streams are named <stream>/%08d, with the index
+# in <stream>/%08d.index
+BEVY_REGEX = re.compile(r"^(.+)/(\d{8})$")
+
+# How many compressed chunks to try when working out the compression method of
+# a stream.
+COMPRESSION_PROBE_CHUNKS = 8
+
+DEFAULT_CHUNKS_PER_SEGMENT = 1024
+
+
+def Recover(resolver, backing_store_urn, version=None):
+    """Recover the AFF4 volume stored in backing_store_urn.
+
+    Returns the volume URN. The new central directory and metadata are written
+    when the resolver is flushed.
+    """
+    with zip.ZipFile.RecoverZipFile(resolver, version, backing_store_urn) as volume:
+        streams = RecoverImageStreams(resolver, volume)
+        RecoverMaps(resolver, volume, streams)
+        return volume.urn
+
+
+def _HasType(resolver, volume_urn, urn):
+    return any(x is not None for x in resolver.Get(volume_urn, urn, lexicon.AFF4_TYPE))
+
+
+def _ReadMember(volume, member_urn):
+    with volume.OpenMember(member_urn) as member:
+        member.SeekRead(0)
+        return member.Read(member.Size())
+
+
+def _ParseBevyIndex(data):
+    count = len(data) // struct.calcsize("<QI")
+    values = struct.unpack("<" + "QI" * count, data[:count * struct.calcsize("<QI")])
+    return [(values[2*i], values[2*i+1]) for i in range(count)]
+
+
+def _Decompress(chunk):
+    """Returns (compression, uncompressed chunk) or (None, None)."""
+    try:
+        return lexicon.AFF4_IMAGE_COMPRESSION_ZLIB, zlib.decompress(chunk)
+    except zlib.error:
+        pass
+
+    try:
+        return lexicon.AFF4_IMAGE_COMPRESSION_SNAPPY, snappy.decompress(chunk)
+    except Exception:
+        pass
+
+    return None, None
+
+
+def _ProbeCompression(volume, stream_urn, indexes):
+    """Work out the compression method and chunk size of a stream.
+
+    Writers store a chunk as is unless it compresses, so the stream is
+    compressed if any chunk but the last is shorter than the longest. Only
+    those chunks are decompressed, to find the method and the chunk size. If
+    all the chunks are as long, the stream is stored unless the first chunk
+    decompresses (e.g. all the chunks are zeros).
+    """
+    chunks = [(bevy_id, offset, length)
+              for bevy_id, bevy_index in enumerate(indexes)
+              for offset, length in bevy_index]
+    longest = max(length for _, _, length in chunks[:-1] or chunks)
+    probes = [x for x in chunks[:-1] if x[2] < longest] or chunks[:1]
+
+    bevy_id = bevy = None
+    for probe_id, offset, length in probes[:COMPRESSION_PROBE_CHUNKS]:
+        if probe_id != bevy_id:
+            bevy_id = probe_id
+            bevy = _ReadMember(volume, stream_urn.Append("%08d" % bevy_id))
+        method, data = _Decompress(bevy[offset:offset + length])
+        if method is not None and len(data) > length:
+            return method, len(data)
+
+    if len(probes) > 1 or probes[0][2] < longest:
+        LOGGER.error("Unable to decompress the short chunks of %s", stream_urn)
+
+    # Chunks which do not compress are stored as is, so the chunk size is the
+    # size of a (full) chunk.
+    return lexicon.AFF4_IMAGE_COMPRESSION_STORED, longest
+
+
+def RecoverImageStreams(resolver, volume):
+    """Re-derive the metadata of image streams which have none.
+
+    Returns the URNs of all image streams in the volume.
+    """
+    members = set(utils.SmartUnicode(x) for x in volume.members)
+    bevies = {}
+    for member in members:
+        m = BEVY_REGEX.match(member)
+        if m and ("%s.index" % member) in members:
+            bevies.setdefault(m.group(1), []).append(int(m.group(2)))
+
+    result = []
+    for stream, bevy_ids in sorted(bevies.items()):
+        stream_urn = rdfvalue.URN(stream)
+        result.append(stream_urn)
+        if _HasType(resolver, volume.urn, stream_urn):
+            continue
+
+        # Only bevies from the start of the stream are usable.
+        bevy_ids = sorted(bevy_ids)
+        bevy_count = 0
+        while bevy_count < len(bevy_ids) and bevy_ids[bevy_count] == bevy_count:
+            bevy_count += 1
+
+        indexes = []
+        for bevy_id in range(bevy_count):
+            bevy_urn = stream_urn.Append("%08d" % bevy_id)
+            bevy_index = _ParseBevyIndex(
+                _ReadMember(volume, rdfvalue.URN("%s.index" % bevy_urn)))
+            if indexes and len(bevy_index) > len(indexes[0]):
+                break
+            if not bevy_index or (indexes and len(indexes[-1]) != len(indexes[0])):
+                break
+            indexes.append(bevy_index)
+
+        if not indexes:
+            LOGGER.error("No usable bevies found for %s", stream_urn)
+            result.pop()
+            continue
+
+        if len(indexes) > 1:
+            chunks_per_segment = len(indexes[0])
+        else:
+            chunks_per_segment = max(len(indexes[0]), DEFAULT_CHUNKS_PER_SEGMENT)
+
+        compression, chunk_size = _ProbeCompression(volume, stream_urn, indexes)
+
+        # Writers pad the last chunk with zeros, so unless the chunk was
+        # stored short the recovered size is rounded up to whole chunks.
+        offset, length = indexes[-1][-1]
+        last_chunk_size = length
+        if compression != lexicon.AFF4_IMAGE_COMPRESSION_STORED and length != chunk_size:
+            bevy = _ReadMember(volume, stream_urn.Append("%08d" % (len(indexes) - 1)))
+            _, data = _Decompress(bevy[offset:offset + length])
+            last_chunk_size = len(data or b"")
+
+        total_chunks = sum(len(x) for x in indexes)
+        size = (total_chunks - 1) * chunk_size + last_chunk_size
+
+        if LOGGER.isEnabledFor(logging.INFO):
+            LOGGER.info("Recovered image stream %s: %d bevies, chunk size %d, size %d",
+                        stream_urn, len(indexes), chunk_size, size)
+
+        resolver.Add(volume.urn, stream_urn, lexicon.AFF4_TYPE,
+                     rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE))
+        resolver.Set(volume.urn, stream_urn, lexicon.AFF4_IMAGE_CHUNK_SIZE,
+                     rdfvalue.XSDInteger(chunk_size))
+        resolver.Set(volume.urn, stream_urn, lexicon.AFF4_IMAGE_CHUNKS_PER_SEGMENT,
+                     rdfvalue.XSDInteger(chunks_per_segment))
+        resolver.Set(volume.urn, stream_urn, lexicon.AFF4_STREAM_SIZE,
+                     rdfvalue.XSDInteger(size))
+        resolver.Set(volume.urn, stream_urn, lexicon.AFF4_IMAGE_COMPRESSION,
+                     rdfvalue.URN(compression))
+        resolver.Set(lexicon.transient_graph, stream_urn, lexicon.AFF4_STORED,
+                     volume.urn)
+
+    return result
+
+
+def RecoverMaps(resolver, volume, streams):
+    """Re-derive the metadata of maps which have none.
+
+    An image stream named <image>/data without a map is what is left when the
+    writer dies before the map is flushed; it gets a map covering all of it.
+    """
+    members = set(utils.SmartUnicode(x) for x in volume.members)
+    for member in sorted(members):
+        if not member.endswith("/map") or (member[:-4] + "/idx") not in members:
+            continue
+
+        map_urn = rdfvalue.URN(member[:-4])
+        if _HasType(resolver, volume.urn, map_urn):
+            continue
+
+        data = _ReadMember(volume, rdfvalue.URN(member))
+        ranges = aff4_map.RangeMap()
+        ranges.Load(data)
+        size = ranges.end()
+
+        if LOGGER.isEnabledFor(logging.INFO):
+            LOGGER.info("Recovered map %s: size %d", map_urn, size)
+
+        resolver.Set(volume.urn, map_urn, lexicon.AFF4_TYPE,
+                     rdfvalue.URN(lexicon.AFF4_MAP_TYPE))
+        resolver.Set(volume.urn, map_urn, lexicon.AFF4_STREAM_SIZE,
+                     rdfvalue.XSDInteger(size))
+        resolver.Set(lexicon.transient_graph, map_urn, lexicon.AFF4_STORED,
+                     volume.urn)
+
+    for stream_urn in streams:
+        stream = utils.SmartUnicode(stream_urn)
+        if not stream.endswith("/data"):
+            continue
+
+        map_urn = rdfvalue.URN(stream[:-5])
+        if _HasType(resolver, volume.urn, map_urn) or (stream[:-5] + "/map") in members:
+            continue
+
+        size = resolver.GetUnique(volume.urn, stream_urn, lexicon.AFF4_STREAM_SIZE)
+        if LOGGER.isEnabledFor(logging.INFO):
+            LOGGER.info("Creating map %s over %s", map_urn, stream_urn)
+
+        with aff4_map.AFF4Map.NewAFF4Map(resolver, map_urn, volume.urn) as map_stream:
+            map_stream.AddRange(0, 0, int(size), stream_urn)
+        resolver.Set(volume.urn, map_urn, lexicon.AFF4_STREAM_SIZE,
+                     rdfvalue.XSDInteger(int(size)))
@@ -0,0 +1,160 @@
+from __future__ import unicode_literals
+# Copyright 2019 Schatz Forensic Pty Ltd. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License"); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+# WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+# License for the specific language governing permissions and limitations under
+# the License.
+
+from future import standard_library
+standard_library.install_aliases()
+from builtins import range
+import os
+import tempfile
+import unittest
+import zipfile
+
+from pyaff4 import aff4_image
+from pyaff4 import data_store
+from pyaff4 import lexicon
+from pyaff4 import rdfvalue
+from pyaff4 import recovery
+from pyaff4 import zip
+from pyaff4 import plugins
+from pyaff4.version import Version
+
+
+class RecoveryTest(unittest.TestCase):
+    filename = tempfile.gettempdir() + "/aff4_recovery_test.zip"
+    filename_urn = rdfvalue.URN.FromFileName(filename)
+    image_name = "image.dd"
+    data = b"".join(b"Hello world %02d!" % i for i in range(100))
+
+    def setUp(self):
+        with data_store.MemoryDataStore() as resolver:
+            resolver.Set(lexicon.transient_graph, self.filename_urn, lexicon.AFF4_STREAM_WRITE_MODE,
+                         rdfvalue.XSDString("truncate"))
+
+            with zip.ZipFile.NewZipFile(resolver, Version(1, 0, "pyaff4"), self.filename_urn) as zip_file:
+                self.volume_urn = zip_file.urn
+                with zip_file.CreateMember(self.volume_urn.Append("container.description")) as description:
+                    description.Write(self.volume_urn.SerializeToString().encode("utf-8"))
+
+                self.image_urn = self.volume_urn.Append(self.image_name)
+                with aff4_image.AFF4Image.NewAFF4Image(
+                        resolver, self.image_urn, self.volume_urn) as image:
+                    image.chunk_size = 10
+                    image.chunks_per_segment = 3
+                    image.Write(self.data)
+
+                self.stored_urn = self.volume_urn.Append("stored")
+                with aff4_image.AFF4Image.NewAFF4Image(
+                        resolver, self.stored_urn, self.volume_urn) as image:
+                    image.setCompressionMethod(lexicon.AFF4_IMAGE_COMPRESSION_STORED)
+                    image.chunk_size = 64
+                    image.chunks_per_segment = 4
+                    image.Write(self.data)
+
+    def tearDown(self):
+        try:
+            os.unlink(self.filename)
+        except (IOError, OSError):
+            pass
+
+    def _truncate_at(self, member_name, garbage=b""):
+        with zipfile.ZipFile(self.filename) as z:
+            offset = z.getinfo(member_name).header_offset
+
+        with open(self.filename, "r+b") as fd:
+            fd.truncate(offset)
+            fd.seek(offset)
+            fd.write(garbage)
+
+    def _check_images(self, stored_size):
+        with data_store.MemoryDataStore() as resolver:
+            with zip.ZipFile.NewZipFile(resolver, Version(1, 0, "pyaff4"), self.filename_urn) as zip_file:
+                self.assertEquals(zip_file.urn, self.volume_urn)
+
+            with resolver.AFF4FactoryOpen(self.image_urn) as image:
+                self.assertEquals(image.chunk_size, 10)
+                self.assertEquals(image.chunks_per_segment, 3)
+                self.assertEquals(image.Size(), len(self.data))
+                self.assertEquals(image.Read(len(self.data)), self.data)
+
+            with resolver.AFF4FactoryOpen(self.stored_urn) as image:
+                self.assertEquals(image.chunk_size, 64)
+                self.assertEquals(image.compression, lexicon.AFF4_IMAGE_COMPRESSION_STORED)
+                self.assertEquals(image.Size(), stored_size)
+                self.assertEquals(image.Read(len(self.data)), self.data)
+
+    def testRecoverMissingCentralDirectory(self):
+        # Keep information.turtle, lose the central directory.
+        with zipfile.ZipFile(self.filename) as z:
+            turtle = z.getinfo("information.turtle")
+            end = turtle.header_offset + len(turtle.FileHeader()) + turtle.compress_size
+        with open(self.filename, "r+b") as fd:
+            fd.truncate(end)
+
+        with data_store.MemoryDataStore() as resolver:
+            self.assertEquals(recovery.Recover(resolver, self.filename_urn),
+                              self.volume_urn)
+
+        self._check_images(len(self.data))
+
+    def testRecoverMissingMetadata(self):
+        # Lose information.turtle and the central directory, and leave a
+        # partially written member behind.
+        header = zip.ZipFileHeader(
+            crc32=0, compress_size=0, file_size=0,
+            file_name_length=len(b"partial"), compression_method=zip.ZIP_STORED,
+            lastmodtime=0, lastmoddate=0, extra_field_len=0)
+        self._truncate_at("information.turtle",
+                          garbage=header.Pack() + b"partial" + b"\xff" * 1000)
+
+        with data_store.MemoryDataStore() as resolver:
+            self.assertEquals(recovery.Recover(resolver, self.filename_urn),
+                              self.volume_urn)
+
+        # Without metadata the zero padding of the last chunk can not be told
+        # apart from data.
+        self._check_images(1536)
+
+        with zipfile.ZipFile(self.filename) as z:
+            self.assertNotIn("partial", z.namelist())
+
+    def testRecoverIncompressibleStart(self):
+        # The first chunks do not compress, so only later ones show the
+        # stream is compressed.
+        data = os.urandom(64 * 10) + b"A" * 64 * 10
+        with data_store.MemoryDataStore() as resolver:
+            resolver.Set(lexicon.transient_graph, self.filename_urn, lexicon.AFF4_STREAM_WRITE_MODE,
+                         rdfvalue.XSDString("truncate"))
+            with zip.ZipFile.NewZipFile(resolver, Version(1, 0, "pyaff4"), self.filename_urn) as zip_file:
+                with aff4_image.AFF4Image.NewAFF4Image(
+                        resolver, self.image_urn, zip_file.urn) as image:
+                    image.chunk_size = 64
+                    image.chunks_per_segment = 4
+                    image.Write(data)
+        self._truncate_at("information.turtle")
+
+        with data_store.MemoryDataStore() as resolver:
+            recovery.Recover(resolver, self.filename_urn)
+
+        with data_store.MemoryDataStore() as resolver:
+            with zip.ZipFile.NewZipFile(resolver, Version(1, 0, "pyaff4"), self.filename_urn):
+                pass
+            with resolver.AFF4FactoryOpen(self.image_urn) as image:
+                self.assertEquals(image.compression, lexicon.AFF4_IMAGE_COMPRESSION_ZLIB)
+                self.assertEquals(image.chunk_size, 64)
+                self.assertEquals(image.Read(len(data)), data)
+
+
+if __name__ == '__main__':
+    unittest.main()
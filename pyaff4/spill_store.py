@@ -0,0 +1,194 @@
+from __future__ import unicode_literals
+# Copyright 2019 Schatz Forensic Pty Ltd. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License"); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+# WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+# License for the specific language governing permissions and limitations under
+# the License.
+
+"""On disk storage for the subjects a SpillingDataStore evicts from memory.
+
+Subjects are held whole: each one is either in memory or here, never split
+between the two. Triples are keyed by strings rather than interned ids, so the
+resolver can forget the URNs of the subjects it evicts.
+
+The store is a scratch sqlite database. It is not a cache - nothing here is
+anywhere else - but it does not outlive the resolver either.
+"""
+from builtins import object
+import os
+import pickle
+import sqlite3
+import tempfile
+
+from pyaff4 import rdfvalue
+
+SCHEMA = """
+CREATE TABLE subjects (graph INTEGER, subject TEXT, version INTEGER,
+                       PRIMARY KEY (graph, subject));
+CREATE TABLE triples (graph INTEGER, subject TEXT, predicate TEXT, urn TEXT,
+                      value BLOB);
+CREATE INDEX triples_subject ON triples (graph, subject);
+CREATE INDEX triples_predicate ON triples (graph, predicate, urn);
+"""
+
+# The most memory sqlite may use for its page cache, in KiB.
+CACHE_SIZE = 16384
+
+
+def _Encode(value):
+    """The (urn, value) columns of an RDFValue."""
+    if type(value) is rdfvalue.URN and len(value.__dict__) == 1:
+        return value.value, None
+    return None, sqlite3.Binary(pickle.dumps(value, 2))
+
+
+def _Decode(urn, value):
+    if urn is not None:
+        result = rdfvalue.URN.__new__(rdfvalue.URN)
+        result.value = urn
+        return result
+    return pickle.loads(bytes(value))
+
+
+class SpillStore(object):
+    """Triples of evicted subjects, by graph number.
+
+    If directory is None sqlite keeps the database in its temporary
+    directory. Otherwise it is a file in directory, removed by Close().
+    """
+
+    def __init__(self, directory=None):
+        self.path = None
+        if directory is None:
+            # sqlite deletes a private temporary database when it is closed.
+            self.db = sqlite3.connect("")
+        else:
+            handle, self.path = tempfile.mkstemp(dir=directory, suffix=".spill")
+            os.close(handle)
+            self.db = sqlite3.connect(self.path)
+
+        # Nothing needs to survive a crash, so there is no journal to write.
+        self.db.execute("PRAGMA journal_mode = OFF")
+        self.db.execute("PRAGMA synchronous = OFF")
+        self.db.execute("PRAGMA cache_size = -%d" % CACHE_SIZE)
+        self.db.executescript(SCHEMA)
+        self.count = 0
+
+    def __len__(self):
+        """The number of subjects held."""
+        return self.count
+
+    def Close(self):
+        self.db.close()
+        if self.path is not None:
+            os.unlink(self.path)
+            self.path = None
+
+    def Commit(self):
+        self.db.commit()
+
+    def Put(self, graph, subject, version, items):
+        """Stores a subject's (predicate, [values]) items.
+
+        version is the store version of the subject's last change.
+        """
+        self.db.execute("INSERT INTO subjects VALUES (?, ?, ?)",
+                        (graph, subject, version))
+        self.db.executemany(
+            "INSERT INTO triples VALUES (?, ?, ?, ?, ?)",
+            ((graph, subject, predicate) + _Encode(value)
+             for predicate, values in items for value in values))
+        self.count += 1
+
+    def Version(self, graph, subject):
+        """The version of a subject, or None if it is not held."""
+        for version, in self.db.execute(
+                "SELECT version FROM subjects WHERE graph = ? AND subject = ?",
+                (graph, subject)):
+            return version
+        return None
+
+    def Remove(self, graph, subject):
+        if self.db.execute(
+                "DELETE FROM subjects WHERE graph = ? AND subject = ?",
+                (graph, subject)).rowcount:
+            self.db.execute(
+                "DELETE FROM triples WHERE graph = ? AND subject = ?",
+                (graph, subject))
+            self.count -= 1
+
+    def Take(self, graph, subject):
+        """Removes a subject, returning (version, items) or None."""
+        version = self.Version(graph, subject)
+        if version is None:
+            return None
+
+        items = self.Items(graph, subject)
+        self.Remove(graph, subject)
+        return version, items
+
+    def Values(self, graph, subject, predicate):
+        return [_Decode(urn, value) for urn, value in self.db.execute(
+            "SELECT urn, value FROM triples WHERE graph = ? AND subject = ? "
+            "AND predicate = ? ORDER BY rowid", (graph, subject, predicate))]
+
+    def Items(self, graph, subject):
+        """The (predicate, [values]) of a subject, in order of addition."""
+        result = []
+        index = {}
+        for predicate, urn, value in self.db.execute(
+                "SELECT predicate, urn, value FROM triples WHERE graph = ? "
+                "AND subject = ? ORDER BY rowid", (graph, subject)):
+            values = index.get(predicate)
+            if values is None:
+                values = index[predicate] = []
+                result.append((predicate, values))
+            values.append(_Decode(urn, value))
+        return result
+
+    def Subjects(self, graph, prefix=""):
+        """Yields the subjects which start with prefix, in order."""
+        for subject, in self.db.execute(
+                "SELECT subject FROM subjects WHERE graph = ? AND subject >= ? "
+                "ORDER BY subject", (graph, prefix)):
+            if not subject.startswith(prefix):
+                break
+            yield subject
+
+    def ChangedSince(self, graph, version):
+        """Yields the subjects changed after the version."""
+        for subject, in self.db.execute(
+                "SELECT subject FROM subjects WHERE graph = ? AND version > ?",
+                (graph, version)):
+            yield subject
+
+    def Scan(self, graph, predicate):
+        """Yields (subject, value) of every triple with the predicate."""
+        for subject, urn, value in self.db.execute(
+                "SELECT subject, urn, value FROM triples WHERE graph = ? "
+                "AND predicate = ? ORDER BY rowid", (graph, predicate)):
+            yield subject, _Decode(urn, value)
+
+    def Match(self, graph, predicate, urn):
+        """Yields the subjects with the URN value urn for the predicate."""
+        for subject, in self.db.execute(
+                "SELECT DISTINCT subject FROM triples WHERE graph = ? "
+                "AND predicate = ? AND urn = ?", (graph, predicate, urn)):
+            yield subject
+
+    def Literals(self, graph, predicate):
+        """Yields (subject, value) of the predicate's values which are not
+        URNs."""
+        for subject, value in self.db.execute(
+                "SELECT subject, value FROM triples WHERE graph = ? "
+                "AND predicate = ? AND urn IS NULL ORDER BY rowid",
+                (graph, predicate)):
+            yield subject, _Decode(None, value)
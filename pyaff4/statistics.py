@@ -0,0 +1,180 @@
+from __future__ import division
+from __future__ import unicode_literals
+# Copyright 2019 Schatz Forensic Pty Ltd. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License"); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+# WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+# License for the specific language governing permissions and limitations under
+# the License.
+
+"""Fragmentation and compression statistics of maps and image streams.
+
+Both are gathered in a single pass over the index data - the map ranges and
+the bevy indexes - without reading or decompressing any chunks.
+"""
+from builtins import object
+from builtins import range
+from builtins import str
+import collections
+
+from pyaff4 import aff4_image
+from pyaff4 import aff4_map
+
+# Kinds of map target.
+DATA = "Data"
+ZERO = "Zero"
+UNKNOWN = "UnknownData"
+UNREADABLE = "UnreadableData"
+SYMBOLIC = "Symbolic"
+
+
+def TargetKind(resolver, target):
+    """Whether target is a data stream, or which kind of symbolic stream."""
+    if not resolver.streamFactory.isSymbolicStream(target):
+        return DATA
+
+    name = str(target)[len(resolver.lexicon.base):]
+    if name in (ZERO, UNKNOWN, UNREADABLE):
+        return name
+    return SYMBOLIC
+
+
+def LengthBucket(length):
+    """The histogram bucket of length: k for lengths in [2**k, 2**(k+1))."""
+    return max(length, 1).bit_length() - 1
+
+
+class MapStatistics(object):
+    """The fragmentation of a map.
+
+    length_histogram counts the ranges by LengthBucket, target_bytes and
+    kind_bytes hold the bytes mapped to each target and each TargetKind. An
+    extent is a run of ranges which is contiguous in a data target, whether
+    or not it is contiguous in the map.
+    """
+
+    def __init__(self, urn):
+        self.urn = urn
+        self.ranges = 0
+        self.size = 0
+        self.length_histogram = collections.Counter()
+        self.target_bytes = collections.OrderedDict()
+        self.kind_bytes = collections.OrderedDict()
+        self.extents = 0
+        self.extent_bytes = 0
+
+    def AverageExtent(self):
+        if not self.extents:
+            return 0
+        return self.extent_bytes / self.extents
+
+
+def AnalyseMap(image_map):
+    """Returns the MapStatistics of an open AFF4Map."""
+    result = MapStatistics(image_map.urn)
+    resolver = image_map.resolver
+    kinds = [TargetKind(resolver, x) for x in image_map.targets]
+    target_bytes = [0] * len(image_map.targets)
+
+    last_target = None
+    last_target_end = None
+    for range in image_map.range_map:
+        result.ranges += 1
+        result.size = max(result.size, range.map_end)
+        result.length_histogram[LengthBucket(range.length)] += 1
+        target_bytes[range.target_id] += range.length
+
+        if kinds[range.target_id] != DATA:
+            continue
+
+        if (range.target_id != last_target or
+                range.target_offset != last_target_end):
+            result.extents += 1
+        result.extent_bytes += range.length
+        last_target = range.target_id
+        last_target_end = range.target_offset + range.length
+
+    for target, kind, length in zip(image_map.targets, kinds, target_bytes):
+        if length:
+            result.target_bytes[target] = length
+            result.kind_bytes[kind] = result.kind_bytes.get(kind, 0) + length
+
+    return result
+
+
+class ImageStatistics(object):
+    """The compression of an image stream.
+
+    bevies holds a (chunks, stored bytes, raw chunks) tuple for each bevy.
+    Chunks which did not compress are stored raw, at their full size.
+    """
+
+    def __init__(self, urn, chunk_size, compression):
+        self.urn = urn
+        self.chunk_size = chunk_size
+        self.compression = compression
+        self.bevies = []
+
+    def Chunks(self):
+        return sum(x[0] for x in self.bevies)
+
+    def StoredBytes(self):
+        return sum(x[1] for x in self.bevies)
+
+    def RawChunks(self):
+        return sum(x[2] for x in self.bevies)
+
+    def CompressionRatio(self, bevy_id=None):
+        """Uncompressed over stored bytes, of one bevy or the whole stream."""
+        if bevy_id is None:
+            chunks, stored = self.Chunks(), self.StoredBytes()
+        else:
+            chunks, stored, _ = self.bevies[bevy_id]
+
+        if not stored:
+            return 0
+        return chunks * self.chunk_size / stored
+
+    def RawHistogram(self):
+        """The number of bevies by how many of their chunks are raw."""
+        return collections.Counter(x[2] for x in self.bevies)
+
+
+def AnalyseImage(image):
+    """Returns the ImageStatistics of an open AFF4Image, from its bevy indexes."""
+    result = ImageStatistics(image.urn, image.chunk_size, image.compression)
+    bevy_size = image.chunk_size * image.chunks_per_segment
+    bevy_count = (image.Size() + bevy_size - 1) // bevy_size
+
+    for bevy_id in range(bevy_count):
+        with image.resolver.AFF4FactoryOpen(
+                image.urn.Append("%08d" % bevy_id), version=image.version) as bevy:
+            bevy_index = image._parse_bevy_index(bevy)
+
+        result.bevies.append((
+            len(bevy_index),
+            sum(x[1] for x in bevy_index),
+            sum(1 for x in bevy_index if x[1] >= image.chunk_size)))
+
+    return result
+
+
+def Analyse(resolver, urn):
+    """Returns the MapStatistics or ImageStatistics of the stream urn.
+
+    Returns None for other kinds of stream.
+    """
+    with resolver.AFF4FactoryOpen(urn) as stream:
+        if isinstance(stream, aff4_map.AFF4Map):
+            return AnalyseMap(stream)
+        if isinstance(stream, aff4_image.AFF4Image):
+            return AnalyseImage(stream)
+
+    return None
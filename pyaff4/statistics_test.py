@@ -0,0 +1,106 @@
+from __future__ import unicode_literals
+# Copyright 2019 Schatz Forensic Pty Ltd. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License"); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+# WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+# License for the specific language governing permissions and limitations under
+# the License.
+
+from future import standard_library
+standard_library.install_aliases()
+import os
+import tempfile
+import unittest
+
+from pyaff4 import aff4_image
+from pyaff4 import aff4_map
+from pyaff4 import data_store
+from pyaff4 import lexicon
+from pyaff4 import rdfvalue
+from pyaff4 import statistics
+from pyaff4 import zip
+from pyaff4 import plugins
+from pyaff4 import version
+
+
+class StatisticsTest(unittest.TestCase):
+    filename = tempfile.gettempdir() + "/aff4_statistics_test.zip"
+    filename_urn = rdfvalue.URN.FromFileName(filename)
+    map_urn = rdfvalue.URN("aff4://5e1a7a9c-63c0-4d8b-9a8a-6a4a3f2b2d10")
+    image_urn = rdfvalue.URN("aff4://5e1a7a9c-63c0-4d8b-9a8a-6a4a3f2b2d11")
+    data_urn = rdfvalue.URN("aff4://5e1a7a9c-63c0-4d8b-9a8a-6a4a3f2b2d12")
+
+    def tearDown(self):
+        try:
+            os.unlink(self.filename)
+        except (IOError, OSError):
+            pass
+
+    def _open_volume(self, resolver, writable=False):
+        if writable:
+            resolver.Set(lexicon.transient_graph, self.filename_urn,
+                         lexicon.AFF4_STREAM_WRITE_MODE,
+                         rdfvalue.XSDString("truncate"))
+        return zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn)
+
+    def testMap(self):
+        zero = rdfvalue.URN(lexicon.standard.base + "Zero")
+        with data_store.MemoryDataStore() as resolver:
+            with self._open_volume(resolver, writable=True) as volume:
+                with aff4_map.AFF4Map.NewAFF4Map(
+                        resolver, self.map_urn, volume.urn) as image_map:
+                    # Two extents of the data stream, as the second range
+                    # carries on from the first across a gap in the map.
+                    image_map.AddRange(0, 0, 100, self.data_urn)
+                    image_map.AddRange(100, 0, 1000, zero)
+                    image_map.AddRange(1100, 100, 28, self.data_urn)
+                    image_map.AddRange(2000, 5000, 4096, self.data_urn)
+
+            result = statistics.AnalyseMap(image_map)
+
+        self.assertEquals(result.ranges, 4)
+        self.assertEquals(result.size, 6096)
+        self.assertEquals(dict(result.length_histogram), {4: 1, 6: 1, 9: 1, 12: 1})
+        self.assertEquals(dict(result.target_bytes),
+                          {self.data_urn: 4224, zero: 1000})
+        self.assertEquals(dict(result.kind_bytes),
+                          {statistics.DATA: 4224, statistics.ZERO: 1000})
+        self.assertEquals(result.extents, 2)
+        self.assertEquals(result.AverageExtent(), 2112)
+
+    def testImage(self):
+        chunk_size = 1024
+        # Compressible and random chunks, in two bevies.
+        data = b"".join([b"A" * chunk_size, os.urandom(chunk_size),
+                         b"B" * chunk_size, os.urandom(chunk_size)])
+
+        with data_store.MemoryDataStore() as resolver:
+            with self._open_volume(resolver, writable=True) as volume:
+                with aff4_image.AFF4Image.NewAFF4Image(
+                        resolver, self.image_urn, volume.urn) as image:
+                    image.chunk_size = chunk_size
+                    image.chunks_per_segment = 3
+                    image.Write(data)
+
+        with data_store.MemoryDataStore() as resolver:
+            with self._open_volume(resolver):
+                result = statistics.Analyse(resolver, self.image_urn)
+
+        self.assertEquals(len(result.bevies), 2)
+        self.assertEquals(result.Chunks(), 4)
+        self.assertEquals(result.RawChunks(), 2)
+        self.assertEquals(dict(result.RawHistogram()), {1: 2})
+        self.assertEquals(result.bevies[1], (1, chunk_size, 1))
+        self.assertTrue(result.CompressionRatio(0) > 1)
+        self.assertEquals(result.CompressionRatio(1), 1)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -13,15 +13,16 @@
 # the License.
 
 def ReadAll(stream):
-    res = b""
+    # Joined once at the end, as adding each read to the result is quadratic.
+    res = []
     while True:
         toRead = 32 * 1024
         data = stream.read(toRead)
         if data == None or len(data) == 0:
             # EOF
-            return res
+            return b"".join(res)
         else:
-            res += data
+            res.append(data)
 
 def WriteAll(fromstream, tostream):
     while True:
@@ -0,0 +1,516 @@
+from __future__ import unicode_literals
+# Copyright 2019 Schatz Forensic Pty Ltd. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License"); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+# WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+# License for the specific language governing permissions and limitations under
+# the License.
+
+"""Writing and reading images striped across several AFF4 volumes.
+
+The image is cut into stripes which alternate between the destinations, each
+of which is written by its own thread, so throughput adds up across
+destination devices. Every destination holds a sequence of volumes no bigger
+than max_volume_size (e.g. to fit on FAT32), and the last volume of each holds
+a map of the whole image, like the canonical striped images in
+test_images/AFF4Std/Striped. All the volumes are needed to read the image.
+
+StripedImageReader reads such an image back with a thread per volume, so
+reads spanning several stripes proceed on all the devices at once.
+"""
+from builtins import object
+from builtins import str
+import logging
+import os
+import threading
+import uuid
+
+from future import standard_library
+standard_library.install_aliases()
+import queue
+
+from pyaff4 import aff4_image
+from pyaff4 import aff4
+from pyaff4 import aff4_map
+from pyaff4 import container
+from pyaff4 import data_store
+from pyaff4 import lexicon
+from pyaff4 import rdfvalue
+from pyaff4 import utils
+from pyaff4 import version
+from pyaff4 import zip
+
+LOGGER = logging.getLogger("pyaff4")
+
+DEFAULT_STRIPE_SIZE = 32 * 1024 * 1024
+
+# Stripes buffered for each destination before Write() blocks.
+QUEUE_DEPTH = 4
+
+# FAT32 can not hold files of 4GiB or more.
+FAT32_MAX_VOLUME_SIZE = 4 * 1024 * 1024 * 1024 - 1
+
+# Upper bounds on what the image takes up in a volume besides its data: the
+# bevy index entry of each chunk, the members (headers and central directory
+# entries) of each bevy and its index, and the map entry and target of each
+# range.
+CHUNK_OVERHEAD = 12
+BEVY_OVERHEAD = 1024
+RANGE_OVERHEAD = 128
+
+
+def VolumeFilename(path, index):
+    """The name of the index'th volume written to path."""
+    if index == 0:
+        return path
+
+    root, ext = os.path.splitext(path)
+    return "%s_%03d%s" % (root, index, ext)
+
+
+class _DestinationWriter(threading.Thread):
+    """Writes the stripes sent to one destination into its volumes.
+
+    Each volume gets its own resolver, so the writers share no state.
+    """
+
+    def __init__(self, owner, path):
+        super(_DestinationWriter, self).__init__(name="striped-writer %s" % path)
+        self.daemon = True
+        self.owner = owner
+        self.path = path
+        self.queue = queue.Queue(QUEUE_DEPTH)
+        self.error = None
+        self.finished = False
+        self.volume_urns = []
+
+    def run(self):
+        try:
+            item = self.queue.get()
+            while item[0] == "volume":
+                item = self._WriteVolume(item[1], item[2])
+
+        except Exception as e:
+            LOGGER.exception("Writing to %s failed", self.path)
+            self.error = e
+
+            # Keep consuming so the producer does not block on us.
+            while not self.finished:
+                self.finished = self.queue.get()[0] == "finish"
+
+    def _WriteVolume(self, filename, stream_urn):
+        backing_store_urn = rdfvalue.URN.FromFileName(filename)
+        with data_store.MemoryDataStore() as resolver:
+            resolver.Set(lexicon.transient_graph, backing_store_urn,
+                         lexicon.AFF4_STREAM_WRITE_MODE,
+                         rdfvalue.XSDString("truncate"))
+
+            with zip.ZipFile.NewZipFile(resolver, self.owner.version,
+                                        backing_store_urn) as volume:
+                self.volume_urns.append(volume.urn)
+                self._WriteDescription(volume)
+
+                if LOGGER.isEnabledFor(logging.INFO):
+                    LOGGER.info("Writing %s to %s <%s>", stream_urn, filename,
+                                volume.urn)
+
+                with aff4_image.AFF4Image.NewAFF4Image(
+                        resolver, stream_urn, volume.urn) as stream:
+                    stream.chunk_size = self.owner.chunk_size
+                    stream.chunks_per_segment = self.owner.chunks_per_segment
+                    if self.owner.compression is not None:
+                        stream.compression = self.owner.compression
+                    while True:
+                        item = self.queue.get()
+                        if item[0] != "data":
+                            break
+                        stream.Write(item[1])
+
+                if item[0] == "finish":
+                    self.finished = True
+                    self._WriteMap(resolver, volume, item[1])
+
+        return item
+
+    def _WriteDescription(self, volume):
+        with volume.CreateMember(volume.urn.Append("container.description")) as description:
+            description.Write(utils.SmartStr(volume.urn.value))
+            description.Flush()
+
+        with volume.CreateMember(volume.urn.Append("version.txt")) as version_file:
+            version_file.Write(utils.SmartStr(str(self.owner.version)))
+            version_file.Flush()
+
+    def _WriteMap(self, resolver, volume, ranges):
+        map_urn = rdfvalue.URN("aff4://%s" % uuid.uuid4())
+        image_urn = self.owner.image_urn
+        with aff4_map.AFF4Map.NewAFF4Map(resolver, map_urn, volume.urn) as image_map:
+            image_map.AddRanges(ranges)
+
+        resolver.Set(volume.urn, map_urn, lexicon.AFF4_STREAM_SIZE,
+                     rdfvalue.XSDInteger(self.owner.size))
+        resolver.Set(volume.urn, map_urn, lexicon.standard.target, image_urn)
+
+        resolver.Add(volume.urn, image_urn, lexicon.AFF4_TYPE,
+                     rdfvalue.URN(lexicon.standard.Image))
+        resolver.Add(volume.urn, image_urn, lexicon.standard.dataStream, map_urn)
+        resolver.Set(volume.urn, image_urn, lexicon.AFF4_STREAM_SIZE,
+                     rdfvalue.XSDInteger(self.owner.size))
+
+
+class StripedImageWriter(object):
+    """Writes an image striped across volumes on several destinations.
+
+    Usage:
+      with StripedImageWriter(image_urn, ["/mnt/a/disk.aff4",
+                                          "/mnt/b/disk.aff4"]) as writer:
+          writer.WriteStream(source)
+
+    Stripes are assigned to the destinations in turn. A destination moves on
+    to a new volume (disk_001.aff4, ...) before a volume can exceed
+    max_volume_size.
+    """
+
+    # Space left in each volume for the metadata and the end of the central
+    # directory, whatever it holds.
+    volume_reserve = 64 * 1024
+
+    chunk_size = 32 * 1024
+    chunks_per_segment = 1024
+
+    def __init__(self, image_urn, destinations, stripe_size=DEFAULT_STRIPE_SIZE,
+                 max_volume_size=None, vers=None, compression=None):
+        if not destinations:
+            raise ValueError("At least one destination is required")
+
+        if (max_volume_size is not None and
+                max_volume_size < stripe_size + self.VolumeOverhead(
+                    stripe_size, len(destinations))):
+            raise ValueError("Maximum volume size is too small for the stripe size")
+
+        self.image_urn = rdfvalue.URN(image_urn)
+        self.stripe_size = stripe_size
+        self.max_volume_size = max_volume_size
+        self.version = vers or version.aff4v10
+        self.compression = compression
+        self.size = 0
+
+        self.buffer = bytearray()
+        self.stripe_number = 0
+        self.ranges = []
+
+        self.writers = [_DestinationWriter(self, path) for path in destinations]
+        # Per destination: volume number, stream URN, bytes in that stream.
+        self.volumes = [[0, None, 0] for _ in destinations]
+        for writer in self.writers:
+            writer.start()
+
+        self.closed = False
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        self.Close()
+        if exc_value is not None:
+            return False
+
+    @classmethod
+    def VolumeOverhead(cls, size, ranges):
+        """What a volume takes up besides size bytes of the image.
+
+        This is an upper bound, for a volume which also holds the map of
+        ranges ranges. Stripes are counted uncompressed, which is an upper
+        bound on what they take up in the volume.
+        """
+        chunks = -(-size // cls.chunk_size)
+        bevies = -(-chunks // cls.chunks_per_segment)
+        return (cls.volume_reserve + chunks * CHUNK_OVERHEAD +
+                bevies * BEVY_OVERHEAD + ranges * RANGE_OVERHEAD)
+
+    def _Fits(self, size):
+        # Any volume may turn out to be the last of its destination, which
+        # holds the map. By the time it is written the other destinations may
+        # each have added a range.
+        ranges = len(self.ranges) + len(self.writers)
+        return size + self.VolumeOverhead(size, ranges) <= self.max_volume_size
+
+    def _Send(self, index, item):
+        writer = self.writers[index]
+        if writer.error is not None:
+            raise IOError("Writing to %s failed: %s" % (writer.path, writer.error))
+        writer.queue.put(item)
+
+    def _WriteStripe(self, data):
+        index = self.stripe_number % len(self.writers)
+        volume = self.volumes[index]
+
+        if volume[1] is None or (
+                self.max_volume_size is not None and
+                not self._Fits(volume[2] + len(data))):
+            if self.max_volume_size is not None and not self._Fits(len(data)):
+                raise IOError("The map of the image no longer fits in a volume")
+
+            if volume[1] is not None:
+                volume[0] += 1
+            volume[1] = rdfvalue.URN("aff4://%s" % uuid.uuid4())
+            volume[2] = 0
+            self._Send(index, ("volume", VolumeFilename(
+                self.writers[index].path, volume[0]), volume[1]))
+
+        self.ranges.append((self.size, volume[2], len(data), volume[1]))
+        self._Send(index, ("data", data))
+
+        volume[2] += len(data)
+        self.size += len(data)
+        self.stripe_number += 1
+
+    def Write(self, data):
+        if self.closed:
+            raise IOError("Attempt to write to a closed image")
+
+        self.buffer += data
+        offset = 0
+        while len(self.buffer) - offset >= self.stripe_size:
+            self._WriteStripe(bytes(self.buffer[offset:offset + self.stripe_size]))
+            offset += self.stripe_size
+
+        if offset:
+            del self.buffer[:offset]
+
+        return len(data)
+
+    def WriteStream(self, source, progress=None):
+        while True:
+            data = source.read(self.stripe_size)
+            if not data:
+                break
+
+            self.Write(data)
+            if progress is not None:
+                progress.Report(self.size)
+
+    def Close(self):
+        """Write the remaining data and the maps, and wait for the writers."""
+        if self.closed:
+            return
+        self.closed = True
+
+        if self.buffer:
+            self._WriteStripe(bytes(self.buffer))
+            self.buffer = bytearray()
+
+        for index, writer in enumerate(self.writers):
+            if self.volumes[index][1] is None:
+                # Nothing was striped here - it still gets a copy of the map.
+                self.volumes[index][1] = rdfvalue.URN("aff4://%s" % uuid.uuid4())
+                writer.queue.put(("volume", writer.path, self.volumes[index][1]))
+            writer.queue.put(("finish", self.ranges))
+
+        for writer in self.writers:
+            writer.join()
+
+        for writer in self.writers:
+            if writer.error is not None:
+                raise IOError("Writing to %s failed: %s" % (writer.path, writer.error))
+
+    def VolumeURNs(self):
+        """The URNs of all volumes written, once Close() has returned."""
+        result = []
+        for writer in self.writers:
+            result.extend(writer.volume_urns)
+        return result
+
+
+class _VolumeReader(threading.Thread):
+    """Reads extents of the streams stored in one volume.
+
+    Like _DestinationWriter, the volume gets its own resolver so that the
+    readers share no state. Each request carries the queue to reply on.
+    """
+
+    def __init__(self, urn, version, lex):
+        super(_VolumeReader, self).__init__(name="striped-reader %s" % urn)
+        self.daemon = True
+        self.urn = urn
+        self.version = version
+        self.queue = queue.Queue()
+        self.resolver = data_store.MemoryDataStore(lex)
+        with zip.ZipFile.NewZipFile(self.resolver, version, urn) as volume:
+            self.volume_urn = volume.urn
+
+    def run(self):
+        try:
+            while True:
+                item = self.queue.get()
+                if item[0] == "close":
+                    break
+
+                reply = item[-1]
+                try:
+                    reply.put((self, self._Handle(item)))
+                except Exception as e:
+                    reply.put((self, e))
+        finally:
+            self.resolver.Flush()
+
+    def _Handle(self, item):
+        if item[0] == "open":
+            # A volume may describe streams stored in another volume of the
+            # set, which then open with no data.
+            try:
+                with self.resolver.AFF4FactoryOpen(item[1], version=self.version) as stream:
+                    return stream.Size()
+            except IOError:
+                return None
+
+        _, target, extents, result, _ = item
+        with self.resolver.AFF4FactoryOpen(target, version=self.version) as target_stream:
+            return aff4_map._ReadExtents(target_stream, extents, result)
+
+
+class StripedImageReader(aff4.AFF4Stream):
+    """Reads an image striped across several volumes, one thread per volume.
+
+    Usage:
+      with StripedImageReader([urn_a, urn_b], image_urn) as image:
+          data = image.Read(image.Size())
+
+    The urns are those of the volume files (or devices), and the image may be
+    given by its map or by the aff4:Image whose dataStream is the map. A Read
+    is planned from the map like AFF4Map.Read, then the extents of each target
+    stream are read by the reader of the volume holding that stream, all at
+    the same time. Reads need to span several stripes to gain anything.
+
+    The volumes are opened by a ContainerSet, which loads them in processes
+    worker processes if asked to.
+    """
+
+    def __init__(self, urns, image_urn, processes=1):
+        # The map, and everything it refers to, is looked up here. Only the
+        # data is read by the volume readers.
+        self.volume_set = container.ContainerSet(urns, processes=processes)
+        self.version = self.volume_set.version
+        self.lexicon = self.volume_set.lexicon
+        super(StripedImageReader, self).__init__(
+            resolver=self.volume_set.resolver, urn=rdfvalue.URN(image_urn))
+        self.readers = [_VolumeReader(urn, self.version, self.lexicon)
+                        for urn in urns]
+
+        self.image_map = self._OpenMap(self.urn)
+
+        # The reader of each target stream, found on first use.
+        self.target_readers = {}
+        self.replies = queue.Queue()
+        for reader in self.readers:
+            reader.start()
+
+    def _OpenMap(self, urn):
+        maps = [x for x in self.resolver.Get(lexicon.any, urn,
+                                             rdfvalue.URN(lexicon.standard.dataStream))
+                if x is not None]
+        for map_urn in maps + [urn]:
+            try:
+                image_map = self.resolver.AFF4FactoryOpen(map_urn, version=self.version)
+            except IOError:
+                continue
+
+            if isinstance(image_map, aff4_map.AFF4Map):
+                return image_map
+            self.resolver.Return(image_map)
+
+        raise IOError("No map for %s in the striped volumes" % urn)
+
+    def _Reader(self, target):
+        """The reader of the volume holding target, or None."""
+        if target not in self.target_readers:
+            volume_urn = self.volume_set.VolumeFor(target)
+            for reader in self.readers:
+                if reader.volume_urn == volume_urn:
+                    self.target_readers[target] = reader
+                    return reader
+
+            # Not stored in a volume of its own (e.g. symbolic streams), so
+            # ask the readers which of them can read it.
+            for reader in self.readers:
+                reader.queue.put(("open", target, self.replies))
+
+            sizes = {}
+            for _ in self.readers:
+                reader, size = self.replies.get()
+                if isinstance(size, Exception):
+                    raise size
+                sizes[reader] = size
+
+            best = None
+            for reader in self.readers:
+                if sizes[reader] is not None and (
+                        best is None or sizes[reader] > sizes[best]):
+                    best = reader
+            self.target_readers[target] = best
+
+        return self.target_readers[target]
+
+    def Size(self):
+        return self.image_map.Size()
+
+    def Read(self, length):
+        result, plan = aff4_map._PlanRead(self.image_map.range_map, self.readptr,
+                                          length, self.image_map._ResolveTarget)
+
+        # Find the readers first, as they reply on the same queue as reads.
+        readers = dict((target, self._Reader(target)) for target in plan)
+
+        # Each extent fills its own part of the result, so the readers can
+        # share it.
+        pending = 0
+        for target, extents in plan.items():
+            reader = readers[target]
+            if reader is None:
+                LOGGER.debug("*** Stream %s not found. Substituting zeros. ***",
+                             target)
+                continue
+
+            reader.queue.put(("read", target, extents, result, self.replies))
+            pending += 1
+
+        result_end = len(result)
+        error = None
+        for _ in range(pending):
+            _, reply = self.replies.get()
+            if isinstance(reply, Exception):
+                error = reply
+            else:
+                result_end = min(result_end, reply)
+
+        if error is not None:
+            raise error
+
+        result = bytes(result[:result_end])
+        self.readptr += len(result)
+        return result
+
+    def Close(self):
+        if not self.readers:
+            return
+
+        for reader in self.readers:
+            reader.queue.put(("close",))
+        for reader in self.readers:
+            reader.join()
+        self.readers = []
+
+        self.resolver.Return(self.image_map)
+        self.volume_set.Close()
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        self.Close()
+        if exc_value is not None:
+            return False
@@ -0,0 +1,159 @@
+from __future__ import unicode_literals
+# Copyright 2019 Schatz Forensic Pty Ltd. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License"); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+# WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+# License for the specific language governing permissions and limitations under
+# the License.
+
+from future import standard_library
+standard_library.install_aliases()
+from builtins import range
+import io
+import os
+import shutil
+import tempfile
+import unittest
+
+from pyaff4 import data_store
+from pyaff4 import lexicon
+from pyaff4 import rdfvalue
+from pyaff4 import striped
+from pyaff4 import zip
+from pyaff4 import plugins
+from pyaff4 import version
+
+
+class StripedImageWriterTest(unittest.TestCase):
+    stripe_size = 64 * 1024
+    # 16 stripes for each destination.
+    data = b"".join(b"Stripe test %08d." % i for i in range(100000))[:32 * stripe_size]
+
+    def setUp(self):
+        self.root = tempfile.mkdtemp()
+        self.destinations = []
+        for name in ["a", "b"]:
+            os.mkdir(os.path.join(self.root, name))
+            self.destinations.append(os.path.join(self.root, name, "disk.aff4"))
+
+        self.image_urn = rdfvalue.URN("aff4://b0f2c3ec-9a3e-4c9e-a4bb-4a9f0e2f6e5d")
+
+    def tearDown(self):
+        shutil.rmtree(self.root)
+
+    def _read_image(self, filenames):
+        resolver = data_store.MemoryDataStore()
+        volume_urns = []
+        for filename in filenames:
+            with zip.ZipFile.NewZipFile(resolver, version.aff4v10,
+                    rdfvalue.URN.FromFileName(filename)) as volume:
+                volume_urns.append(volume.urn)
+
+        maps = set()
+        for volume_urn in volume_urns:
+            maps.update(x for x in resolver.Get(volume_urn, self.image_urn,
+                                                lexicon.standard.dataStream)
+                        if x is not None)
+        self.assertEquals(len(maps), len(self.destinations))
+
+        for map_urn in maps:
+            with resolver.AFF4FactoryOpen(map_urn) as image_map:
+                self.assertEquals(image_map.Size(), len(self.data))
+                self.assertEquals(image_map.Read(len(self.data)), self.data)
+
+    def testStriped(self):
+        with striped.StripedImageWriter(self.image_urn, self.destinations,
+                                        stripe_size=self.stripe_size) as writer:
+            writer.WriteStream(io.BytesIO(self.data))
+
+        self.assertEquals(len(writer.VolumeURNs()), 2)
+        self._read_image(self.destinations)
+
+    def testMaxVolumeSize(self):
+        max_volume_size = 4 * self.stripe_size + striped.StripedImageWriter.VolumeOverhead(
+            4 * self.stripe_size, 34)
+        with striped.StripedImageWriter(self.image_urn, self.destinations,
+                                        stripe_size=self.stripe_size,
+                                        max_volume_size=max_volume_size) as writer:
+            writer.Write(self.data)
+
+        filenames = []
+        for destination in self.destinations:
+            for index in range(4):
+                filename = striped.VolumeFilename(destination, index)
+                self.assertTrue(os.path.exists(filename))
+                self.assertTrue(os.stat(filename).st_size <= max_volume_size)
+                filenames.append(filename)
+
+            self.assertFalse(os.path.exists(striped.VolumeFilename(destination, 4)))
+
+        self._read_image(filenames)
+
+    def testMapSize(self):
+        # With small stripes the map in the last volume of each destination
+        # takes up more than the first volumes leave for it.
+        stripe_size = 4096
+        max_volume_size = 64 * stripe_size + striped.StripedImageWriter.VolumeOverhead(
+            64 * stripe_size, 100)
+        with striped.StripedImageWriter(self.image_urn, self.destinations,
+                                        stripe_size=stripe_size,
+                                        max_volume_size=max_volume_size,
+                                        compression=lexicon.AFF4_IMAGE_COMPRESSION_STORED) as writer:
+            for i in range(0, len(self.data), 1000):
+                writer.Write(self.data[i:i + 1000])
+
+        filenames = []
+        for destination in self.destinations:
+            index = 0
+            while os.path.exists(striped.VolumeFilename(destination, index)):
+                filename = striped.VolumeFilename(destination, index)
+                self.assertTrue(os.stat(filename).st_size <= max_volume_size)
+                filenames.append(filename)
+                index += 1
+
+        self.assertTrue(len(filenames) > 4)
+        self._read_image(filenames)
+
+    def testReader(self):
+        max_volume_size = 4 * self.stripe_size + striped.StripedImageWriter.VolumeOverhead(
+            4 * self.stripe_size, 34)
+        with striped.StripedImageWriter(self.image_urn, self.destinations,
+                                        stripe_size=self.stripe_size,
+                                        max_volume_size=max_volume_size) as writer:
+            writer.Write(self.data)
+
+        urns = [rdfvalue.URN.FromFileName(striped.VolumeFilename(destination, index))
+                for index in range(4) for destination in self.destinations]
+        # The volumes load the same in worker processes.
+        for processes in (1, 2):
+            with striped.StripedImageReader(urns, self.image_urn,
+                                            processes=processes) as image:
+                self.assertEquals(image.Size(), len(self.data))
+
+                # Reads which span stripes, and do not line up with them.
+                read_size = 3 * self.stripe_size + 100
+                result = b""
+                while True:
+                    data = image.Read(read_size)
+                    if not data:
+                        break
+                    result += data
+                self.assertEquals(result, self.data)
+
+                image.SeekRead(self.stripe_size - 10)
+                self.assertEquals(image.Read(20),
+                                  self.data[self.stripe_size - 10:self.stripe_size + 10])
+
+                # Every volume is read by its own reader.
+                self.assertEquals(len(set(image.target_readers.values())), len(urns))
+
+
+if __name__ == '__main__':
+    unittest.main()
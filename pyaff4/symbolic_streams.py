@@ -63,6 +63,9 @@ class RepeatedStream(aff4.AFF4Stream):
     def Prepare(self):
         self.SeekRead(0)
 
+    def Close(self):
+        pass
+
 
 class RepeatedStringStream(aff4.AFF4Stream):
 
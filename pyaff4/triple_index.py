@@ -0,0 +1,302 @@
+from __future__ import unicode_literals
+# Copyright 2019 Schatz Forensic Pty Ltd. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License"); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+# WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+# License for the specific language governing permissions and limitations under
+# the License.
+
+"""A binary index of the triples of a volume, read in place through mmap.
+
+Parsing the turtle dominates the time taken to open a volume with a lot of
+metadata. The index holds the same triples in a form which needs no parsing:
+
+  header      magic, byte order mark, validation key, counts and the offsets
+              of the sections below
+  terms       every URN and literal, sorted, as UTF-8 with an array of their
+              offsets. A term's id is its position.
+  spo         (subject, predicate, object) id triples, sorted
+  pos         the same triples, sorted by (predicate, object, subject)
+  namespaces  the namespaces of the turtle, one per line
+
+Literals are encoded as "\\0<datatype>\\0<lexical form>", so they sort before
+the URNs and are never mistaken for one.
+"""
+from builtins import object
+import array
+import bisect
+import mmap
+import os
+import struct
+import tempfile
+
+from pyaff4 import rdfvalue
+from pyaff4 import registry
+from pyaff4 import turtle
+from pyaff4 import utils
+
+MAGIC = b"AFF4TIX1"
+BYTE_ORDER_MARK = 0x01020304
+
+# magic, byte order mark, key, term count, triple count and the offsets of the
+# term offsets, term data, spo, pos and namespaces sections. Everything is in
+# native byte order, as the index is a local cache.
+HEADER = struct.Struct("=8sI32sIIQQQQQ")
+
+LITERAL = "\0"
+
+
+class InvalidIndex(ValueError):
+    """The file is not an index this version can read."""
+
+
+# The datatype each RDFValue class is read back from, where its own is not
+# (e.g. XSDDateTime is read from xsd:datetime).
+DATATYPES = {}
+
+
+def EncodeValue(value):
+    """The term of an RDFValue."""
+    if isinstance(value, rdfvalue.URN):
+        return value.value
+
+    lexical = utils.SmartUnicode(value.SerializeToString())
+    datatype = value.datatype
+    if registry.RDF_TYPE_MAP.get(datatype) is not type(value):
+        if not DATATYPES:
+            for key, cls in registry.RDF_TYPE_MAP.items():
+                DATATYPES.setdefault(cls, key)
+        datatype = DATATYPES.get(type(value), datatype)
+
+    return "%s%s%s%s" % (LITERAL, datatype or "", LITERAL, lexical)
+
+
+def _Align(fd):
+    padding = -fd.tell() % 8
+    fd.write(b"\0" * padding)
+    return fd.tell()
+
+
+def Write(path, triples, key, namespaces=()):
+    """Writes the index of (subject, predicate, value) triples to path.
+
+    Subjects and predicates are strings and values are RDFValues. The file is
+    written aside and renamed into place, so readers never see half of it.
+    """
+    ids = {}
+    encoded = []
+    for subject, predicate, value in triples:
+        encoded.append((subject, predicate, EncodeValue(value)))
+        for term in encoded[-1]:
+            ids[term] = None
+
+    terms = sorted(ids)
+    for i, term in enumerate(terms):
+        ids[term] = i
+
+    spo = sorted(set((ids[s], ids[p], ids[o]) for s, p, o in encoded))
+    pos = sorted((p, o, s) for s, p, o in spo)
+
+    directory = os.path.dirname(path) or "."
+    handle, temp = tempfile.mkstemp(dir=directory, suffix=".tmp")
+    try:
+        with os.fdopen(handle, "wb") as fd:
+            fd.write(b"\0" * HEADER.size)
+
+            offsets = array.array("Q", [0])
+            data = []
+            for term in terms:
+                data.append(term.encode("utf-8"))
+                offsets.append(offsets[-1] + len(data[-1]))
+
+            offsets_start = _Align(fd)
+            fd.write(offsets.tobytes())
+            data_start = fd.tell()
+            fd.write(b"".join(data))
+
+            tables = []
+            for table in (spo, pos):
+                tables.append(_Align(fd))
+                column = array.array("I")
+                for row in table:
+                    column.extend(row)
+                fd.write(column.tobytes())
+
+            namespaces_start = fd.tell()
+            fd.write("\n".join(namespaces).encode("utf-8"))
+
+            fd.seek(0)
+            fd.write(HEADER.pack(MAGIC, BYTE_ORDER_MARK, key, len(terms),
+                                 len(spo), offsets_start, data_start,
+                                 tables[0], tables[1], namespaces_start))
+
+        os.replace(temp, path)
+    except:
+        os.unlink(temp)
+        raise
+
+
+class _Terms(object):
+    """The sorted term strings, as a sequence for bisect."""
+
+    def __init__(self, index):
+        self.index = index
+
+    def __len__(self):
+        return self.index.term_count
+
+    def __getitem__(self, i):
+        return self.index.Term(i)
+
+
+class _Keys(object):
+    """The first ids of each triple of a table, as a sequence for bisect."""
+
+    def __init__(self, table, width):
+        self.table = table
+        self.width = width
+
+    def __len__(self):
+        return len(self.table) // 3
+
+    def __getitem__(self, i):
+        i *= 3
+        return tuple(self.table[i:i + self.width])
+
+
+class TripleIndex(object):
+    """An index written by Write(), mapped read only."""
+
+    def __init__(self, path):
+        with open(path, "rb") as fd:
+            self.map = mmap.mmap(fd.fileno(), 0, access=mmap.ACCESS_READ)
+
+        try:
+            if len(self.map) < HEADER.size:
+                raise InvalidIndex("Truncated index")
+
+            (magic, mark, self.key, self.term_count, self.triple_count,
+             offsets, data, spo, pos, namespaces) = HEADER.unpack_from(self.map)
+            if magic != MAGIC or mark != BYTE_ORDER_MARK:
+                raise InvalidIndex("Not an index of this version")
+            if namespaces > len(self.map):
+                raise InvalidIndex("Truncated index")
+
+            self.view = view = memoryview(self.map)
+            self.offsets = view[offsets:offsets + 8 * (self.term_count + 1)].cast("Q")
+            self.data = data
+            size = 12 * self.triple_count
+            self.spo = view[spo:spo + size].cast("I")
+            self.pos = view[pos:pos + size].cast("I")
+            self.namespaces = [x for x in utils.SmartUnicode(
+                self.map[namespaces:]).split("\n") if x]
+        except (struct.error, TypeError, ValueError) as e:
+            self.Close()
+            if isinstance(e, InvalidIndex):
+                raise
+            raise InvalidIndex(str(e))
+
+        self.literal = turtle.LiteralFactory()
+
+    def Close(self):
+        for name in ("offsets", "spo", "pos", "view"):
+            view = self.__dict__.pop(name, None)
+            if view is not None:
+                view.release()
+        self.map.close()
+
+    def __len__(self):
+        return self.triple_count
+
+    def Term(self, term_id):
+        start = self.data + self.offsets[term_id]
+        end = self.data + self.offsets[term_id + 1]
+        return self.map[start:end].decode("utf-8")
+
+    def Lookup(self, term):
+        """The id of a term, or None if the index does not hold it."""
+        terms = _Terms(self)
+        i = bisect.bisect_left(terms, term)
+        if i < len(terms) and terms[i] == term:
+            return i
+        return None
+
+    def Value(self, term_id):
+        """The RDFValue of a term."""
+        term = self.Term(term_id)
+        if term.startswith(LITERAL):
+            _, datatype, lexical = term.split(LITERAL, 2)
+            return self.literal(lexical, datatype or None)
+
+        result = rdfvalue.URN.__new__(rdfvalue.URN)
+        result.value = term
+        return result
+
+    @staticmethod
+    def _Range(table, key):
+        """The [start, end) rows of a table which start with the ids of key."""
+        keys = _Keys(table, len(key))
+        start = bisect.bisect_left(keys, key)
+        end = bisect.bisect_left(keys, key[:-1] + (key[-1] + 1,), start)
+        return start, end
+
+    def _Rows(self, table, *key):
+        """Yields the rows of a table which start with key, as id triples."""
+        start, end = self._Range(table, key)
+        for row in range(start * 3, end * 3, 3):
+            yield table[row], table[row + 1], table[row + 2]
+
+    def IsSubject(self, term_id):
+        start, end = self._Range(self.spo, (term_id,))
+        return start < end
+
+    def Subjects(self):
+        """Yields the ids of all subjects, in order."""
+        spo = self.spo
+        last = None
+        for row in range(0, len(spo), 3):
+            if spo[row] != last:
+                last = spo[row]
+                yield last
+
+    def SubjectsWithPrefix(self, prefix):
+        """Yields the subject strings which start with prefix, in order."""
+        terms = _Terms(self)
+        i = bisect.bisect_left(terms, prefix)
+        while i < len(terms):
+            term = terms[i]
+            if not term.startswith(prefix):
+                break
+            if self.IsSubject(i):
+                yield term
+            i += 1
+
+    def Objects(self, subject, predicate):
+        """The object ids of (subject id, predicate id)."""
+        return [o for _, _, o in self._Rows(self.spo, subject, predicate)]
+
+    def Items(self, subject):
+        """The (predicate id, [object ids]) of a subject id."""
+        result = []
+        for _, p, o in self._Rows(self.spo, subject):
+            if not result or result[-1][0] != p:
+                result.append((p, []))
+            result[-1][1].append(o)
+        return result
+
+    def Scan(self, predicate):
+        """Yields (subject id, object id) of each triple of a predicate id."""
+        for _, o, s in self._Rows(self.pos, predicate):
+            yield s, o
+
+    def Match(self, predicate, value):
+        """Yields the subject ids with the object id value for a predicate."""
+        for _, _, s in self._Rows(self.pos, predicate, value):
+            yield s
@@ -0,0 +1,123 @@
+from __future__ import unicode_literals
+# Copyright 2019 Schatz Forensic Pty Ltd. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License"); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+# WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+# License for the specific language governing permissions and limitations under
+# the License.
+
+import os
+import shutil
+import tempfile
+import unittest
+
+import rdflib
+
+from pyaff4 import lexicon
+from pyaff4 import rdfvalue
+from pyaff4 import triple_index
+
+KEY = b"k" * 32
+
+
+class TripleIndexTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.mkdtemp()
+        self.path = os.path.join(self.directory, "volume.index")
+
+        self.image_type = rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE)
+        self.triples = []
+        for i in range(3):
+            subject = "aff4://volume/image%d" % i
+            self.triples.append((subject, lexicon.AFF4_TYPE, self.image_type))
+            self.triples.append((subject, lexicon.AFF4_STREAM_SIZE,
+                                 rdfvalue.XSDInteger(i * 10)))
+        self.triples.append(("aff4://other", lexicon.standard.hash,
+                             rdfvalue.MD5Hash("d5825dc1152a42958c8219ff11ed01a3")))
+        self.triples.append(("aff4://other", lexicon.AFF4_TYPE,
+                             rdfvalue.URN(lexicon.AFF4_MAP_TYPE)))
+        self.triples.append(("aff4://other", lexicon.AFF4_NAMESPACE + "birthTime", rdfvalue.XSDDateTime(
+            rdflib.Literal("2019-01-01T10:00:00+00:00",
+                           datatype=rdflib.XSD.datetime))))
+
+        triple_index.Write(self.path, self.triples, KEY, ["aff4://volume"])
+        self.index = triple_index.TripleIndex(self.path)
+
+    def tearDown(self):
+        self.index.Close()
+        shutil.rmtree(self.directory)
+
+    def testRoundTrip(self):
+        self.assertEquals(self.index.key, KEY)
+        self.assertEquals(self.index.namespaces, ["aff4://volume"])
+        self.assertEquals(len(self.index), len(self.triples))
+        self.assertIsNone(self.index.Lookup("aff4://missing"))
+
+        for subject, predicate, value in self.triples:
+            subject_id = self.index.Lookup(subject)
+            predicate_id = self.index.Lookup(predicate)
+            values = [self.index.Value(x) for x in
+                      self.index.Objects(subject_id, predicate_id)]
+            self.assertEquals(values, [value])
+            self.assertEquals(type(values[0]), type(value))
+
+        items = self.index.Items(self.index.Lookup("aff4://volume/image1"))
+        self.assertEquals(
+            sorted((self.index.Term(p), [self.index.Value(x) for x in o])
+                   for p, o in items),
+            [(lexicon.AFF4_STREAM_SIZE, [10]),
+             (lexicon.AFF4_TYPE, [self.image_type])])
+
+    def testQueries(self):
+        self.assertEquals(
+            list(self.index.SubjectsWithPrefix("aff4://volume/")),
+            ["aff4://volume/image%d" % i for i in range(3)])
+
+        # Objects are not subjects.
+        self.assertEquals(list(self.index.SubjectsWithPrefix("http://")), [])
+        self.assertEquals(len(list(self.index.Subjects())), 4)
+
+        type_id = self.index.Lookup(lexicon.AFF4_TYPE)
+        image_id = self.index.Lookup(self.image_type.value)
+        self.assertEquals(
+            [self.index.Term(x) for x in self.index.Match(type_id, image_id)],
+            ["aff4://volume/image%d" % i for i in range(3)])
+
+        self.assertEquals(
+            sorted((self.index.Term(s), self.index.Value(o)) for s, o in
+                   self.index.Scan(self.index.Lookup(lexicon.AFF4_STREAM_SIZE))),
+            [("aff4://volume/image%d" % i, i * 10) for i in range(3)])
+
+    def testRewrite(self):
+        # A rewritten index replaces the old one in a single step, and those
+        # who had the old one open keep reading it.
+        triple_index.Write(self.path, self.triples[:2], KEY)
+        index = triple_index.TripleIndex(self.path)
+        try:
+            self.assertEquals(len(index), 2)
+        finally:
+            index.Close()
+
+        self.assertEquals(len(self.index), len(self.triples))
+        self.assertEquals(os.listdir(self.directory), ["volume.index"])
+
+    def testInvalid(self):
+        with open(self.path, "rb") as fd:
+            data = fd.read()
+
+        for corrupt in (b"garbage", b"X" + data[1:], data[:200]):
+            with open(self.path, "wb") as fd:
+                fd.write(corrupt)
+            self.assertRaises(triple_index.InvalidIndex,
+                              triple_index.TripleIndex, self.path)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,614 @@
+from __future__ import unicode_literals
+# Copyright 2019 Schatz Forensic Pty Ltd. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License"); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+# WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+# License for the specific language governing permissions and limitations under
+# the License.
+
+"""Compact storage of the triples held by a MemoryDataStore.
+
+URNs (subjects, predicates and URN values) are interned into integer ids, and
+the triples of a graph are kept in columns of machine integers, one row per
+triple. Literal values only keep their raw value and a small class code, and
+are rebuilt as RDFValues when read.
+
+The rows of a subject are chained from its last row backwards, so a subject's
+triples are found without any per-triple index. The rows of each predicate, and
+of each (predicate, URN value) pair, are indexed for queries by predicate and
+by type. Removed or overwritten rows are left in those indexes and skipped
+when read, until Compact() rebuilds the columns.
+
+Subject strings are also kept sorted, so prefix queries are a range scan.
+
+Every change bumps the store's version, and each subject remembers the version
+of its last change, so the subjects changed since some point are cheap to find.
+"""
+from builtins import object
+from builtins import zip
+import array
+import bisect
+
+from pyaff4 import rdfvalue
+from pyaff4 import utils
+
+# Rows of no subject, or a removed triple's predicate.
+NONE = -1
+
+# Value kinds: a URN is stored as its id, an RDFValue which holds nothing but
+# its value as that value and the code of its class, anything else as is.
+URN_KIND = 0
+OBJECT_KIND = 255
+
+
+# Characters which end the literal prefix of a regular expression.
+REGEX_SPECIAL = set(".^$*+?{}[]|()\\")
+REGEX_QUANTIFIERS = set("*+?{")
+
+
+def LiteralPrefix(pattern):
+    """The literal text every match of a regular expression starts with."""
+    if "|" in pattern:
+        # An alternative might start anywhere.
+        return ""
+
+    result = []
+    i = 0
+    if pattern.startswith("^"):
+        i = 1
+    while i < len(pattern):
+        char = pattern[i]
+        if char == "\\":
+            if i + 1 >= len(pattern) or pattern[i + 1].isalnum():
+                # Character classes (\d) and anchors (\A) are not literal.
+                break
+            char = pattern[i + 1]
+            step = 2
+        elif char in REGEX_SPECIAL:
+            break
+        else:
+            step = 1
+
+        if pattern[i + step:i + step + 1] in REGEX_QUANTIFIERS:
+            # The quantified character may not be there at all.
+            break
+
+        result.append(char)
+        i += step
+
+    return "".join(result)
+
+
+def Normalize(value):
+    """The form of a URN string used as a key, as URN.SerializeToString()."""
+    try:
+        return rdfvalue.URN(value).SerializeToString()
+    except ValueError:
+        # Python 3 rejects the [offset:length] suffix of byte range URNs.
+        return value
+
+
+def _Expand(strings, classes, kind, value):
+    """The RDFValue of a compact value."""
+    if kind == OBJECT_KIND:
+        return value
+
+    if kind == URN_KIND:
+        result = rdfvalue.URN.__new__(rdfvalue.URN)
+        result.value = strings[value]
+    else:
+        cls = classes[kind - 1]
+        result = cls.__new__(cls)
+        result.value = value
+
+    return result
+
+
+class Interner(object):
+    """Maps URN strings to dense integer ids, and value classes to codes.
+
+    Every string is normalized once, the first time it is seen, after which
+    both it and its normal form map straight to the id.
+    """
+
+    def __init__(self):
+        self.ids = {}
+        self.strings = []
+        self.classes = []
+        self.class_codes = {}
+
+    def __len__(self):
+        return len(self.strings)
+
+    @staticmethod
+    def _String(urn):
+        if isinstance(urn, rdfvalue.URN):
+            return urn.value
+        return utils.SmartUnicode(urn)
+
+    def Intern(self, urn):
+        """The id of urn (a URN or a string), allocating one if it is new."""
+        value = self._String(urn)
+        result = self.ids.get(value)
+        if result is None:
+            normalized = Normalize(value)
+            result = self.ids.get(normalized)
+            if result is None:
+                result = self.ids[normalized] = len(self.strings)
+                self.strings.append(normalized)
+            self.ids[value] = result
+
+        return result
+
+    def InternNormal(self, string):
+        """The id of a string already in normal form (e.g. one from another
+        Interner), allocating one if it is new."""
+        result = self.ids.get(string)
+        if result is None:
+            result = self.ids[string] = len(self.strings)
+            self.strings.append(string)
+
+        return result
+
+    def Lookup(self, urn):
+        """The id of urn, or None if it was never interned."""
+        value = self._String(urn)
+        result = self.ids.get(value)
+        if result is None:
+            result = self.ids.get(Normalize(value))
+            if result is not None:
+                self.ids[value] = result
+
+        return result
+
+    def Retain(self, keep):
+        """Forgets the strings of all ids not in keep.
+
+        The ids of forgotten strings are not reused - a string interned again
+        gets a new id.
+        """
+        strings = self.strings
+        for i, string in enumerate(strings):
+            if string is not None and i not in keep:
+                strings[i] = None
+        self.ids = dict((k, v) for k, v in self.ids.items() if v in keep)
+
+    def ClassCode(self, cls):
+        result = self.class_codes.get(cls)
+        if result is None:
+            if len(self.classes) >= OBJECT_KIND - 1:
+                return OBJECT_KIND
+            self.classes.append(cls)
+            result = self.class_codes[cls] = len(self.classes)
+
+        return result
+
+
+class TripleStore(object):
+    """The triples of one graph, as columns indexed by row.
+
+    Iterating the store yields the subject strings, like the dict it replaces.
+    """
+
+    def __init__(self, interner):
+        self.interner = interner
+
+        # The last row of each subject id.
+        self.heads = {}
+
+        self.subjects = array.array("i")
+        self.predicates = array.array("i")
+        # The previous row of the same subject, or NONE.
+        self.previous = array.array("i")
+        # The last row of each (subject id, predicate id), and the previous row
+        # of the same pair, so the values of one predicate are found without
+        # walking all of the subject's.
+        self.pair_heads = {}
+        self.pair_previous = array.array("i")
+        self.kinds = array.array("B")
+        self.objects = []
+
+        # The rows of each predicate id, and of each URN value id of each
+        # predicate id (None for the rows with other values).
+        self.predicate_rows = {}
+        self.value_rows = {}
+
+        # The subject strings in sorted order. New subjects are kept aside and
+        # merged in by the next prefix query.
+        self.sorted_subjects = []
+        self.unsorted_subjects = []
+        self.indexed_subjects = set()
+
+        # The number of changes made, and the version of each subject id's
+        # last change.
+        self.version = 0
+        self.changed = {}
+
+    def __len__(self):
+        return len(self.heads)
+
+    def __iter__(self):
+        strings = self.interner.strings
+        for subject in list(self.heads):
+            yield strings[subject]
+
+    def __contains__(self, subject):
+        subject = self.interner.Lookup(subject)
+        return subject is not None and subject in self.heads
+
+    def SubjectIds(self):
+        return list(self.heads)
+
+    def ChangedSince(self, version):
+        """The ids of the live subjects changed after the version."""
+        changed = self.changed
+        return [x for x in self.heads if changed[x] > version]
+
+    def _SortedSubjects(self):
+        if self.unsorted_subjects:
+            strings = self.interner.strings
+            new_subjects = sorted(strings[x] for x in self.unsorted_subjects)
+            # Sorting two sorted runs is a linear merge.
+            self.sorted_subjects.extend(new_subjects)
+            self.sorted_subjects.sort()
+            self.unsorted_subjects = []
+
+        return self.sorted_subjects
+
+    def SubjectsWithPrefix(self, prefix):
+        """Yields the subject strings which start with prefix, in order."""
+        subjects = self._SortedSubjects()
+        ids = self.interner.ids
+        heads = self.heads
+        index = bisect.bisect_left(subjects, prefix)
+        while index < len(subjects):
+            subject = subjects[index]
+            if not subject.startswith(prefix):
+                break
+
+            # Removed subjects stay in the index.
+            if ids[subject] in heads:
+                yield subject
+            index += 1
+
+    def Rows(self, subject, predicate=None):
+        """The live rows of a subject id (with predicate id), oldest first."""
+        result = []
+        predicates = self.predicates
+        if predicate is None:
+            row = self.heads.get(subject, NONE)
+            previous = self.previous
+        else:
+            row = self.pair_heads.get((subject, predicate), NONE)
+            previous = self.pair_previous
+        while row != NONE:
+            if (predicate is None and predicates[row] != NONE or
+                    predicates[row] == predicate):
+                result.append(row)
+            row = previous[row]
+
+        result.reverse()
+        return result
+
+    def Scan(self, predicate):
+        """Yields (subject id, row) of every triple with the predicate id."""
+        predicates = self.predicates
+        subjects = self.subjects
+        for row in self.predicate_rows.get(predicate, ()):
+            if predicates[row] == predicate:
+                yield subjects[row], row
+
+    def Match(self, predicate, value):
+        """Yields (subject id, row) of the triples of predicate with the URN id
+        value, or with any other kind of value if value is None."""
+        rows = self.value_rows.get(predicate, {}).get(value, ())
+        predicates = self.predicates
+        kinds = self.kinds
+        seen = set()
+        for row in rows:
+            if predicates[row] != predicate or row in seen:
+                continue
+
+            if value is None:
+                if kinds[row] == URN_KIND:
+                    continue
+            elif kinds[row] != URN_KIND or self.objects[row] != value:
+                continue
+
+            seen.add(row)
+            yield self.subjects[row], row
+
+    @staticmethod
+    def _IndexKey(kind, value):
+        if kind == URN_KIND:
+            return value
+        return None
+
+    def _Index(self, predicate, kind, value, row):
+        value = self._IndexKey(kind, value)
+        values = self.value_rows.get(predicate)
+        if values is None:
+            values = self.value_rows[predicate] = {}
+        rows = values.get(value)
+        if rows is None:
+            rows = values[value] = array.array("i")
+        rows.append(row)
+
+    def _Compact(self, value):
+        if type(value) is rdfvalue.URN and len(value.__dict__) == 1:
+            return URN_KIND, self.interner.Intern(value)
+
+        attributes = getattr(value, "__dict__", None)
+        if attributes is not None and len(attributes) == 1 and "value" in attributes:
+            kind = self.interner.ClassCode(type(value))
+            if kind != OBJECT_KIND:
+                return kind, value.value
+
+        return OBJECT_KIND, value
+
+    def Value(self, row):
+        """The RDFValue of a row."""
+        return _Expand(self.interner.strings, self.interner.classes,
+                       self.kinds[row], self.objects[row])
+
+    def Values(self, subject, predicate):
+        return [self.Value(x) for x in self.Rows(subject, predicate)]
+
+    def _Append(self, subject, predicate, kind, value):
+        row = len(self.predicates)
+        self.subjects.append(subject)
+        self.predicates.append(predicate)
+        self.previous.append(self.heads.get(subject, NONE))
+        self.pair_previous.append(self.pair_heads.get((subject, predicate), NONE))
+        self.kinds.append(kind)
+        self.objects.append(value)
+        self.heads[subject] = row
+        self.pair_heads[subject, predicate] = row
+        self.version += 1
+        self.changed[subject] = self.version
+
+        if subject not in self.indexed_subjects:
+            self.indexed_subjects.add(subject)
+            self.unsorted_subjects.append(subject)
+
+        rows = self.predicate_rows.get(predicate)
+        if rows is None:
+            rows = self.predicate_rows[predicate] = array.array("i")
+        rows.append(row)
+        self._Index(predicate, kind, value, row)
+
+    def Add(self, subject, predicate, value):
+        """Adds a value to those of (subject, predicate), if it is new."""
+        kind, compact = self._Compact(value)
+        if kind == URN_KIND:
+            # The rows holding the URN are few, even when the subject has
+            # many values for the predicate (e.g. a container's contents).
+            subjects = self.subjects
+            predicates = self.predicates
+            kinds = self.kinds
+            objects = self.objects
+            for row in self.value_rows.get(predicate, {}).get(compact, ()):
+                if (subjects[row] == subject and predicates[row] == predicate and
+                        kinds[row] == URN_KIND and objects[row] == compact):
+                    return
+
+            self._Append(subject, predicate, kind, compact)
+            return
+
+        for row in self.Rows(subject, predicate):
+            if self.kinds[row] == kind:
+                if self.objects[row] == compact:
+                    return
+            elif self.Value(row) == value:
+                return
+
+        self._Append(subject, predicate, kind, compact)
+
+    def Extend(self, columns):
+        """Adds the triples of Columns (e.g. of a store in another process), in
+        the order they were added there.
+
+        Ids and class codes are mapped once each. Triples of subjects held
+        here already are skipped if they are not new, as Add() does.
+        """
+        interner = self.interner
+        strings = columns.strings
+        classes = columns.classes
+        ids = {}
+        codes = {}
+        # Whether each subject (by its id in columns) was held before.
+        held = {}
+        for subject, predicate, kind, value in zip(
+                columns.subjects, columns.predicates, columns.kinds,
+                columns.objects):
+            existing = held.get(subject)
+            subject_id = ids.get(subject)
+            if subject_id is None:
+                subject_id = ids[subject] = interner.InternNormal(strings[subject])
+            if existing is None:
+                existing = held[subject] = subject_id in self.heads
+
+            predicate_id = ids.get(predicate)
+            if predicate_id is None:
+                predicate_id = ids[predicate] = interner.InternNormal(
+                    strings[predicate])
+
+            if kind == URN_KIND:
+                value_id = ids.get(value)
+                if value_id is None:
+                    value_id = ids[value] = interner.InternNormal(strings[value])
+                value = value_id
+            elif kind != OBJECT_KIND:
+                code = codes.get(kind)
+                if code is None:
+                    code = codes[kind] = interner.ClassCode(classes[kind - 1])
+                if code == OBJECT_KIND:
+                    value = _Expand(strings, classes, kind, value)
+                kind = code
+
+            if existing:
+                self.Add(subject_id, predicate_id, _Expand(
+                    interner.strings, interner.classes, kind, value))
+            else:
+                self._Append(subject_id, predicate_id, kind, value)
+
+    def Set(self, subject, predicate, value):
+        """Replaces the values of (subject, predicate) with value."""
+        kind, value = self._Compact(value)
+        rows = self.Rows(subject, predicate)
+        if not rows:
+            self._Append(subject, predicate, kind, value)
+            return
+
+        # Update in place, so properties which are set over and over (e.g.
+        # stream sizes) do not grow the store.
+        row = rows[0]
+        if (len(rows) == 1 and self.kinds[row] == kind and
+                self.objects[row] == value):
+            return
+
+        if self._IndexKey(self.kinds[row], self.objects[row]) != self._IndexKey(kind, value):
+            self._Index(predicate, kind, value, row)
+        self.kinds[row] = kind
+        self.objects[row] = value
+        self.version += 1
+        self.changed[subject] = self.version
+        for row in rows[1:]:
+            self._Remove(row)
+
+    def _Remove(self, row):
+        self.predicates[row] = NONE
+        self.objects[row] = None
+
+    def RemoveSubject(self, subject):
+        for row in self.Rows(subject):
+            self.pair_heads.pop((subject, self.predicates[row]), None)
+            self._Remove(row)
+        if self.heads.pop(subject, None) is not None:
+            self.version += 1
+
+    def ReferencedIds(self):
+        """The ids of the subjects, predicates and URN values of live rows."""
+        result = set(self.heads)
+        predicates = self.predicates
+        kinds = self.kinds
+        objects = self.objects
+        for subject in self.heads:
+            for row in self.Rows(subject):
+                result.add(predicates[row])
+                if kinds[row] == URN_KIND:
+                    result.add(objects[row])
+
+        return result
+
+    def Compact(self):
+        """Drops removed rows, so the columns only hold the live triples.
+
+        Rows are renumbered, so no row from before may be used after.
+        """
+        rows = []
+        for subject in self.heads:
+            rows.extend(self.Rows(subject))
+        rows.sort()
+
+        subjects = self.subjects
+        predicates = self.predicates
+        kinds = self.kinds
+        objects = self.objects
+
+        self.heads = {}
+        self.pair_heads = {}
+        self.subjects = array.array("i")
+        self.predicates = array.array("i")
+        self.previous = array.array("i")
+        self.pair_previous = array.array("i")
+        self.kinds = array.array("B")
+        self.objects = []
+        self.predicate_rows = {}
+        self.value_rows = {}
+        for row in rows:
+            subject = subjects[row]
+            predicate = predicates[row]
+            new_row = len(self.predicates)
+            self.subjects.append(subject)
+            self.predicates.append(predicate)
+            self.previous.append(self.heads.get(subject, NONE))
+            self.pair_previous.append(self.pair_heads.get((subject, predicate), NONE))
+            self.kinds.append(kinds[row])
+            self.objects.append(objects[row])
+            self.heads[subject] = new_row
+            self.pair_heads[subject, predicate] = new_row
+
+            predicate_rows = self.predicate_rows.get(predicate)
+            if predicate_rows is None:
+                predicate_rows = self.predicate_rows[predicate] = array.array("i")
+            predicate_rows.append(new_row)
+            self._Index(predicate, kinds[row], objects[row], new_row)
+
+        self.DropRemovedSubjects()
+
+    def DropRemovedSubjects(self):
+        """Drops removed subjects from the subject index.
+
+        Their ids may then be forgotten by the interner.
+        """
+        heads = self.heads
+        ids = self.interner.ids
+        self.sorted_subjects = [x for x in self.sorted_subjects
+                                if ids.get(x) in heads]
+        self.unsorted_subjects = [x for x in self.unsorted_subjects
+                                  if x in heads]
+        self.indexed_subjects = set(heads)
+        self.changed = dict((x, self.changed[x]) for x in heads)
+
+    def Items(self, subject):
+        """The (predicate id, [values]) of a subject id, in order of addition."""
+        result = []
+        index = {}
+        for row in self.Rows(subject):
+            predicate = self.predicates[row]
+            values = index.get(predicate)
+            if values is None:
+                values = index[predicate] = []
+                result.append((predicate, values))
+            values.append(self.Value(row))
+
+        return result
+
+
+class Columns(object):
+    """The live triples of a TripleStore as plain columns, with the strings and
+    classes their ids and kinds refer to.
+
+    These pickle far smaller than the store, for passing to another process,
+    and are added to a store with TripleStore.Extend().
+    """
+
+    def __init__(self, store):
+        self.strings = store.interner.strings
+        self.classes = store.interner.classes
+
+        rows = [row for row, predicate in enumerate(store.predicates)
+                if predicate != NONE]
+        self.subjects = array.array("i", (store.subjects[x] for x in rows))
+        self.predicates = array.array("i", (store.predicates[x] for x in rows))
+        self.kinds = array.array("B", (store.kinds[x] for x in rows))
+        self.objects = [store.objects[x] for x in rows]
+
+    def __len__(self):
+        return len(self.objects)
+
+    def __iter__(self):
+        """Yields the (subject, predicate, RDFValue) triples, as strings."""
+        strings = self.strings
+        for subject, predicate, kind, value in zip(
+                self.subjects, self.predicates, self.kinds, self.objects):
+            yield (strings[subject], strings[predicate],
+                   _Expand(strings, self.classes, kind, value))
@@ -1,3 +1,625 @@
+from __future__ import unicode_literals
+# Copyright 2019 Schatz Forensic Pty Ltd. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License"); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+# WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+# License for the specific language governing permissions and limitations under
+# the License.
+
+"""Turtle helpers, and a streaming reader and writer for the Turtle AFF4
+writers emit.
+
+The reader handles prefix and base directives, IRIs, prefixed names, string,
+numeric and boolean literals, and predicate and object lists. Anything else
+(blank nodes, collections, escaped names) raises UnsupportedSyntax, and the
+caller falls back to rdflib.
+
+The writer emits the same subset, one subject block at a time. BlockIndex
+finds those blocks without parsing them, and Split() cuts a document at them
+into pieces which parse separately.
+"""
+from builtins import chr
+from builtins import object
+import array
+import bisect
+import codecs
+import io
+import re
+
+import rdflib
+
+from pyaff4 import rdfvalue
+from pyaff4 import registry
+
+RDF_NAMESPACE = "http://www.w3.org/1999/02/22-rdf-syntax-ns#"
+RDF_TYPE = RDF_NAMESPACE + "type"
+XSD_NAMESPACE = "http://www.w3.org/2001/XMLSchema#"
+XSD_INTEGER = XSD_NAMESPACE + "integer"
+
+BLOCK_SIZE = 1024 * 1024
+
+# Tokens this close to the end of the buffer may carry on in the next block
+# (e.g. "aff4:a" "." "b").
+LOOKAHEAD = 2
+
+WHITESPACE = re.compile(r"(?:\s+|#[^\n]*)+")
+
+TOKEN = re.compile(r"""
+    <(?P<iri>(?:[^<>"{}|^`\\\x00-\x20]|\\u[0-9a-fA-F]{4}|\\U[0-9a-fA-F]{8})*)>
+  | "\"\"(?P<long_string>(?:[^"\\]|\\.|"(?!""))*)\"\"\"
+  | '''(?P<long_single_string>(?:[^'\\]|\\.|'(?!''))*)'''
+  | "(?P<string>(?:[^"\\\n\r]|\\.)*)"
+  | '(?P<single_string>(?:[^'\\\n\r]|\\.)*)'
+  | (?P<pname>(?:[^\W\d][\w\-.]*)?:(?:[\w\-:%]|\.(?=[\w\-:%]))*)
+  | (?P<number>[+-]?(?:\d+\.\d+|\.\d+|\d+)(?:[eE][+-]?\d+)?)
+  | (?P<at>@[A-Za-z]+(?:-[A-Za-z0-9]+)*)
+  | (?P<datatype>\^\^)
+  | (?P<word>[A-Za-z]+)
+  | (?P<punctuation>[.;,])
+""", re.VERBOSE)
+
+STRING_ESCAPE = re.compile(r"\\(?:u([0-9a-fA-F]{4})|U([0-9a-fA-F]{8})|(.))",
+                           re.DOTALL)
+STRING_ESCAPES = {"t": "\t", "b": "\b", "n": "\n", "r": "\r", "f": "\f",
+                  '"': '"', "'": "'", "\\": "\\"}
+
+
+# Local names the writer abbreviates to prefixed names.
+LOCAL_NAME = re.compile(r"[A-Za-z_][A-Za-z0-9_\-]*\Z")
+INTEGER = re.compile(r"[+-]?[0-9]+\Z")
+
+# Characters escaped by the writer in IRIs and in strings.
+IRI_SPECIAL = re.compile(r'[\x00-\x20<>"{}|^`\\]')
+STRING_SPECIAL = re.compile(r'[\x00-\x1f"\\]')
+CHARACTER_ESCAPES = {"\t": "\\t", "\b": "\\b", "\n": "\\n", "\r": "\\r",
+                    "\f": "\\f", '"': '\\"', "\\": "\\\\"}
+
+# Flush written text to the stream once this much is pending.
+WRITE_BUFFER_SIZE = 64 * 1024
+
+# The start of a line which starts a statement: an IRI, a prefixed name, or
+# anything else (a directive, a comment or syntax BlockIndex does not handle).
+BLOCK_START = re.compile(
+    br"""^(?:<([^>\n]*)>|([^\s<>@#\[("']*?:[^\s;,]*)|(\S))""", re.M)
+# A character of a prefixed name.
+NAME_CHARACTER = re.compile(br"[\w\-.:%]")
+# The start of a line which is neither blank, indented nor a comment.
+LINE_START = re.compile(br"^[^\s#]", re.M)
+# A directive, in either syntax.
+DIRECTIVE = re.compile(br"(?:@prefix|@base|prefix|base)[ \t<]", re.I)
+
+
+class UnsupportedSyntax(Exception):
+    """The Turtle uses syntax the streaming reader does not handle."""
+
+
+def _Unescape(match):
+    if match.group(3) is not None:
+        result = STRING_ESCAPES.get(match.group(3))
+        if result is None:
+            raise UnsupportedSyntax("Bad string escape \\%s" % match.group(3))
+        return result
+
+    return chr(int(match.group(1) or match.group(2), 16))
+
+
+def Unescape(string):
+    if "\\" not in string:
+        return string
+    return STRING_ESCAPE.sub(_Unescape, string)
+
+
+class LiteralFactory(object):
+    """Converts literals to RDFValues, as registry.RDF_TYPE_MAP says."""
+
+    def __init__(self):
+        self.types = dict((str(k), v) for k, v in registry.RDF_TYPE_MAP.items())
+        self.plain = {}
+
+    def __call__(self, lexical, datatype=None):
+        if datatype is None:
+            return rdfvalue.XSDString(lexical)
+
+        cls = self.types.get(datatype)
+        if cls is None:
+            # Default to a string literal, in rdflib's canonical form (e.g. of
+            # an xsd:dateTime).
+            return rdfvalue.XSDString(
+                rdflib.Literal(lexical, datatype=rdflib.URIRef(datatype)))
+
+        plain = self.plain.get(cls)
+        if plain is None:
+            # Most types are built from the lexical form. The others expect
+            # the rdflib literal.
+            plain = self.plain[cls] = cls.Set in (
+                rdfvalue.XSDString.Set, rdfvalue.XSDInteger.Set)
+
+        if plain:
+            return cls(lexical)
+        return cls(rdflib.Literal(lexical, datatype=rdflib.URIRef(datatype)))
+
+
+class TurtleReader(object):
+    """Reads (subject, predicate, value) triples from a Turtle stream.
+
+    Subjects and predicates are yielded as strings and values as RDFValues.
+    The stream is read and decoded a block at a time, so only the statement
+    being parsed is held in memory. The prefixes declared so far are in
+    namespaces.
+    """
+
+    def __init__(self, stream, block_size=BLOCK_SIZE):
+        self.stream = stream
+        self.block_size = block_size
+        self.decoder = codecs.getincrementaldecoder("utf-8")()
+        self.buffer = ""
+        self.position = 0
+        self.eof = False
+        self.pushed_back = None
+        self.namespaces = {}
+        self.literal = LiteralFactory()
+
+    def _Fill(self):
+        data = self.stream.read(self.block_size)
+        if not data:
+            self.eof = True
+            text = self.decoder.decode(b"", True)
+        else:
+            text = self.decoder.decode(data)
+
+        self.buffer = self.buffer[self.position:] + text
+        self.position = 0
+
+    def _Next(self):
+        """The next token, as (kind, text), or None at the end."""
+        if self.pushed_back is not None:
+            result = self.pushed_back
+            self.pushed_back = None
+            return result
+
+        while True:
+            match = WHITESPACE.match(self.buffer, self.position)
+            if match is not None:
+                if match.end() + LOOKAHEAD > len(self.buffer) and not self.eof:
+                    self._Fill()
+                    continue
+                self.position = match.end()
+
+            match = TOKEN.match(self.buffer, self.position)
+            if not self.eof and (
+                    match is None or match.end() + LOOKAHEAD > len(self.buffer) or
+                    self._LongStringStart(match)):
+                self._Fill()
+                continue
+
+            if match is None:
+                if self.position == len(self.buffer):
+                    return None
+                raise UnsupportedSyntax(
+                    "Unexpected %r" % self.buffer[self.position:self.position + 20])
+
+            self.position = match.end()
+            kind = match.lastgroup
+            return kind, match.group(kind)
+
+    def _LongStringStart(self, match):
+        """Whether an empty string is the start of a long string whose end
+        has not been read yet."""
+        if match.lastgroup not in ("string", "single_string") or match.group(
+                match.lastgroup):
+            return False
+
+        quote = self.buffer[match.start()]
+        return self.buffer[match.end():match.end() + 1] == quote
+
+    def _PushBack(self, token):
+        self.pushed_back = token
+
+    def _Expect(self, kind, text=None):
+        token = self._Next()
+        if token is None or token[0] != kind or (
+                text is not None and token[1] != text):
+            raise UnsupportedSyntax("Expected %s, got %r" % (text or kind, token))
+        return token[1]
+
+    def _Iri(self, iri):
+        # The token only holds \u and \U escapes, as TurtleWriter writes.
+        iri = Unescape(iri)
+        if ":" not in iri:
+            raise UnsupportedSyntax("Relative IRI %s" % iri)
+
+        return iri
+
+    def _PrefixedName(self, pname):
+        prefix, local = pname.split(":", 1)
+        namespace = self.namespaces.get(prefix)
+        if namespace is None:
+            raise UnsupportedSyntax("Unknown prefixed name %s" % pname)
+        return namespace + local
+
+    def _Resource(self, token):
+        """The IRI of a token, or None if it is not a resource."""
+        kind, text = token
+        if kind == "iri":
+            return self._Iri(text)
+        elif kind == "pname":
+            return self._PrefixedName(text)
+        return None
+
+    def _Object(self):
+        token = self._Next()
+        if token is None:
+            raise UnsupportedSyntax("Missing object")
+
+        kind, text = token
+        iri = self._Resource(token)
+        if iri is not None:
+            return rdfvalue.URN(iri)
+
+        if kind in ("string", "long_string", "single_string",
+                    "long_single_string"):
+            text = Unescape(text)
+            token = self._Next()
+            if token is not None and token[0] == "datatype":
+                datatype = self._Resource(self._Next() or ("", ""))
+                if datatype is None:
+                    raise UnsupportedSyntax("Bad datatype")
+                return self.literal(text, datatype)
+
+            # Language tags are dropped, as in the rdflib loader.
+            if token is None or token[0] != "at":
+                self._PushBack(token)
+            return self.literal(text)
+
+        if kind == "number":
+            if "e" in text or "E" in text:
+                return self.literal(text, XSD_NAMESPACE + "double")
+            elif "." in text:
+                return self.literal(text, XSD_NAMESPACE + "decimal")
+            return self.literal(text, XSD_NAMESPACE + "integer")
+
+        if kind == "word" and text in ("true", "false"):
+            return self.literal(text, XSD_NAMESPACE + "boolean")
+
+        raise UnsupportedSyntax("Unsupported object %r" % (token,))
+
+    def _Directive(self, name, dotted):
+        if name == "prefix":
+            prefix = self._Expect("pname")
+            if not prefix.endswith(":"):
+                raise UnsupportedSyntax("Bad prefix %s" % prefix)
+            self.namespaces[prefix[:-1]] = self._Iri(self._Expect("iri"))
+        else:
+            # Only absolute IRIs are read, so the base is not needed.
+            self._Iri(self._Expect("iri"))
+
+        if dotted:
+            self._Expect("punctuation", ".")
+
+    def __iter__(self):
+        while True:
+            token = self._Next()
+            if token is None:
+                return
+
+            kind, text = token
+            if kind == "at" and text in ("@prefix", "@base"):
+                self._Directive(text[1:], True)
+                continue
+            elif kind == "word" and text.lower() in ("prefix", "base"):
+                self._Directive(text.lower(), False)
+                continue
+
+            subject = self._Resource(token)
+            if subject is None:
+                raise UnsupportedSyntax("Unsupported subject %r" % (token,))
+
+            for triple in self._PredicateObjectList(subject):
+                yield triple
+
+    def _PredicateObjectList(self, subject):
+        while True:
+            token = self._Next()
+            if token == ("word", "a"):
+                predicate = RDF_TYPE
+            else:
+                predicate = self._Resource(token or ("", ""))
+                if predicate is None:
+                    raise UnsupportedSyntax("Unsupported predicate %r" % (token,))
+
+            while True:
+                yield subject, predicate, self._Object()
+
+                separator = self._Expect("punctuation")
+                if separator != ",":
+                    break
+
+            if separator == ".":
+                return
+
+            # Predicate lists may have repeated and trailing semicolons.
+            token = self._Next()
+            while token == ("punctuation", ";"):
+                token = self._Next()
+            if token == ("punctuation", "."):
+                return
+            self._PushBack(token)
+
+
+def _EscapeIri(match):
+    return "\\u%04X" % ord(match.group(0))
+
+
+def _EscapeString(match):
+    char = match.group(0)
+    return CHARACTER_ESCAPES.get(char) or "\\u%04X" % ord(char)
+
+
+class TurtleWriter(object):
+    """Writes subject blocks of Turtle to a stream, as UTF-8.
+
+    The prefix directives come first, then a blank line, then one block per
+    subject, as rdflib lays them out. Only a bounded amount of text is held
+    before it is written to the stream.
+    """
+
+    def __init__(self, stream, namespaces):
+        self.stream = stream
+        # (prefix, namespace), longest namespace first so the most specific
+        # prefix is used.
+        self.namespaces = sorted(namespaces.items(),
+                                 key=lambda x: (-len(x[1]), x[0]))
+        self.pending = []
+        self.pending_size = 0
+
+        self._Write("".join(
+            "@prefix %s: <%s> .\n" % (prefix, namespace)
+            for prefix, namespace in sorted(namespaces.items())) + "\n")
+
+    def _Write(self, text):
+        self.pending.append(text)
+        self.pending_size += len(text)
+        if self.pending_size >= WRITE_BUFFER_SIZE:
+            self.Flush()
+
+    def Flush(self):
+        if self.pending:
+            self.stream.write("".join(self.pending).encode("utf-8"))
+            self.pending = []
+            self.pending_size = 0
+
+    def Iri(self, iri):
+        """The Turtle term of an IRI, as a prefixed name if it has one."""
+        for prefix, namespace in self.namespaces:
+            if iri.startswith(namespace) and LOCAL_NAME.match(
+                    iri[len(namespace):]):
+                return "%s:%s" % (prefix, iri[len(namespace):])
+
+        return "<%s>" % IRI_SPECIAL.sub(_EscapeIri, iri)
+
+    def Term(self, value):
+        """The Turtle term of an RDFValue."""
+        if isinstance(value, rdfvalue.URN):
+            return self.Iri(value.value)
+
+        lexical = value.SerializeToString()
+        if isinstance(lexical, bytes):
+            lexical = lexical.decode("utf-8")
+
+        datatype = str(value.datatype)
+        if datatype == XSD_INTEGER and INTEGER.match(lexical):
+            return lexical
+
+        lexical = '"%s"' % STRING_SPECIAL.sub(_EscapeString, lexical)
+        if not datatype:
+            return lexical
+        return "%s^^%s" % (lexical, self.Iri(datatype))
+
+    def WriteSubject(self, subject, items):
+        """Writes the block of a subject.
+
+        items are (predicate, [values]) of the subject, as strings and
+        RDFValues. Types are written first, as "a".
+        """
+        lines = []
+        for predicate, values in sorted(items, key=lambda x: x[0] != RDF_TYPE):
+            if predicate == RDF_TYPE:
+                verb = "a"
+            else:
+                verb = self.Iri(predicate)
+
+            lines.append("%s %s" % (verb, ",\n        ".join(
+                self.Term(x) for x in values)))
+
+        if lines:
+            self._Write("%s %s .\n\n" % (
+                self.Iri(subject), " ;\n    ".join(lines)))
+
+
+class BlockIndex(object):
+    """The subject blocks of a Turtle document laid out as the writer does.
+
+    Each statement starts at the start of a line and continues on indented
+    lines, so statements are found without parsing them. The directives must
+    all come before the first statement. Documents laid out otherwise, or with
+    long strings (which may hold lines that look like statements), raise
+    UnsupportedSyntax.
+
+    subjects holds the subject IRI of each block, and Block() the text of a
+    block as a document of its own.
+    """
+
+    def __init__(self, data):
+        if b'"""' in data or b"'''" in data:
+            raise UnsupportedSyntax("Long string")
+
+        self.data = data
+        self.header = None
+        self.namespaces = {}
+        self.starts = array.array("Q")
+        self.subjects = []
+        for match in BLOCK_START.finditer(data):
+            iri, pname, other = match.groups()
+            if other is not None:
+                # Comments belong to the block they are in, and directives are
+                # read with the header.
+                if other == b"#" or self.header is None:
+                    continue
+                raise UnsupportedSyntax(
+                    "Unexpected %r" % data[match.start():match.start() + 20])
+
+            if self.header is None:
+                self._ReadHeader(data[:match.start()])
+
+            if iri is not None:
+                subject = iri.decode("utf-8")
+                if "\\" in subject:
+                    subject = Unescape(subject)
+            else:
+                prefix, local = pname.decode("utf-8").split(":", 1)
+                namespace = self.namespaces.get(prefix)
+                if namespace is None:
+                    raise UnsupportedSyntax("Unknown prefixed name %s" % pname)
+                subject = namespace + local
+
+            self.starts.append(match.start())
+            self.subjects.append(subject)
+
+        if self.header is None:
+            self._ReadHeader(data)
+        self.starts.append(len(data))
+
+        # Escaped IRIs may not be found by Mentions().
+        self.escaped = b"\\u" in data or b"\\U" in data
+
+    def _ReadHeader(self, header):
+        reader = TurtleReader(io.BytesIO(header))
+        for _ in reader:
+            raise UnsupportedSyntax("Statement among the directives")
+        self.header = header
+        self.namespaces = reader.namespaces
+
+    def __len__(self):
+        return len(self.subjects)
+
+    def Block(self, block):
+        """The text of a block, after the directives."""
+        return self.header + self.data[self.starts[block]:self.starts[block + 1]]
+
+    def _Patterns(self, iri):
+        """Patterns matching the terms an IRI may be written as, and whether
+        each must not follow a name character.
+
+        Each starts with the term, so the regex engine searches for it as a
+        literal.
+        """
+        result = [(re.compile(re.escape(("<%s>" % IRI_SPECIAL.sub(
+            _EscapeIri, iri)).encode("utf-8"))), False)]
+        for prefix, namespace in self.namespaces.items():
+            if iri.startswith(namespace):
+                pname = "%s:%s" % (prefix, iri[len(namespace):])
+                result.append((re.compile(re.escape(pname.encode("utf-8")) +
+                                          br"(?![\w\-:%]|\.[\w\-:%])"), True))
+        if iri == RDF_TYPE:
+            result.append((re.compile(br"\sa\s"), False))
+        return result
+
+    def Mentions(self, iri):
+        """The blocks which may mention an IRI, in order.
+
+        These are the blocks which hold any term the IRI may be written as,
+        so a few may not mention it at all.
+        """
+        if self.escaped and IRI_SPECIAL.search(iri):
+            return range(len(self.subjects))
+
+        data = self.data
+        blocks = set()
+        for pattern, name in self._Patterns(iri):
+            for match in pattern.finditer(data, self.starts[0]):
+                start = match.start()
+                if name and start and NAME_CHARACTER.match(data, start - 1):
+                    continue
+                blocks.add(bisect.bisect_right(self.starts, start) - 1)
+        return sorted(blocks)
+
+
+def Split(data, size):
+    """Splits a Turtle document into pieces of about size bytes, each of which
+    reads as a document of its own.
+
+    Pieces are cut before a statement which starts a line, and each starts
+    with the directives of the document. Documents with long strings, blank
+    node labels (which are local to a document) or directives after the first
+    statement are returned whole.
+    """
+    header, ranges = SplitRanges(io.BytesIO(data), size)
+    return [data[start:end] if not start else data[:header] + data[start:end]
+            for start, end in ranges]
+
+
+def SplitRanges(stream, size, block_size=BLOCK_SIZE):
+    """Splits a Turtle document as Split() does, reading it a block at a time.
+
+    Returns the length of the header (the directives before the first
+    statement) and the (start, end) offsets of the pieces. A piece after the
+    first reads as a document of its own once the header is put before it.
+    """
+    header = None
+    whole = False
+    ranges = []
+    cut = 0
+    # The last non space byte before the current line.
+    last = b""
+    offset = 0
+    data = b""
+    while True:
+        block = stream.read(block_size)
+        data += block
+
+        # Only whole lines are looked at, until the end.
+        end = data.rfind(b"\n") + 1 if block else len(data)
+        position = 0
+        while not whole and position < end:
+            line_end = data.find(b"\n", position, end) + 1 or end
+            line = data[position:line_end]
+            line_offset = offset + position
+            position = line_end
+
+            if b'"""' in line or b"'''" in line or b"_:" in line:
+                whole = True
+            elif header is not None:
+                if DIRECTIVE.match(line.lstrip(b" \t")):
+                    whole = True
+                elif (line_offset >= cut + size and last == b"." and
+                      LINE_START.match(line)):
+                    ranges.append((cut, line_offset))
+                    cut = line_offset
+            elif LINE_START.match(line) and not DIRECTIVE.match(line):
+                header = line_offset
+
+            stripped = line.rstrip()
+            if stripped:
+                last = stripped[-1:]
+
+        offset += end
+        data = data[end:]
+        if not block:
+            break
+
+    if whole or header is None or offset <= size:
+        return 0, [(0, offset)]
+
+    ranges.append((cut, offset))
+    return header, ranges
+
 
 def toDirectivesAndTripes(text):
     directives = []
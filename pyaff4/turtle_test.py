@@ -0,0 +1,217 @@
+from __future__ import unicode_literals
+# Copyright 2019 Schatz Forensic Pty Ltd. All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License"); you may not
+# use this file except in compliance with the License.  You may obtain a copy of
+# the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+# WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  See the
+# License for the specific language governing permissions and limitations under
+# the License.
+
+import io
+import unittest
+
+from pyaff4 import data_store
+from pyaff4 import lexicon
+from pyaff4 import rdfvalue
+from pyaff4 import turtle
+
+TURTLE = """@prefix :      <aff4://volume> .
+@prefix aff4:  <http://aff4.org/Schema#> .
+@prefix xsd:   <http://www.w3.org/2001/XMLSchema#> .
+
+# A comment.
+<aff4://volume/image>
+        a                 aff4:ImageStream , aff4:Image ;
+        aff4:chunkSize    "32768"^^xsd:int ;
+        aff4:hash         "d5825dc1152a42958c8219ff11ed01a3"^^aff4:MD5 ;
+        aff4:size         8688 ;
+        aff4:stored       : ;
+        aff4:notes        "say \\"hi\\"\\n"@en, '''two
+lines''' ;
+        aff4:target       <aff4://volume/map[0x10:0x20]> ; .
+"""
+
+
+class TurtleTest(unittest.TestCase):
+    def Read(self, data, block_size=turtle.BLOCK_SIZE):
+        reader = turtle.TurtleReader(io.BytesIO(data.encode("utf-8")),
+                                     block_size)
+        return [(s, p, type(v), v.SerializeToString()) for s, p, v in reader]
+
+    def testRead(self):
+        triples = self.Read(TURTLE)
+        image = "aff4://volume/image"
+        self.assertEqual(triples, [
+            (image, lexicon.AFF4_TYPE, rdfvalue.URN, lexicon.AFF4_IMAGE_TYPE),
+            (image, lexicon.AFF4_TYPE, rdfvalue.URN,
+             lexicon.AFF4_NAMESPACE + "Image"),
+            (image, lexicon.AFF4_IMAGE_CHUNK_SIZE, rdfvalue.XSDInteger, b"32768"),
+            (image, lexicon.standard.hash, rdfvalue.MD5Hash,
+             b"d5825dc1152a42958c8219ff11ed01a3"),
+            (image, lexicon.AFF4_STREAM_SIZE, rdfvalue.XSDInteger, b"8688"),
+            (image, lexicon.AFF4_STORED, rdfvalue.URN, "aff4://volume"),
+            (image, lexicon.AFF4_NAMESPACE + "notes", rdfvalue.XSDString,
+             b'say "hi"\n'),
+            (image, lexicon.AFF4_NAMESPACE + "notes", rdfvalue.XSDString,
+             b"two\nlines"),
+            (image, lexicon.AFF4_NAMESPACE + "target", rdfvalue.URN,
+             "aff4://volume/map[0x10:0x20]")])
+
+        # Tokens split across blocks are read whole.
+        for block_size in (1, 2, 3, 7):
+            self.assertEqual(self.Read(TURTLE, block_size), triples)
+
+    def testUnsupported(self):
+        for data in ["<aff4://a> <aff4://b> [ <aff4://c> 1 ] .",
+                     "<aff4://a> <aff4://b> _:node .",
+                     "<a> <aff4://b> 1 .",
+                     "<aff4://a> unknown:b 1 .",
+                     "@prefix x: <aff4://> . x:c\\-d <aff4://b> 1 .",
+                     "<aff4://a\\n> <aff4://b> 1 ."]:
+            with self.assertRaises(turtle.UnsupportedSyntax):
+                self.Read(data)
+
+    def testWrite(self):
+        image = "aff4://volume/a file\\.txt"
+        items = [
+            (lexicon.AFF4_STREAM_SIZE, [rdfvalue.XSDInteger(8688)]),
+            (lexicon.AFF4_TYPE, [rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE),
+                                 rdfvalue.URN("aff4://other/type")]),
+            (lexicon.standard.hash, [
+                rdfvalue.MD5Hash("d5825dc1152a42958c8219ff11ed01a3")]),
+            (lexicon.AFF4_NAMESPACE + "notes", [
+                rdfvalue.XSDString('say "hi"\n\\ é\x01')]),
+            (lexicon.AFF4_NAMESPACE + "target", [
+                rdfvalue.URN("aff4://volume/map[0x10:0x20]")])]
+
+        stream = io.BytesIO()
+        writer = turtle.TurtleWriter(stream, {
+            "aff4": lexicon.AFF4_NAMESPACE, "xsd": lexicon.XSD_NAMESPACE})
+        writer.WriteSubject(image, items)
+        writer.Flush()
+        data = stream.getvalue()
+        self.assertTrue(data.startswith(
+            b"@prefix aff4: <http://aff4.org/Schema#> .\n"
+            b"@prefix xsd: <http://www.w3.org/2001/XMLSchema#> .\n\n"
+            b"<aff4://volume/a\\u0020file\\u005C.txt> a aff4:ImageStream,\n"))
+
+        expected = set((image, p, type(v), v.SerializeToString())
+                       for p, values in items for v in values)
+
+        # The output reads back the same, both with rdflib and without.
+        volume_urn = rdfvalue.URN("aff4://volume")
+        resolver = data_store.MemoryDataStore()
+        resolver._LoadFromTurtleWithRdflib(io.BytesIO(data), volume_urn)
+        self.assertEqual(
+            set((image, p, type(v), v.SerializeToString())
+                for p, values in resolver.QueryPredicatesBySubject(volume_urn, image)
+                for v in (values if isinstance(values, list) else [values])),
+            expected)
+        self.assertEqual(set(self.Read(data.decode("utf-8"))), expected)
+        for block_size in (1, 7):
+            self.assertEqual(set(self.Read(data.decode("utf-8"), block_size)),
+                             expected)
+
+        stream = io.BytesIO()
+        writer = turtle.TurtleWriter(stream, {"aff4": lexicon.AFF4_NAMESPACE})
+        writer.WriteSubject("aff4://volume/image", items)
+        writer.Flush()
+        self.assertEqual(
+            set(self.Read(stream.getvalue().decode("utf-8"))),
+            set(("aff4://volume/image",) + x[1:] for x in expected))
+
+    def testBlockIndex(self):
+        stream = io.BytesIO()
+        writer = turtle.TurtleWriter(stream, {"aff4": lexicon.AFF4_NAMESPACE})
+        for i in range(3):
+            writer.WriteSubject("aff4://volume/image%d" % i, [
+                (lexicon.AFF4_TYPE, [rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE)]),
+                (lexicon.AFF4_STREAM_SIZE, [rdfvalue.XSDInteger(i)])])
+        writer.WriteSubject("aff4://volume/map", [
+            (lexicon.AFF4_TYPE, [rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE + "Index")]),
+            (lexicon.AFF4_NAMESPACE + "target", [
+                rdfvalue.URN("aff4://volume/image1")])])
+        writer.Flush()
+
+        index = turtle.BlockIndex(stream.getvalue() + b"# The end.\n")
+        self.assertEqual(index.subjects, ["aff4://volume/image0", "aff4://volume/image1",
+                                          "aff4://volume/image2", "aff4://volume/map"])
+
+        # Each block reads as a document of its own.
+        self.assertEqual(
+            self.Read(index.Block(1).decode("utf-8")),
+            [("aff4://volume/image1", lexicon.AFF4_TYPE, rdfvalue.URN,
+              lexicon.AFF4_IMAGE_TYPE),
+             ("aff4://volume/image1", lexicon.AFF4_STREAM_SIZE,
+              rdfvalue.XSDInteger, b"1")])
+
+        self.assertEqual(index.Mentions(lexicon.AFF4_IMAGE_TYPE), [0, 1, 2])
+        self.assertEqual(index.Mentions("aff4://volume/image1"), [1, 3])
+        self.assertEqual(index.Mentions(lexicon.AFF4_TYPE), [0, 1, 2, 3])
+        self.assertEqual(index.Mentions(lexicon.AFF4_NAMESPACE + "target"), [3])
+
+        for data in [b'<aff4://a> <aff4://b> """x\n<aff4://c> y""" .',
+                     b"[ <aff4://b> 1 ] <aff4://b> 1 .",
+                     b"<aff4://a> <aff4://b> 1 .\n@prefix x: <aff4://> .",
+                     b"x:a <aff4://b> 1 ."]:
+            self.assertRaises(turtle.UnsupportedSyntax, turtle.BlockIndex, data)
+
+    def testSplit(self):
+        stream = io.BytesIO()
+        writer = turtle.TurtleWriter(stream, {"aff4": lexicon.AFF4_NAMESPACE})
+        for i in range(20):
+            writer.WriteSubject("aff4://volume/image%d" % i, [
+                (lexicon.AFF4_TYPE, [rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE)]),
+                (lexicon.AFF4_STREAM_SIZE, [rdfvalue.XSDInteger(i)])])
+        writer.Flush()
+        data = stream.getvalue()
+        triples = self.Read(data.decode("utf-8"))
+
+        # Each piece reads as a document of its own, and together they read
+        # as the whole.
+        pieces = turtle.Split(data, 200)
+        self.assertGreater(len(pieces), 5)
+        self.assertEqual(
+            sum((self.Read(x.decode("utf-8")) for x in pieces), []), triples)
+        self.assertEqual(turtle.Split(data, len(data)), [data])
+
+        # The document is read a block at a time.
+        header, ranges = turtle.SplitRanges(io.BytesIO(data), 200)
+        self.assertEqual(
+            [data[x:y] if not i else data[:header] + data[x:y]
+             for i, (x, y) in enumerate(ranges)], pieces)
+        for block_size in (1, 7, 64):
+            self.assertEqual(turtle.SplitRanges(io.BytesIO(data), 200, block_size),
+                             (header, ranges))
+
+        for data in [TURTLE.encode("utf-8"),
+                     b"<aff4://a> <aff4://b> _:x .\n<aff4://c> <aff4://b> _:x .",
+                     b"<aff4://a> <aff4://b> 1 .\n@prefix x: <aff4://> .\n"]:
+            self.assertEqual(turtle.Split(data, 1), [data])
+
+        # Statements are only cut where the one before ends.
+        data = b"<aff4://a> <aff4://b>\n<aff4://c> .\n<aff4://d> <aff4://b> 1 .\n"
+        self.assertEqual(turtle.Split(data, 1), [
+            b"<aff4://a> <aff4://b>\n<aff4://c> .\n",
+            b"<aff4://d> <aff4://b> 1 .\n"])
+
+    def testFallback(self):
+        # The resolver falls back to rdflib for syntax the reader does not
+        # handle.
+        volume_urn = rdfvalue.URN("aff4://volume")
+        resolver = data_store.MemoryDataStore()
+        resolver.LoadFromTurtle(io.BytesIO(
+            b"@prefix x: <aff4://> . <aff4://a> <aff4://b> 1 . x:c\\-d <aff4://b> 2 ."),
+            volume_urn)
+        self.assertEqual(resolver.GetUnique(volume_urn, "aff4://a", "aff4://b"), 1)
+        self.assertEqual(resolver.GetUnique(volume_urn, "aff4://c-d", "aff4://b"), 2)
+
+
+if __name__ == '__main__':
+    unittest.main()
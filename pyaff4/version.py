@@ -8,6 +8,12 @@ class Version(object):
     def create(dic):
         return Version(int(dic["major"]),int(dic["minor"]),dic["tool"])
 
+    @staticmethod
+    def parse(text):
+        """Parse the version.txt format produced by str()."""
+        return Version.create(dict(
+            line.split("=", 1) for line in text.splitlines() if "=" in line))
+
     def is10(self):
         if self.major == 1 and self.minor == 0:
             return True
@@ -23,7 +23,9 @@ import copy
 import logging
 import io
 import zlib
+import bisect
 import struct
+import time
 import traceback
 
 from pyaff4 import aff4
@@ -46,6 +48,9 @@ ZIP32_MAX_SIZE = 2**32 -1
 
 BUFF_SIZE = 64 * 1024
 
+# Read size used when scanning for local file headers during recovery.
+SCAN_BUFF_SIZE = 4 * 1024 * 1024
+
 # Flag for debugging zip (uses pre Zip64 so we can open using more Zip tools. Should be false for production.
 ZIP_DEBUG = False
 
@@ -58,6 +63,99 @@ class UnknownZipEntity(Exception):
     pass
 
 
+# Reflected CRC32 polynomial, as used by zlib and the zip format.
+CRC32_POLYNOMIAL = 0xedb88320
+
+
+def _crc32_multmodp(a, b):
+    """Multiply a and b modulo the CRC32 polynomial (reflected bit order)."""
+    m = 1 << 31
+    p = 0
+    while True:
+        if a & m:
+            p ^= b
+            if (a & (m - 1)) == 0:
+                break
+        m >>= 1
+        if b & 1:
+            b = (b >> 1) ^ CRC32_POLYNOMIAL
+        else:
+            b >>= 1
+    return p
+
+
+def _crc32_x2n_table():
+    # x^(2^n) modulo the polynomial, for n in range(32).
+    table = []
+    p = 1 << 30
+    for _ in range(32):
+        table.append(p)
+        p = _crc32_multmodp(p, p)
+    return table
+
+CRC32_X2N_TABLE = _crc32_x2n_table()
+
+# Shift operators (x^(8 * length) modulo the polynomial) keyed by block length.
+# Blocks are usually of a handful of distinct sizes (chunk or bevy size) so
+# this stays small.
+_CRC32_SHIFT_CACHE = {}
+
+
+def _crc32_shift_operator(length):
+    result = _CRC32_SHIFT_CACHE.get(length)
+    if result is None:
+        result = 1 << 31
+        n = length
+        k = 3
+        while n:
+            if n & 1:
+                result = _crc32_multmodp(CRC32_X2N_TABLE[k & 31], result)
+            n >>= 1
+            k += 1
+
+        if len(_CRC32_SHIFT_CACHE) < 1024:
+            _CRC32_SHIFT_CACHE[length] = result
+
+    return result
+
+
+def crc32_combine(crc1, crc2, len2):
+    """Combine the CRC32 of two adjacent blocks of data.
+
+    Given crc1 = crc32(A), crc2 = crc32(B) and len2 = len(B), returns
+    crc32(A + B) without touching the data again. This lets blocks be
+    checksummed independently (e.g. on the worker which produced them) and
+    folded together afterwards. Equivalent to zlib's crc32_combine().
+    """
+    if len2 <= 0:
+        return crc1
+
+    return (_crc32_multmodp(_crc32_shift_operator(len2), crc1) ^ crc2) & 0xffffffff
+
+
+class CRC32Folder(object):
+    """Accumulates the CRC32 of a member from a sequence of blocks.
+
+    Blocks may either be given as data (checksummed here with zlib.crc32) or
+    as (crc32, length) pairs which were computed elsewhere. Chaining zlib.crc32
+    through the data is far cheaper than folding, so AddBlock() is only for
+    blocks checksummed concurrently.
+    """
+
+    def __init__(self):
+        self.crc32 = 0
+        self.length = 0
+
+    def Update(self, data):
+        # Python 2 erronously returns a signed int here.
+        self.crc32 = zlib.crc32(data, self.crc32) & 0xffffffff
+        self.length += len(data)
+
+    def AddBlock(self, crc32, length):
+        self.crc32 = crc32_combine(self.crc32, crc32 & 0xffffffff, length)
+        self.length += length
+
+
 class EndCentralDirectory(struct_parser.CreateStruct(
         "EndCentralDirectory_t",
         definition="""
@@ -138,6 +236,8 @@ class ZipFileHeader(struct_parser.CreateStruct(
         uint16_t extra_field_len = 0;
         """)):
 
+    magic_string = b'PK\x03\x04'
+
     def IsValid(self):
         return self.magic == 0x4034b50
 
@@ -274,6 +374,80 @@ class Zip64CDLocator(struct_parser.CreateStruct(
                 self.number_of_disks == 1)
 
 
+# Not part of the zip format. Zip readers only look at the central
+# directory, so they never see these.
+class CheckpointRecord(struct_parser.CreateStruct(
+        "CheckpointRecord_t",
+        """
+        uint64_t magic = 0x54504b4334464641;
+        uint64_t previous = 0xFFFFFFFFFFFFFFFF;
+        uint32_t number_of_entries;
+        uint32_t number_of_removed;
+        uint32_t urn_length;
+        uint64_t length;
+        uint32_t crc32;
+        """)):
+    """What changed in a volume since its last central directory or checkpoint.
+
+    previous is the offset of the end of that (or all ones for the first
+    checkpoint of a new volume). The record is followed by length bytes:
+    number_of_entries central directory entries of new or changed members, the
+    names of
+    number_of_removed removed members (each preceded by its uint16_t length),
+    the volume URN and the turtle of the subjects which changed.
+    """
+    magic_string = b"AFF4CKPT"
+    NO_PREVIOUS = 0xFFFFFFFFFFFFFFFF
+
+    def IsValid(self):
+        return self.magic == 0x54504b4334464641
+
+
+class FreeSpaceMarker(struct_parser.CreateStruct(
+        "FreeSpaceMarker_t",
+        """
+        uint64_t magic = 0x4545524634464641;
+        uint64_t length;
+        """)):
+    """Starts the unused part of free space which a member was written into.
+
+    This is what lets _WalkCheckpoints() step over it.
+    """
+    magic_string = b"AFF4FREE"
+
+    def IsValid(self):
+        return self.magic == 0x4545524634464641
+
+
+class CheckpointState(object):
+    """The state of a volume at a central directory or checkpoint record."""
+
+    def __init__(self, urn_string, zip_infos, extent=None):
+        self.urn_string = urn_string
+        self.zip_infos = dict((x.filename, x) for x in zip_infos)
+
+        # The turtle of each checkpoint record since the central directory.
+        self.turtle = []
+
+        # The [start, end) of the central directory and checkpoint records.
+        self.extents = []
+        self.end = None
+        if extent is not None:
+            self.extents.append(extent)
+            self.end = extent[1]
+
+    def Apply(self, zip_infos, removed, urn_string, turtle, extent):
+        for zip_info in zip_infos:
+            self.zip_infos[zip_info.filename] = zip_info
+        for name in removed:
+            self.zip_infos.pop(name, None)
+
+        self.urn_string = urn_string
+        self.turtle.append(turtle)
+        self.extents.append(extent)
+        self.end = extent[1]
+
+
 class ZipInfo(object):
     def __init__(self, compression_method=0, compress_size=0,
                  file_size=0, filename="", local_header_offset=0,
@@ -289,10 +463,28 @@ class ZipInfo(object):
 
         self.file_header_offset = None
 
+        # Offset of the member data, only known for recovered members.
+        self.data_offset = None
+
     def WriteFileHeader(self, backing_store):
         if self.file_header_offset is None:
             self.file_header_offset = backing_store.TellWrite()
 
+        header, encodedFilename, extra_header_64 = self._FileHeader()
+
+        backing_store.SeekWrite(self.file_header_offset)
+        backing_store.Write(header.Pack())
+        backing_store.write(encodedFilename)
+
+        if not extra_header_64.empty():
+            backing_store.Write(extra_header_64.Pack())
+
+    def FileHeaderLength(self):
+        """The length of the local file header for the current sizes."""
+        header, encodedFilename, extra_header_64 = self._FileHeader()
+        return header.sizeof() + len(encodedFilename) + header.extra_field_len
+
+    def _FileHeader(self):
         encodedFilename = self.filename
         if USE_UNICODE:
             encodedFilename = self.filename.encode("utf-8")
@@ -323,12 +515,7 @@ class ZipInfo(object):
         if not extra_header_64.empty():
             header.extra_field_len = extra_header_64.sizeof()
 
-        backing_store.SeekWrite(self.file_header_offset)
-        backing_store.Write(header.Pack())
-        backing_store.write(encodedFilename)
-
-        if not extra_header_64.empty():
-            backing_store.Write(extra_header_64.Pack())
+        return header, encodedFilename, extra_header_64
 
     def WriteCDFileHeader(self, backing_store):
         encodedFilename = self.filename
@@ -429,6 +616,22 @@ def DecompressBuffer(buffer):
 class ZipFileSegment(aff4_file.FileBackedObject):
     compression_method = ZIP_STORED
 
+    # CRC32 of the segment content when it is already known (e.g. computed
+    # by the producer of the data). None means it is computed while storing.
+    checksum = None
+
+    def SetChecksum(self, crc32):
+        """Set the CRC32 of the whole content, as computed by the writer.
+
+        Must be called after the last Write() - any further write invalidates
+        it.
+        """
+        self.checksum = crc32 & 0xffffffff
+
+    def Write(self, data):
+        self.checksum = None
+        return super(ZipFileSegment, self).Write(data)
+
     def setCompressionMethod(self, method):
         if method in [ZIP_STORED, lexicon.AFF4_IMAGE_COMPRESSION_STORED]:
             self.compression_method = ZIP_STORED
@@ -510,12 +713,12 @@ class ZipFileSegment(aff4_file.FileBackedObject):
                 LOGGER.info("Unsupported compression method.")
                 raise NotImplementedError()
 
-    def WriteStream(self, stream, progress=None):
+    def WriteStream(self, stream, progress=None, crc32=None):
         owner_urn = self.resolver.GetUnique(lexicon.transient_graph, self.urn, lexicon.AFF4_STORED)
         with self.resolver.AFF4FactoryOpen(owner_urn) as owner:
             owner.StreamAddMember(
                 self.urn, stream, compression_method=self.compression_method,
-                progress=progress)
+                progress=progress, crc32=crc32)
 
     def FlushAndClose(self):
         self.Flush()
@@ -529,9 +732,20 @@ class ZipFileSegment(aff4_file.FileBackedObject):
                     # only copy into the owner if we dont already exist there
                     self.SeekRead(0)
 
+                    checksum = self.checksum
+                    size = None
+                    if isinstance(self.fd, io.BytesIO):
+                        size = self.Size()
+                        if checksum is None and self.compression_method == ZIP_STORED:
+                            # Checksum the buffer in a single pass rather than
+                            # per 64k buffer while copying it out.
+                            with self.fd.getbuffer() as view:
+                                checksum = zlib.crc32(view) & 0xffffffff
+
                     # Copy ourselves into the owner.
                     owner.StreamAddMember(
-                        self.urn, self, self.compression_method)
+                        self.urn, self, self.compression_method,
+                        crc32=checksum, size=size)
 
         super(ZipFileSegment, self).Flush()
 
@@ -558,16 +772,61 @@ class ZipFileSegment(aff4_file.FileBackedObject):
 
 
 class BasicZipFile(aff4.AFF4Volume):
+    # When set, a checkpoint record is appended after this many bytes of
+    # member data or seconds, whichever comes first. See
+    # SetCheckpointInterval().
+    checkpoint_bytes = None
+    checkpoint_seconds = None
+
     def __init__(self,  *args, **kwargs):
         super(BasicZipFile, self).__init__( *args, **kwargs)
         self.children = set()
         # The members of this zip file. Keys is member URN, value is zip info.
         self.members = {}
         self.global_offset = 0
-        try:
-            self.version = kwargs["version"]
-        except:
-            self.version = Version(0,0, "pyaff4")
+        self.version = kwargs.get("version")
+        if self.version is None:
+            # A volume reopened after it was evicted from the object cache.
+            recorded = self.resolver.GetUnique(lexicon.transient_graph,
+                self.urn, lexicon.AFF4_VOLUME_VERSION)
+            if recorded:
+                self.version = Version.parse(str(recorded))
+            else:
+                self.version = Version(0,0, "pyaff4")
+
+        # The (zip_info, serialized CD entry) of each member in the last
+        # central directory on disk, keyed by member URN, so checkpoints only
+        # serialize the members added since the last one. The entry is None
+        # until it is serialized.
+        self._cd_entries = {}
+
+        # Sorted [start, end) extents of the backing store which no central
+        # directory we have written references, so new members of a suitable
+        # size can reuse them.
+        self.free_extents = []
+
+        # Extents of removed members. The last central directory (or
+        # checkpoint) still references them, so they only become free once
+        # another is written.
+        self.pending_extents = []
+
+        # The [start, end) of the last central directory read or written and
+        # the checkpoint records written since, which readers need if we die.
+        self._directory_extents = []
+
+        # Free extents may hold anything until they are marked (see
+        # FreeSpaceMarker), which only matters once we write checkpoints.
+        self._unmarked_free_space = False
+
+        # The turtle of the checkpoint records the volume was read from, if it
+        # was not closed. See MemoryDataStore.loadMetadata().
+        self.checkpoint_turtle = []
+
+        # The store version the last checkpoint's turtle matches.
+        self._checkpoint_version = None
+        self._checkpoints_suspended = False
+        self._bytes_since_checkpoint = 0
+        self._last_checkpoint = time.time()
 
     def parse_cd(self, backing_store_urn):
         with self.resolver.AFF4FactoryOpen(backing_store_urn) as backing_store:
@@ -579,11 +838,24 @@ class BasicZipFile(aff4.AFF4Volume):
             ecd_real_offset = backing_store.TellRead()
             buffer = backing_store.Read(BUFF_SIZE)
 
-            end_cd, buffer_offset = EndCentralDirectory.FromBuffer(buffer)
+            try:
+                end_cd, buffer_offset = EndCentralDirectory.FromBuffer(buffer)
+                ecd_real_offset += buffer_offset
+                end_of_cd = ecd_real_offset + end_cd.sizeof() + end_cd.comment_len
+            except IOError:
+                end_cd = None
+                end_of_cd = 0
+
+            # The volume may not have been closed - use the last checkpoint
+            # if there is one after the central directory.
+            if (end_of_cd < backing_store.Size() and
+                    self._LoadCheckpoint(backing_store_urn, backing_store, end_of_cd)):
+                return
 
-            urn_string = None
+            if end_cd is None:
+                raise IOError("Unable to find EndCentralDirectory")
 
-            ecd_real_offset += buffer_offset
+            urn_string = None
 
             # Fetch the volume comment.
             if end_cd.comment_len > 0:
@@ -606,23 +878,7 @@ class BasicZipFile(aff4.AFF4Volume):
 
 
 
-            # There is a catch 22 here - before we parse the ZipFile we dont
-            # know the Volume's URN, but we need to know the URN so the
-            # AFF4FactoryOpen() can open it. Therefore we start with a random
-            # URN and then create a new ZipFile volume. After parsing the
-            # central directory we discover our URN and therefore we can delete
-            # the old, randomly selected URN.
-            if urn_string and self.urn != urn_string and self.version != basic_zip :
-                self.resolver.DeleteSubject(self.urn)
-                self.urn.Set(utils.SmartUnicode(urn_string))
-
-                # Set these triples so we know how to open the zip file again.
-                self.resolver.Set(self.urn, self.urn, lexicon.AFF4_TYPE, rdfvalue.URN(
-                    lexicon.AFF4_ZIP_TYPE))
-                self.resolver.Set(lexicon.transient_graph, self.urn, lexicon.AFF4_STORED, rdfvalue.URN(
-                    backing_store_urn))
-                self.resolver.Set(lexicon.transient_graph, backing_store_urn, lexicon.AFF4_CONTAINS,
-                                  self.urn)
+            self._SetVolumeURN(urn_string, backing_store_urn)
 
             directory_offset = end_cd.offset_of_cd
             directory_number_of_entries = end_cd.total_entries_in_cd
@@ -685,84 +941,532 @@ class BasicZipFile(aff4.AFF4Volume):
                     LOGGER.info("Global offset: %#x", self.global_offset)
 
             # Now iterate over the directory and read all the ZipInfo structs.
-            entry_offset = directory_offset
+            backing_store.SeekRead(directory_offset + self.global_offset, 0)
+            directory = backing_store.Read(end_cd.size_of_cd)
+            entry_offset = 0
             for _ in range(directory_number_of_entries):
-                backing_store.SeekRead(entry_offset + self.global_offset, 0)
-                entry = CDFileHeader(
-                    backing_store.Read(CDFileHeader.sizeof()))
-
-                if not entry.IsValid():
+                result = self._ParseCDEntry(directory, entry_offset)
+                if result is None:
                     if LOGGER.isEnabledFor(logging.INFO):
-                        LOGGER.info("CDFileHeader at offset %#x invalid", entry_offset)
+                        LOGGER.info("CDFileHeader at offset %#x invalid",
+                                    directory_offset + entry_offset)
                     raise RuntimeError()
 
-                fn = backing_store.Read(entry.file_name_length)
+                zip_info, entry_offset = result
+                if LOGGER.isEnabledFor(logging.INFO):
+                    LOGGER.info("Found file %s @ %#x", zip_info.filename,
+                            zip_info.local_header_offset)
 
-                # decode the filename to UTF-8 if the EFS bit (bit 11) is set
-                if entry.flags | (1 << 11):
-                    fn = fn.decode("utf-8")
-
-                zip_info = ZipInfo(
-                    filename=fn,
-                    local_header_offset=entry.relative_offset_local_header,
-                    compression_method=entry.compression_method,
-                    compress_size=entry.compress_size,
-                    file_size=entry.file_size,
-                    crc32=entry.crc32,
-                    lastmoddate=entry.dosdate,
-                    lastmodtime=entry.dostime)
-
-                # Zip64 local header - parse the Zip64 extended information extra field.
-                # if zip_info.local_header_offset < 0 or zip_info.local_header_offset == 0xffffffff:
-                if entry.extra_field_len > 0:
-                    extrabuf = backing_store.Read(entry.extra_field_len)
-
-                    # AFF4 requres Zip64, but we still want to be able to read 3rd party
-                    # zip files, so just skip unknown Extensible data fields and find the Zip64
-
-                    while len(extrabuf) > 0:
-                        (headerID, dataSize) = struct.unpack("<HH", extrabuf[0:4])
-                        if headerID == 1:
-                            # Zip64 extended information extra field
-                            extra, readbytes = Zip64FileHeaderExtensibleField.FromBuffer(
-                                entry, extrabuf)
-                            extrabuf = extrabuf[readbytes:]
-
-                            if extra.header_id == 1:
-                                if extra.Get("relative_offset_local_header") is not None:
-                                    zip_info.local_header_offset = (
-                                        extra.Get("relative_offset_local_header"))
-                                if extra.Get("file_size") is not None:
-                                    zip_info.file_size = extra.Get("file_size")
-                                if extra.Get("compress_size") is not None:
-                                    zip_info.compress_size = extra.Get("compress_size")
-                        else:
-                            extrabuf = extrabuf[dataSize + 4:]
+                self._RegisterMember(zip_info)
+                self._cd_entries[escaping.urn_from_member_name(
+                    zip_info.filename, self.urn, self.version)] = (zip_info, None)
+
+            self._directory_extents = [
+                [directory_offset + self.global_offset, end_of_cd]]
+            if (self.properties.writable and
+                    self._CanReuseExtents(backing_store_urn)):
+                self._RebuildFreeExtents(backing_store)
+
+    def _SetVolumeURN(self, urn_string, backing_store_urn):
+        # There is a catch 22 here - before we parse the ZipFile we dont
+        # know the Volume's URN, but we need to know the URN so the
+        # AFF4FactoryOpen() can open it. Therefore we start with a random
+        # URN and then create a new ZipFile volume. After parsing the
+        # central directory we discover our URN and therefore we can delete
+        # the old, randomly selected URN.
+        if urn_string and self.urn != urn_string and self.version != basic_zip :
+            self.resolver.DeleteSubject(self.urn)
+            self.urn.Set(utils.SmartUnicode(urn_string))
+
+            # Set these triples so we know how to open the zip file again.
+            self.resolver.Set(self.urn, self.urn, lexicon.AFF4_TYPE, rdfvalue.URN(
+                lexicon.AFF4_ZIP_TYPE))
+            self.resolver.Set(lexicon.transient_graph, self.urn, lexicon.AFF4_STORED, rdfvalue.URN(
+                backing_store_urn))
+            self.resolver.Set(lexicon.transient_graph, backing_store_urn, lexicon.AFF4_CONTAINS,
+                              self.urn)
 
+    def _ParseCDEntry(self, buffer, offset):
+        """Parse the central directory entry at offset in buffer.
+
+        Returns the ZipInfo and the offset of the next entry, or None.
+        """
+        if len(buffer) < offset + CDFileHeader.sizeof():
+            return None
+
+        entry = CDFileHeader(buffer[offset:])
+        if not entry.IsValid():
+            return None
+
+        offset += entry.sizeof()
+        fn = buffer[offset:offset + entry.file_name_length]
+        offset += entry.file_name_length
+
+        # decode the filename to UTF-8 if the EFS bit (bit 11) is set
+        if entry.flags | (1 << 11):
+            fn = fn.decode("utf-8")
+
+        zip_info = ZipInfo(
+            filename=fn,
+            local_header_offset=entry.relative_offset_local_header,
+            compression_method=entry.compression_method,
+            compress_size=entry.compress_size,
+            file_size=entry.file_size,
+            crc32=entry.crc32,
+            lastmoddate=entry.dosdate,
+            lastmodtime=entry.dostime)
+
+        # Zip64 local header - parse the Zip64 extended information extra field.
+        # if zip_info.local_header_offset < 0 or zip_info.local_header_offset == 0xffffffff:
+        if entry.extra_field_len > 0:
+            extrabuf = buffer[offset:offset + entry.extra_field_len]
+
+            # AFF4 requres Zip64, but we still want to be able to read 3rd party
+            # zip files, so just skip unknown Extensible data fields and find the Zip64
+
+            while len(extrabuf) > 0:
+                (headerID, dataSize) = struct.unpack("<HH", extrabuf[0:4])
+                if headerID == 1:
+                    # Zip64 extended information extra field
+                    extra, readbytes = Zip64FileHeaderExtensibleField.FromBuffer(
+                        entry, extrabuf)
+                    extrabuf = extrabuf[readbytes:]
+
+                    if extra.header_id == 1:
+                        if extra.Get("relative_offset_local_header") is not None:
+                            zip_info.local_header_offset = (
+                                extra.Get("relative_offset_local_header"))
+                        if extra.Get("file_size") is not None:
+                            zip_info.file_size = extra.Get("file_size")
+                        if extra.Get("compress_size") is not None:
+                            zip_info.compress_size = extra.Get("compress_size")
+                else:
+                    extrabuf = extrabuf[dataSize + 4:]
+
+        # Go to the next entry.
+        return zip_info, (offset + entry.extra_field_len +
+                          entry.file_comment_length)
+
+    def _ReadCDEntry(self, backing_store, offset):
+        backing_store.SeekRead(offset, 0)
+        buffer = backing_store.Read(CDFileHeader.sizeof())
+        if len(buffer) < CDFileHeader.sizeof():
+            return None
+
+        entry = CDFileHeader(buffer)
+        buffer += backing_store.Read(entry.file_name_length +
+                                     entry.extra_field_len +
+                                     entry.file_comment_length)
+        try:
+            result = self._ParseCDEntry(buffer, 0)
+        except (struct.error, UnicodeDecodeError):
+            return None
+
+        if result is None or result[1] != len(buffer):
+            return None
+
+        return result[0], offset + result[1]
+
+    def _ReadCheckpointRecord(self, backing_store, record, offset):
+        """Parse the data of the checkpoint record at offset.
+
+        Returns (zip_infos, removed names, urn_string, turtle) or None if the
+        record is damaged.
+        """
+        data_offset = offset + record.sizeof()
+        backing_store.SeekRead(data_offset, 0)
+        data = backing_store.Read(record.length)
+        if (len(data) != record.length or
+                zlib.crc32(data) & 0xffffffff != record.crc32):
+            return None
+
+        try:
+            zip_infos = []
+            data_offset = 0
+            for _ in range(record.number_of_entries):
+                zip_info, data_offset = self._ParseCDEntry(data, data_offset)
+                zip_infos.append(zip_info)
+
+            removed = []
+            for _ in range(record.number_of_removed):
+                length, = struct.unpack_from("<H", data, data_offset)
+                data_offset += 2
+                removed.append(data[data_offset:data_offset + length].decode("utf-8"))
+                data_offset += length
+
+            urn_string = data[data_offset:data_offset + record.urn_length]
+            data_offset += record.urn_length
+        except (TypeError, struct.error, UnicodeDecodeError):
+            return None
+
+        return zip_infos, removed, utils.SmartUnicode(urn_string), data[data_offset:]
+
+    def _WalkCheckpoints(self, backing_store):
+        """Find the volume's state at its last central directory or checkpoint.
+
+        The zip structures are stepped over from the start of the file, which
+        only reads headers, never member data. Stops at the first thing which
+        is not one (e.g. a member being written when the writer died).
+        Returns a CheckpointState or None.
+        """
+        # Only zip files which start with a member can have checkpoints - do
+        # not walk through arbitrary files we were appended to.
+        backing_store.SeekRead(0, 0)
+        if backing_store.Read(4) != ZipFileHeader.magic_string:
+            return None
+
+        end_of_file = backing_store.Size()
+        state = None
+
+        # The central directory entries since the last member.
+        entries = []
+        entries_start = None
+        number_of_entries = None
+        offset = 0
+        while offset < end_of_file:
+            backing_store.SeekRead(offset, 0)
+            signature = backing_store.Read(8)
+            if signature.startswith(ZipFileHeader.magic_string):
+                zip_info = self._ReadLocalHeader(backing_store, offset, end_of_file)
+                if zip_info is None:
+                    break
+
+                offset = zip_info.data_offset + zip_info.compress_size
+                entries = []
+                number_of_entries = None
+
+            elif signature.startswith(b"PK\x01\x02"):
+                result = self._ReadCDEntry(backing_store, offset)
+                if result is None:
+                    break
+
+                if not entries:
+                    entries_start = offset
+                entries.append(result[0])
+                offset = result[1]
+
+            elif signature.startswith(Zip64EndCD.magic_string):
+                backing_store.SeekRead(offset, 0)
+                end_cd = Zip64EndCD(backing_store.Read(Zip64EndCD.sizeof()))
+                number_of_entries = end_cd.number_of_entries_in_volume
+                offset += end_cd.size_of_header + 12
+
+            elif signature.startswith(b"PK\x06\x07"):
+                offset += Zip64CDLocator.sizeof()
+
+            elif signature.startswith(EndCentralDirectory.magic_string):
+                backing_store.SeekRead(offset, 0)
+                end_cd = EndCentralDirectory(
+                    backing_store.Read(EndCentralDirectory.sizeof()))
+                start = offset
+                offset += end_cd.sizeof() + end_cd.comment_len
+                if number_of_entries is None:
+                    number_of_entries = end_cd.total_entries_in_cd
+
+                if offset <= end_of_file and len(entries) == number_of_entries:
+                    backing_store.SeekRead(start + end_cd.sizeof(), 0)
+                    urn_string = utils.SmartUnicode(
+                        backing_store.Read(end_cd.comment_len)).rstrip("\x00")
+                    state = CheckpointState(
+                        urn_string, entries,
+                        [entries_start if entries else start, offset])
+
+                entries = []
+                number_of_entries = None
+
+            elif signature == CheckpointRecord.magic_string:
+                backing_store.SeekRead(offset, 0)
+                record = CheckpointRecord(
+                    backing_store.Read(CheckpointRecord.sizeof()))
+                end = offset + record.sizeof() + record.length
+                if end > end_of_file:
+                    break
+
+                # Records which do not follow on from the state we have are
+                # left over from an earlier session.
+                if (record.previous == CheckpointRecord.NO_PREVIOUS or
+                        (state is not None and record.previous == state.end)):
+                    result = self._ReadCheckpointRecord(
+                        backing_store, record, offset)
+                    if result is not None:
+                        if record.previous == CheckpointRecord.NO_PREVIOUS:
+                            state = CheckpointState(None, [])
+                        zip_infos, removed, urn_string, turtle = result
+                        state.Apply(zip_infos, removed, urn_string, turtle,
+                                    [offset, end])
+
+                offset = end
+
+            elif signature == FreeSpaceMarker.magic_string:
+                backing_store.SeekRead(offset, 0)
+                marker = FreeSpaceMarker(
+                    backing_store.Read(FreeSpaceMarker.sizeof()))
+                if marker.length < marker.sizeof():
+                    break
+                offset += marker.length
+
+            else:
+                break
+
+        return state
+
+    def _LoadCheckpoint(self, backing_store_urn, backing_store, end_of_cd):
+        """Load the volume from its last checkpoint, if it has one after
+        end_of_cd.
+
+        A volume which was not closed has no central directory at the end, or
+        checkpoint records after it. Returns True if the volume was loaded.
+        """
+        state = self._WalkCheckpoints(backing_store)
+        if state is None or state.end <= end_of_cd:
+            return False
+
+        if LOGGER.isEnabledFor(logging.INFO):
+            LOGGER.info("Using checkpoint ending @ %#x", state.end)
+
+        self._SetVolumeURN(state.urn_string, backing_store_urn)
+        self.global_offset = 0
+        for zip_info in state.zip_infos.values():
+            member_urn = self._RegisterMember(zip_info)
+            self._cd_entries[member_urn] = (zip_info, None)
+
+        self.checkpoint_turtle = state.turtle
+        self._directory_extents = state.extents
+        return True
+
+    def _RegisterMember(self, zip_info):
+        # Store this information in the resolver. Ths allows
+        # segments to be directly opened by URN.
+        member_urn = escaping.urn_from_member_name(
+            zip_info.filename, self.urn, self.version)
+
+        self.resolver.Set(lexicon.transient_graph,
+            member_urn, lexicon.AFF4_TYPE, rdfvalue.URN(
+                lexicon.AFF4_ZIP_SEGMENT_TYPE))
+
+        self.resolver.Set(lexicon.transient_graph, member_urn, lexicon.AFF4_STORED, self.urn)
+        self.resolver.Set(lexicon.transient_graph, member_urn, lexicon.AFF4_STREAM_SIZE,
+                          rdfvalue.XSDInteger(zip_info.file_size))
+        if zip_info.file_header_offset is None:
+            zip_info.file_header_offset = (zip_info.local_header_offset +
+                                           self.global_offset)
+        self.members[member_urn] = zip_info
+        return member_urn
+
+    def _ReadLocalHeader(self, backing_store, offset, end_of_file):
+        """Parse and sanity check the local file header at offset.
+
+        Returns a ZipInfo (with file_header_offset set) or None if there is no
+        plausible, complete member at this offset.
+        """
+        backing_store.SeekRead(offset, 0)
+        buffer = backing_store.Read(ZipFileHeader.sizeof())
+        if len(buffer) < ZipFileHeader.sizeof():
+            return None
+
+        file_header = ZipFileHeader(buffer)
+        if not file_header.IsValid():
+            return None
+
+        if file_header.compression_method not in (ZIP_STORED, ZIP_DEFLATE):
+            return None
+
+        if file_header.file_name_length == 0:
+            return None
+
+        fn = backing_store.Read(file_header.file_name_length)
+        if len(fn) != file_header.file_name_length or b"\x00" in fn:
+            return None
+
+        try:
+            fn = fn.decode("utf-8")
+        except UnicodeDecodeError:
+            return None
+
+        # The local header sizes are signed, and set to -1 (0xFFFFFFFF) when
+        # the real value is held in the Zip64 extra field.
+        file_size = file_header.file_size & 0xFFFFFFFF
+        compress_size = file_header.compress_size & 0xFFFFFFFF
+
+        extrabuf = backing_store.Read(file_header.extra_field_len)
+        if len(extrabuf) != file_header.extra_field_len:
+            return None
+
+        while len(extrabuf) >= 4:
+            (header_id, data_size) = struct.unpack("<HH", extrabuf[0:4])
+            if header_id == 1:
+                field = extrabuf[4:4 + data_size]
+                if file_size == 0xFFFFFFFF and len(field) >= 8:
+                    file_size = struct.unpack("<Q", field[0:8])[0]
+                    field = field[8:]
+                if compress_size == 0xFFFFFFFF and len(field) >= 8:
+                    compress_size = struct.unpack("<Q", field[0:8])[0]
+            extrabuf = extrabuf[data_size + 4:]
+
+        if file_size == 0xFFFFFFFF or compress_size == 0xFFFFFFFF:
+            return None
+
+        if (file_header.compression_method == ZIP_STORED and
+                file_size != compress_size):
+            return None
+
+        data_offset = (offset + ZipFileHeader.sizeof() +
+                       file_header.file_name_length +
+                       file_header.extra_field_len)
+        if data_offset + compress_size > end_of_file:
+            # Truncated member.
+            return None
+
+        if compress_size == 0:
+            # StreamAddMember writes a zero length header first and only
+            # fixes it up once the data is written, so this is either a
+            # genuinely empty member or one which was never finished. The
+            # former is immediately followed by another zip structure.
+            backing_store.SeekRead(data_offset, 0)
+            signature = backing_store.Read(4)
+            if signature and signature not in (
+                    b"PK\x03\x04", b"PK\x01\x02", b"PK\x06\x06", b"PK\x05\x06",
+                    b"AFF4"):
+                return None
+
+        zip_info = ZipInfo(
+            filename=fn,
+            local_header_offset=offset,
+            compression_method=file_header.compression_method,
+            compress_size=compress_size,
+            file_size=file_size,
+            crc32=file_header.crc32,
+            lastmoddate=file_header.lastmoddate,
+            lastmodtime=file_header.lastmodtime)
+        zip_info.file_header_offset = offset
+        zip_info.data_offset = data_offset
+
+        return zip_info
+
+    def scan_local_headers(self, backing_store_urn):
+        """Find all complete members by scanning for local file headers.
+
+        This is used when the central directory is missing (e.g. the writer
+        was killed before Flush()). Member data is skipped over using the
+        sizes in each local header, so only the gaps between members are
+        actually scanned. Returns the list of ZipInfo in file order and the
+        offset of the end of the last complete member.
+        """
+        result = []
+        end_of_members = 0
+        with self.resolver.AFF4FactoryOpen(backing_store_urn) as backing_store:
+            end_of_file = backing_store.Size()
+            offset = 0
+            while offset < end_of_file:
+                backing_store.SeekRead(offset, 0)
+                buffer = backing_store.Read(SCAN_BUFF_SIZE)
+                if not buffer:
+                    break
+
+                index = buffer.find(ZipFileHeader.magic_string)
+                if index < 0:
+                    # The magic may straddle the buffer boundary.
+                    offset += max(1, len(buffer) - 3)
+                    continue
+
+                header_offset = offset + index
+                zip_info = self._ReadLocalHeader(
+                    backing_store, header_offset, end_of_file)
+                if zip_info is None:
+                    offset = header_offset + 1
+                    continue
 
                 if LOGGER.isEnabledFor(logging.INFO):
-                    LOGGER.info("Found file %s @ %#x", zip_info.filename,
-                            zip_info.local_header_offset)
+                    LOGGER.info("Recovered file %s @ %#x", zip_info.filename,
+                                header_offset)
 
-                # Store this information in the resolver. Ths allows
-                # segments to be directly opened by URN.
-                member_urn = escaping.urn_from_member_name(
-                    zip_info.filename, self.urn, self.version)
+                result.append(zip_info)
+                offset = zip_info.data_offset + zip_info.compress_size
+                end_of_members = offset
 
-                self.resolver.Set(lexicon.transient_graph,
-                    member_urn, lexicon.AFF4_TYPE, rdfvalue.URN(
-                        lexicon.AFF4_ZIP_SEGMENT_TYPE))
+        return result, end_of_members
 
-                self.resolver.Set(lexicon.transient_graph, member_urn, lexicon.AFF4_STORED, self.urn)
-                self.resolver.Set(lexicon.transient_graph, member_urn, lexicon.AFF4_STREAM_SIZE,
-                                  rdfvalue.XSDInteger(zip_info.file_size))
-                self.members[member_urn] = zip_info
+    def RecoverMembers(self):
+        """Rebuild the members of this volume from the local file headers.
 
-                # Go to the next entry.
-                entry_offset += (entry.sizeof() +
-                                 entry.file_name_length +
-                                 entry.extra_field_len +
-                                 entry.file_comment_length)
+        The backing store is trimmed after the last complete member, so any
+        partially written member (and any stale central directory) is
+        discarded. A fresh central directory is written on Flush().
+        """
+        zip_infos, end_of_members = self.scan_local_headers(
+            self.backing_store_urn)
+
+        # Later copies of a member supersede earlier ones.
+        latest = {}
+        for zip_info in zip_infos:
+            latest[zip_info.filename] = zip_info
+
+        # Discover the volume URN from the container description if we can,
+        # as member names are relative to it.
+        description = latest.get("container.description")
+        if description is not None and self.version != basic_zip:
+            with self.resolver.AFF4FactoryOpen(self.backing_store_urn) as backing_store:
+                backing_store.SeekRead(description.data_offset, 0)
+                data = backing_store.Read(description.compress_size)
+                if description.compression_method == ZIP_DEFLATE:
+                    data = DecompressBuffer(data)
+                urn_string = utils.SmartUnicode(data).strip("\x00").strip()
+
+            if urn_string.startswith("aff4://") and self.urn != urn_string:
+                self.resolver.DeleteSubject(self.urn)
+                self.urn.Set(urn_string)
+
+        self.global_offset = 0
+        self.members = {}
+        for zip_info in sorted(latest.values(),
+                               key=lambda k: k.file_header_offset):
+            self._RegisterMember(zip_info)
+
+        with self.resolver.AFF4FactoryOpen(self.backing_store_urn) as backing_store:
+            if backing_store.Size() > end_of_members:
+                if LOGGER.isEnabledFor(logging.INFO):
+                    LOGGER.info("Discarding %#x bytes after the last complete member",
+                                backing_store.Size() - end_of_members)
+                backing_store.Trim(end_of_members)
+
+        self.MarkDirty()
+
+    @staticmethod
+    def RecoverZipFile(resolver, vers, backing_store_urn):
+        """Open a zip file with a missing or stale central directory.
+
+        Members are recovered from their local file headers and any metadata
+        found in the volume is loaded. The caller is responsible for
+        regenerating metadata which was lost; Flush() writes a new
+        information.turtle and central directory.
+        """
+        rdfvalue.AssertURN(backing_store_urn)
+        if vers == None:
+            vers = Version(0,1,"pyaff4")
+
+        # Random mode allows trimming the tail and rewrites the turtle in place.
+        resolver.Set(lexicon.transient_graph, backing_store_urn, lexicon.AFF4_STREAM_WRITE_MODE,
+                     rdfvalue.XSDString("random"))
+
+        result = ZipFile(resolver, urn=None, version=vers)
+        result.backing_store_urn = rdfvalue.URN(backing_store_urn)
+        result.properties.writable = True
+        result.RecoverMembers()
+
+        resolver.Set(lexicon.transient_graph, result.urn, lexicon.AFF4_TYPE,
+                     rdfvalue.URN(lexicon.AFF4_ZIP_TYPE))
+        resolver.Set(lexicon.transient_graph, result.urn, lexicon.AFF4_STORED,
+                     rdfvalue.URN(backing_store_urn))
+        resolver.Set(lexicon.transient_graph, backing_store_urn, lexicon.AFF4_CONTAINS,
+                     result.urn)
+
+        if result.ContainsSegment("information.turtle"):
+            try:
+                resolver.loadMetadata(result)
+            except Exception as e:
+                LOGGER.error("Unable to load metadata from %s: %s", result.urn, e)
+
+        return resolver.CachePut(result)
 
     @staticmethod
     def NewZipFile(resolver, vers, backing_store_urn, appendmode=None):
@@ -879,13 +1583,17 @@ class BasicZipFile(aff4.AFF4Volume):
         except IOError:
             # If we can not parse a CD from the zip file, this is fine, we just
             # append an AFF4 volume to it, or make a new file.
-            return
+            pass
+
+        self.resolver.Set(lexicon.transient_graph, self.urn,
+                          lexicon.AFF4_VOLUME_VERSION,
+                          rdfvalue.XSDString(str(self.version)))
 
 
 
     def StreamAddMember(self, member_urn, stream,
                         compression_method=ZIP_STORED,
-                        progress=None):
+                        progress=None, crc32=None, size=None):
         """An efficient interface to add a new archive member.
 
         Args:
@@ -893,15 +1601,38 @@ class BasicZipFile(aff4.AFF4Volume):
           stream: A file-like object (with read() method) that generates data to
             be written as the member.
           compression_method: How to compress the member.
+          crc32: The CRC32 of the data in stream if the caller already knows
+            it, or a function returning it once stream is exhausted (e.g. when
+            the stream checksums each block it produces). Stored members are
+            then copied without checksumming them again.
+          size: The length of the data in stream, if known. Stored members of
+            a known size may be placed in free space left by removed members
+            instead of at the end of the file.
 
         """
         if progress is None:
             progress = aff4.EMPTY_PROGRESS
 
+        filename = escaping.member_name_for_urn(member_urn, self.version, self.urn, use_unicode=USE_UNICODE)
+
         backing_store_urn = self.resolver.GetUnique(lexicon.transient_graph, self.urn, lexicon.AFF4_STORED)
         with self.resolver.AFF4FactoryOpen(backing_store_urn) as backing_store:
-            # Append member at the end of the file.
-            backing_store.SeekWrite(0, aff4.SEEK_END)
+            seekable = self._CanReuseExtents(backing_store_urn)
+            if compression_method != ZIP_STORED:
+                size = None
+
+            extent = None
+            if size is not None and self.free_extents and seekable:
+                extent_size = ZipInfo(
+                    filename=filename, file_size=size,
+                    compress_size=size).FileHeaderLength() + size
+                extent = self._AllocateExtent(extent_size)
+
+            if extent is not None:
+                backing_store.SeekWrite(extent[0], aff4.SEEK_SET)
+            else:
+                # Append member at the end of the file.
+                backing_store.SeekWrite(0, aff4.SEEK_END)
 
             if LOGGER.isEnabledFor(logging.INFO):
                 LOGGER.info("Appending ZIP file header %s @ %x", member_urn, backing_store.TellWrite())
@@ -910,12 +1641,23 @@ class BasicZipFile(aff4.AFF4Volume):
             # global_offset into account).
             zip_info = ZipInfo(
                 local_header_offset=backing_store.TellWrite() - self.global_offset,
-                filename=escaping.member_name_for_urn(member_urn, self.version, self.urn, use_unicode=USE_UNICODE),
+                filename=filename,
                 file_size=0, crc32=0, compression_method=compression_method)
 
+            if extent is not None:
+                self._UseExtent(backing_store, extent, extent_size)
+                backing_store.SeekWrite(extent[0], aff4.SEEK_SET)
+
             # For now we do not support streamed writing so we need to seek back
-            # to this position later with an updated crc32.
+            # to this position later with an updated crc32. Headers with the
+            # size from the start let _WalkCheckpoints() step over the member
+            # even if we die part way through it.
+            if size is not None:
+                zip_info.file_size = zip_info.compress_size = size
+                if crc32 is not None and not callable(crc32):
+                    zip_info.crc32 = crc32 & 0xffffffff
             zip_info.WriteFileHeader(backing_store)
+            zip_info.file_size = zip_info.compress_size = zip_info.crc32 = 0
 
             start_of_stream_addr = backing_store.TellWrite()
 
@@ -953,29 +1695,337 @@ class BasicZipFile(aff4.AFF4Volume):
                     if not data:
                         break
 
+                    if size is not None and zip_info.compress_size + len(data) > size:
+                        raise IOError("Member %s is larger than its size" % member_urn)
+
                     zip_info.compress_size += len(data)
                     zip_info.file_size += len(data)
-                    # Python 2 erronously returns a signed int here.
-                    zip_info.crc32 = zlib.crc32(data, zip_info.crc32) & 0xffffffff
+                    if crc32 is None:
+                        # Python 2 erronously returns a signed int here.
+                        zip_info.crc32 = zlib.crc32(data, zip_info.crc32) & 0xffffffff
                     progress.Report(zip_info.file_size)
                     backing_store.Write(data)
+
+                if callable(crc32):
+                    crc32 = crc32()
+                if crc32 is not None:
+                    zip_info.crc32 = crc32 & 0xffffffff
             else:
                 raise RuntimeError("Unsupported compression method")
 
             if LOGGER.isEnabledFor(logging.INFO):
                 LOGGER.info("Wrote ZIP stream @ %x[%x]", start_of_stream_addr, zip_info.compress_size)
 
-            # Update the local file header now that CRC32 is calculated.
-            if LOGGER.isEnabledFor(logging.INFO):
-                LOGGER.info("Updating ZIP file header %s @ %x", member_urn, zip_info.file_header_offset)
-            zip_info.WriteFileHeader(backing_store)
+            if size is not None and zip_info.compress_size != size:
+                raise IOError("Member %s is smaller than its size" % member_urn)
+
+            # Update the local file header now that CRC32 is calculated. Files
+            # opened for appending can only be written at the end, so keep the
+            # header we started with.
+            if seekable:
+                if LOGGER.isEnabledFor(logging.INFO):
+                    LOGGER.info("Updating ZIP file header %s @ %x", member_urn, zip_info.file_header_offset)
+                zip_info.WriteFileHeader(backing_store)
             self.members[member_urn] = zip_info
 
+        self._bytes_since_checkpoint += zip_info.compress_size
+        self.MaybeCheckpoint()
+
+    def SetCheckpointInterval(self, bytes=None, seconds=None):
+        """Periodically write a checkpoint record (see Checkpoint()).
+
+        If the writer dies before Flush(), the volume can then be reopened
+        from the last checkpoint, losing at most the data written since.
+        """
+        self.checkpoint_bytes = bytes
+        self.checkpoint_seconds = seconds
+        self._bytes_since_checkpoint = 0
+        self._last_checkpoint = time.time()
+
+    def MaybeCheckpoint(self):
+        if self._checkpoints_suspended or not self.properties.writable:
+            return
+
+        if ((self.checkpoint_bytes is not None and
+             self._bytes_since_checkpoint >= self.checkpoint_bytes) or
+            (self.checkpoint_seconds is not None and
+             time.time() - self._last_checkpoint >= self.checkpoint_seconds)):
+            self.Checkpoint()
+
+    def Checkpoint(self):
+        """Append a checkpoint record.
+
+        Objects in the volume which support it record metadata covering the
+        data they have already stored (see AFF4Image.Checkpoint). The record
+        only holds what changed since the last central directory or record,
+        which it follows on from.
+        """
+        self._checkpoints_suspended = True
+        try:
+            # Far fewer objects are cached than we have children.
+            for child in [obj.urn for obj in self.resolver.ObjectCache.Objects()
+                          if obj.urn in self.children]:
+                with self.resolver.CacheGet(child) as obj:
+                    checkpoint = getattr(obj, "Checkpoint", None)
+                    if checkpoint is not None:
+                        checkpoint()
+
+            backing_store_urn = self.resolver.GetUnique(lexicon.transient_graph, self.urn, lexicon.AFF4_STORED)
+            with self.resolver.AFF4FactoryOpen(backing_store_urn) as backing_store:
+                self._WriteCheckpointRecord(backing_store)
+                backing_store.Flush()
+        finally:
+            self._checkpoints_suspended = False
+
+        self._bytes_since_checkpoint = 0
+        self._last_checkpoint = time.time()
+
+    def _WriteCheckpointRecord(self, backing_store):
+        if self._unmarked_free_space:
+            # Readers of the record need to step over all the free space.
+            for start, end in self.free_extents:
+                self._MarkFreeSpace(backing_store, start, end)
+            self._unmarked_free_space = False
+
+        data = io.BytesIO()
+        number_of_entries = 0
+        for urn, zip_info in list(self.members.items()):
+            entry = self._cd_entries.get(urn)
+            if entry is None or entry[0] is not zip_info:
+                entry_stream = io.BytesIO()
+                zip_info.WriteCDFileHeader(entry_stream)
+                self._cd_entries[urn] = (zip_info, entry_stream.getvalue())
+                data.write(entry_stream.getvalue())
+                number_of_entries += 1
+
+        removed = [urn for urn in self._cd_entries if urn not in self.members]
+        for urn in removed:
+            name = utils.SmartStr(self._cd_entries.pop(urn)[0].filename)
+            data.write(struct.pack("<H", len(name)))
+            data.write(name)
+
+        urn_string = utils.SmartStr(self.urn.SerializeToString())
+        data.write(urn_string)
+
+        since = self._checkpoint_version
+        if since is None:
+            since = self.resolver.turtle_versions.get(self.urn)
+        turtle, self._checkpoint_version = self.resolver.CheckpointTurtle(
+            self, since=since)
+        data.write(turtle)
+
+        data = data.getvalue()
+        record = CheckpointRecord(
+            number_of_entries=number_of_entries,
+            number_of_removed=len(removed),
+            urn_length=len(urn_string),
+            length=len(data),
+            crc32=zlib.crc32(data) & 0xffffffff)
+        if self._directory_extents:
+            record.previous = self._directory_extents[-1][1]
+
+        backing_store.SeekWrite(0, aff4.SEEK_END)
+        offset = backing_store.TellWrite()
+        if LOGGER.isEnabledFor(logging.INFO):
+            LOGGER.info("Writing checkpoint record at %#x", offset)
+        backing_store.Write(record.Pack() + data)
+
+        # The central directory and earlier records are still needed to read
+        # this record, but nothing references the removed members any more.
+        self._directory_extents.append([offset, offset + record.sizeof() + len(data)])
+        for start, end in self.pending_extents:
+            self._FreeExtent(start, end)
+        self.pending_extents = []
+
+    def _CanReuseExtents(self, backing_store_urn):
+        # Files opened for appending always write at the end.
+        mode = self.resolver.GetUnique(lexicon.transient_graph,
+            backing_store_urn, lexicon.AFF4_STREAM_WRITE_MODE)
+        return str(mode) in ["truncate", "random"]
+
+    def _MemberExtent(self, backing_store, zip_info):
+        """Returns the [start, end) extent of a member in the backing store."""
+        start = zip_info.file_header_offset
+        if start is None:
+            start = zip_info.local_header_offset + self.global_offset
+
+        backing_store.SeekRead(start, 0)
+        file_header = ZipFileHeader(backing_store.Read(ZipFileHeader.sizeof()))
+        if not file_header.IsValid():
+            raise IOError("Local file header invalid!")
+
+        return start, (start + file_header.sizeof() +
+                       file_header.file_name_length +
+                       file_header.extra_field_len + zip_info.compress_size)
+
+    def _RebuildFreeExtents(self, backing_store):
+        """Frees the gaps between the members of the central directory.
+
+        These are left by members removed in earlier sessions, and by the
+        central directories written before the current one.
+        """
+        self.free_extents = []
+        offset = self.global_offset
+        for zip_info in sorted(self.members.values(),
+                               key=lambda k: k.file_header_offset):
+            start, end = self._MemberExtent(backing_store, zip_info)
+            self._FreeExtent(offset, start)
+            offset = max(offset, end)
+
+        self._FreeExtent(offset, self._directory_extents[0][0])
+
+        # Only checkpoint records need this, so it is left until one is
+        # written.
+        self._unmarked_free_space = True
+
+    def _EndOfMembers(self, backing_store):
+        if not self.members:
+            return self.global_offset
+
+        last = max(self.members.values(), key=lambda k: k.file_header_offset)
+        return self._MemberExtent(backing_store, last)[1]
+
+    def _FreeExtent(self, start, end):
+        if end <= start:
+            return
+
+        index = bisect.bisect_left(self.free_extents, [start, end])
+
+        # Merge with the neighbouring extents if they touch.
+        if index > 0 and self.free_extents[index - 1][1] >= start:
+            index -= 1
+            start = self.free_extents[index][0]
+            end = max(end, self.free_extents.pop(index)[1])
+
+        while (index < len(self.free_extents) and
+               self.free_extents[index][0] <= end):
+            end = max(end, self.free_extents.pop(index)[1])
+
+        self.free_extents.insert(index, [start, end])
+
+    def _CommitExtents(self, cd_extent):
+        """Called once a new central directory has been written at cd_extent.
+
+        Nothing references the removed members, the old central directory or
+        checkpoint records any more, so their space is free.
+        """
+        for start, end in self.pending_extents + self._directory_extents:
+            self._FreeExtent(start, end)
+        self.pending_extents = []
+        self._directory_extents = [cd_extent]
+
+    def _AllocateExtent(self, length, before=None):
+        """Take length bytes from the smallest free extent which fits.
+
+        If before is given the extent must lie before that offset. Returns the
+        [start, end) of the whole extent (see _UseExtent) or None.
+        """
+        best = None
+        for index, (start, end) in enumerate(self.free_extents):
+            if before is not None and end > before:
+                break
+
+            # What is left over must fit a FreeSpaceMarker.
+            if end - start != length and end - start < length + FreeSpaceMarker.sizeof():
+                continue
+
+            if end - start >= length and (
+                    best is None or end - start < self.free_extents[best][1] -
+                    self.free_extents[best][0]):
+                best = index
+
+        if best is None:
+            return None
+
+        return self.free_extents.pop(best)
+
+    def _UseExtent(self, backing_store, extent, length):
+        """Write length bytes at the start of extent, freeing the rest."""
+        self._MarkFreeSpace(backing_store, extent[0] + length, extent[1])
+        self._FreeExtent(extent[0] + length, extent[1])
+
+    def _MarkFreeSpace(self, backing_store, start, end):
+        # So that _WalkCheckpoints() can step over it.
+        if end - start >= FreeSpaceMarker.sizeof():
+            backing_store.SeekWrite(start, aff4.SEEK_SET)
+            backing_store.Write(FreeSpaceMarker(length=end - start).Pack())
+
+    def Compact(self, progress=None):
+        """Moves members into free space nearer the start of the file.
+
+        This is an offline operation: the volume is flushed and open objects
+        are evicted first since their members move. Members are only ever
+        copied into free space, and the space they leave behind is only reused
+        once a central directory which no longer references it is written, so
+        an interrupted Compact() leaves a readable volume. Free space left at
+        the end of the file is dropped.
+        """
+        if not self.properties.writable:
+            raise IOError("Attempt to compact a read only volume")
+
+        if progress is None:
+            progress = aff4.EMPTY_PROGRESS
+
+        self.Flush()
+        for child in list(self.children):
+            if self.resolver.CacheContains(child):
+                obj = self.resolver.CacheGet(child)
+                self.resolver.ObjectCache.Remove(obj)
+
+        backing_store_urn = self.resolver.GetUnique(lexicon.transient_graph, self.urn, lexicon.AFF4_STORED)
+        with self.resolver.AFF4FactoryOpen(backing_store_urn) as backing_store:
+            moved = True
+            while moved:
+                moved = False
+
+                # Members at the end of the file go first, since moving them
+                # is what lets the file shrink.
+                for urn, zip_info in sorted(self.members.items(),
+                                            key=lambda k: k[1].file_header_offset,
+                                            reverse=True):
+                    start, end = self._MemberExtent(backing_store, zip_info)
+                    extent = self._AllocateExtent(end - start, before=start)
+                    if extent is None:
+                        continue
+
+                    if LOGGER.isEnabledFor(logging.INFO):
+                        LOGGER.info("Moving %s from %#x to %#x",
+                                    zip_info.filename, start, extent[0])
+                    self._UseExtent(backing_store, extent, end - start)
+                    self._CopyExtent(backing_store, start, end, extent[0])
+                    self.pending_extents.append([start, end])
+
+                    zip_info.file_header_offset = extent[0]
+                    zip_info.local_header_offset = extent[0] - self.global_offset
+                    if zip_info.data_offset is not None:
+                        zip_info.data_offset -= start - extent[0]
+                    self._cd_entries.pop(urn, None)
+
+                    moved = True
+                    progress.Report(end - start)
+
+                if moved:
+                    self.write_zip64_CD()
+
+    def _CopyExtent(self, backing_store, start, end, destination):
+        # The destination is free space, so never overlaps the source.
+        while start < end:
+            backing_store.SeekRead(start, 0)
+            data = backing_store.Read(min(SCAN_BUFF_SIZE, end - start))
+            if not data:
+                raise IOError("Unexpected end of file while compacting")
+
+            backing_store.SeekWrite(destination, aff4.SEEK_SET)
+            backing_store.Write(data)
+            start += len(data)
+            destination += len(data)
+
     def RemoveMember(self, child_urn):
         self.RemoveMembers([child_urn])
 
     def RemoveMembers(self, child_urns):
-        trimStorage = True
+        # The central directory must be rewritten.
+        self.MarkDirty()
         backing_store_urn = self.resolver.GetUnique(lexicon.transient_graph, self.urn, lexicon.AFF4_STORED)
         with self.resolver.AFF4FactoryOpen(backing_store_urn) as backing_store:
             try:
@@ -991,10 +2041,23 @@ class BasicZipFile(aff4.AFF4Volume):
                         if self.members[arn] != None:
                             del self.members[arn]
 
-                        if trimStorage:
-                            backing_store.Trim(zip_info.file_header_offset)
-                    else:
-                        trimStorage = False
+                        extent = self._MemberExtent(backing_store, zip_info)
+                        entry = self._cd_entries.get(arn)
+                        if entry is not None and entry[0] is zip_info:
+                            # The last central directory references the
+                            # member, so its data stays until one without it
+                            # is written, in case we die first.
+                            self.pending_extents.append(list(extent))
+                        else:
+                            self._FreeExtent(*extent)
+
+                # Free space which is now at the end of the file can go.
+                end_of_file = backing_store.Size()
+                while self.free_extents and self.free_extents[-1][1] >= end_of_file:
+                    start, _ = self.free_extents.pop()
+                    if start < end_of_file:
+                        backing_store.Trim(start)
+                        end_of_file = start
             except:
                 for arn in child_urns:
                     if self.resolver.CacheContains(arn):
@@ -1016,7 +2079,8 @@ class BasicZipFile(aff4.AFF4Volume):
         # If the zip file was changed, re-write the central directory.
         if self.IsDirty():
             # First Flush all our children, but only if they are still in the
-            # cache.
+            # cache. There is no point checkpointing while we do this.
+            self._checkpoints_suspended = True
 
             while len(self.children):
                 for child in list(self.children):
@@ -1028,8 +2092,11 @@ class BasicZipFile(aff4.AFF4Volume):
                     if child in self.children:
                         self.children.remove(child)
 
+            self._checkpoints_suspended = False
+
             # Add the turtle file to the volume.
             self.resolver.DumpToTurtle(self)
+            self._checkpoint_version = None
 
             # Write the central directory.
             self.write_zip64_CD()
@@ -1039,76 +2106,110 @@ class BasicZipFile(aff4.AFF4Volume):
     def write_zip64_CD(self):
         backing_store_urn = self.resolver.GetUnique(lexicon.transient_graph, self.urn, lexicon.AFF4_STORED)
         with self.resolver.AFF4FactoryOpen(backing_store_urn) as backing_store:
-            # We write to a memory stream first, and then copy it into the
-            # backing_store at once. This really helps when we have lots of
-            # members in the zip archive.
-            cd_stream = io.BytesIO()
-
             # Append a new central directory to the end of the zip file.
             backing_store.SeekWrite(0, aff4.SEEK_END)
+            cd_real_offset = backing_store.TellWrite()
+            cd = self._CentralDirectory(cd_real_offset)
+
+            # Now copy the cd into the backing_store in one write operation.
+            backing_store.write(cd)
+            self._CommitExtents([cd_real_offset, cd_real_offset + len(cd)])
+
+            # If there is room between the last member and the central
+            # directory we just wrote, write it again there and drop the rest
+            # of the file. The copy at the end stays valid until then. Files
+            # opened for appending can only be written at the end.
+            if not self._CanReuseExtents(backing_store_urn):
+                return
 
-            # The real start of the ECD.
-            ecd_real_offset = backing_store.TellWrite()
-
-            total_entries = len(self.members)
-            for urn, zip_info in list(self.members.items()):
+            end_of_members = self._EndOfMembers(backing_store)
+            cd = self._CentralDirectory(end_of_members)
+            if end_of_members + len(cd) <= cd_real_offset:
+                backing_store.Flush()
+                backing_store.SeekWrite(end_of_members, aff4.SEEK_SET)
+                backing_store.write(cd)
+                backing_store.Flush()
+                backing_store.Trim(end_of_members + len(cd))
+
+                self._directory_extents = [[end_of_members, end_of_members + len(cd)]]
+                while self.free_extents and self.free_extents[-1][1] > end_of_members:
+                    start, _ = self.free_extents.pop()
+                    self._FreeExtent(start, end_of_members)
+
+    def _CentralDirectory(self, cd_real_offset):
+        """Returns the central directory, to be written at cd_real_offset."""
+        # We write to a memory stream first, and then copy it into the
+        # backing_store at once. This really helps when we have lots of
+        # members in the zip archive.
+        cd_stream = io.BytesIO()
+
+        total_entries = len(self.members)
+        cd_entries = {}
+        for urn, zip_info in list(self.members.items()):
+            entry = self._cd_entries.get(urn)
+            if entry is None or entry[0] is not zip_info or entry[1] is None:
                 if LOGGER.isEnabledFor(logging.INFO):
                     LOGGER.info("Writing CD entry for %s", urn)
-                zip_info.WriteCDFileHeader(cd_stream)
-
-            offset_of_end_cd = cd_stream.tell() + ecd_real_offset - self.global_offset
-            size_of_cd = cd_stream.tell()
-            offset_of_cd = offset_of_end_cd - size_of_cd
-            urn_string = self.urn.SerializeToString()
-
-            # the following is included for debugging the zip implementation.
-            # for small zip files, enable output to non-zip64 containers
-            # NOT TO BE USED IN PRODUCTION
-            if not ZIP_DEBUG or offset_of_cd > ZIP32_MAX_SIZE or size_of_cd > ZIP32_MAX_SIZE or total_entries > 0xffff:
-                # only write zip64 headers if needed
-                locator = Zip64CDLocator(
-                    offset_of_end_cd=(offset_of_end_cd))
-
-                end_cd = Zip64EndCD(
-                    size_of_header=Zip64EndCD.sizeof()-12,
-                    number_of_entries_in_volume=total_entries,
-                    total_entries_in_cd=total_entries,
-                    size_of_cd=size_of_cd,
-                    offset_of_cd=offset_of_cd)
+                entry_stream = io.BytesIO()
+                zip_info.WriteCDFileHeader(entry_stream)
+                entry = (zip_info, entry_stream.getvalue())
+
+            cd_entries[urn] = entry
+            cd_stream.write(entry[1])
+
+        self._cd_entries = cd_entries
+
+        offset_of_end_cd = cd_stream.tell() + cd_real_offset - self.global_offset
+        size_of_cd = cd_stream.tell()
+        offset_of_cd = offset_of_end_cd - size_of_cd
+        urn_string = self.urn.SerializeToString()
+
+        # the following is included for debugging the zip implementation.
+        # for small zip files, enable output to non-zip64 containers
+        # NOT TO BE USED IN PRODUCTION
+        if not ZIP_DEBUG or offset_of_cd > ZIP32_MAX_SIZE or size_of_cd > ZIP32_MAX_SIZE or total_entries > 0xffff:
+            # only write zip64 headers if needed
+            locator = Zip64CDLocator(
+                offset_of_end_cd=(offset_of_end_cd))
+
+            end_cd = Zip64EndCD(
+                size_of_header=Zip64EndCD.sizeof()-12,
+                number_of_entries_in_volume=total_entries,
+                total_entries_in_cd=total_entries,
+                size_of_cd=size_of_cd,
+                offset_of_cd=offset_of_cd)
 
-                if LOGGER.isEnabledFor(logging.INFO):
-                    LOGGER.info("Writing Zip64EndCD at %#x",
-                            cd_stream.tell() + ecd_real_offset)
-                cd_stream.write(end_cd.Pack())
-                cd_stream.write(locator.Pack())
+            if LOGGER.isEnabledFor(logging.INFO):
+                LOGGER.info("Writing Zip64EndCD at %#x",
+                        cd_stream.tell() + cd_real_offset)
+            cd_stream.write(end_cd.Pack())
+            cd_stream.write(locator.Pack())
 
-            end = EndCentralDirectory(
-                total_entries_in_cd_on_disk=total_entries,
-                total_entries_in_cd=total_entries,
-                comment_len=len(urn_string),
-                offset_of_cd = offset_of_cd,
-                size_of_cd = size_of_cd)
+        end = EndCentralDirectory(
+            total_entries_in_cd_on_disk=total_entries,
+            total_entries_in_cd=total_entries,
+            comment_len=len(urn_string),
+            offset_of_cd = offset_of_cd,
+            size_of_cd = size_of_cd)
 
-            if size_of_cd > ZIP32_MAX_SIZE or not ZIP_DEBUG :
-                end.size_of_cd = 0xffffffff
+        if size_of_cd > ZIP32_MAX_SIZE or not ZIP_DEBUG :
+            end.size_of_cd = 0xffffffff
 
-            if offset_of_end_cd > ZIP32_MAX_SIZE or not ZIP_DEBUG :
-                end.offset_of_cd = 0xffffffff
+        if offset_of_end_cd > ZIP32_MAX_SIZE or not ZIP_DEBUG :
+            end.offset_of_cd = 0xffffffff
 
-            if total_entries > 0xffff:
-                end.total_entries_in_cd_on_disk = 0xffff
-                end.total_entries_in_cd = 0xffff
+        if total_entries > 0xffff:
+            end.total_entries_in_cd_on_disk = 0xffff
+            end.total_entries_in_cd = 0xffff
 
-            if LOGGER.isEnabledFor(logging.INFO):
-                LOGGER.info("Writing ECD at %#x",
-                        cd_stream.tell() + ecd_real_offset)
+        if LOGGER.isEnabledFor(logging.INFO):
+            LOGGER.info("Writing ECD at %#x",
+                    cd_stream.tell() + cd_real_offset)
 
-            cd_stream.write(end.Pack())
-            cd_stream.write(utils.SmartStr(urn_string))
+        cd_stream.write(end.Pack())
+        cd_stream.write(utils.SmartStr(urn_string))
 
-            # Now copy the cd_stream into the backing_store in one write
-            # operation.
-            backing_store.write(cd_stream.getvalue())
+        return cd_stream.getvalue()
 
     def Close(self):
         pass
@@ -18,9 +18,13 @@ from future import standard_library
 standard_library.install_aliases()
 import os
 import io
+import shutil
 import unittest
 import tempfile
+import zipfile
+import zlib
 
+from pyaff4 import aff4_image
 from pyaff4 import data_store
 from pyaff4 import lexicon
 from pyaff4 import plugins
@@ -111,6 +115,577 @@ class ZipTest(unittest.TestCase):
                 except:
                     pass
 
+    def testCRC32Combine(self):
+        data = os.urandom(100000)
+        for split in [0, 1, 17, 4096, 65536, 99999, 100000]:
+            a = data[:split]
+            b = data[split:]
+            self.assertEquals(
+                zip.crc32_combine(zlib.crc32(a) & 0xffffffff,
+                                  zlib.crc32(b) & 0xffffffff, len(b)),
+                zlib.crc32(data) & 0xffffffff)
+
+        folder = zip.CRC32Folder()
+        for i in range(0, len(data), 32768):
+            block = data[i:i+32768]
+            if i % 65536:
+                folder.Update(block)
+            else:
+                folder.AddBlock(zlib.crc32(block), len(block))
+        self.assertEquals(folder.crc32, zlib.crc32(data) & 0xffffffff)
+        self.assertEquals(folder.length, len(data))
+
+    def testPrecomputedChecksum(self):
+        data = b"A" * 100 + b"B" * 200
+        with data_store.MemoryDataStore() as resolver:
+            resolver.Set(lexicon.transient_graph, self.filename_urn, lexicon.AFF4_STREAM_WRITE_MODE,
+                         rdfvalue.XSDString("truncate"))
+
+            with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn) as zip_file:
+                segment_urn = zip_file.urn.Append(self.segment_name)
+                with zip_file.CreateMember(segment_urn) as segment:
+                    segment.Write(data[:100])
+                    segment.Write(data[100:])
+                    segment.SetChecksum(zip.crc32_combine(
+                        zlib.crc32(data[:100]), zlib.crc32(data[100:]), 200))
+
+                streamed_urn = zip_file.urn.Append(self.streamed_segment)
+                zip_file.StreamAddMember(streamed_urn, io.BytesIO(data),
+                                         crc32=zlib.crc32(data))
+
+        resolver = data_store.MemoryDataStore()
+        with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn) as zip_file:
+            for name in [self.segment_name, self.streamed_segment]:
+                zip_info = zip_file.members[zip_file.urn.Append(name)]
+                self.assertEquals(zip_info.crc32, zlib.crc32(data) & 0xffffffff)
+                self.assertEquals(zip_info.file_size, len(data))
+
+    def testCheckpoint(self):
+        crashed = self.filename + ".crashed"
+        crashed_urn = rdfvalue.URN.FromFileName(crashed)
+        data = b"".join(b"Hello world %02d!" % i for i in range(100))
+        try:
+            with data_store.MemoryDataStore() as resolver:
+                resolver.Set(lexicon.transient_graph, self.filename_urn, lexicon.AFF4_STREAM_WRITE_MODE,
+                             rdfvalue.XSDString("truncate"))
+
+                with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn) as zip_file:
+                    zip_file.SetCheckpointInterval(bytes=1)
+                    volume_urn = zip_file.urn
+                    image_urn = zip_file.urn.Append("image.dd")
+                    with aff4_image.AFF4Image.NewAFF4Image(
+                            resolver, image_urn, zip_file.urn) as image:
+                        image.chunk_size = 10
+                        image.chunks_per_segment = 3
+                        image.Write(data)
+
+                        # Simulate the writer dying part way through a member.
+                        shutil.copyfile(self.filename, crashed)
+                        with open(crashed, "ab") as fd:
+                            fd.write(b"PK\x03\x04" + b"\xff" * 100)
+
+            resolver = data_store.MemoryDataStore()
+            with zip.ZipFile.NewZipFile(resolver, version.aff4v10, crashed_urn) as zip_file:
+                self.assertEquals(zip_file.urn, volume_urn)
+
+            with resolver.AFF4FactoryOpen(image_urn) as image:
+                size = image.Size()
+                self.assertTrue(size > 0)
+                self.assertEquals(size % 30, 0)
+                self.assertEquals(image.Read(size), data[:size])
+
+            # The final flush writes the whole of the metadata.
+            resolver = data_store.MemoryDataStore()
+            with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn) as zip_file:
+                with resolver.AFF4FactoryOpen(image_urn) as image:
+                    self.assertEquals(image.Size(), len(data))
+                    self.assertEquals(image.Read(len(data)), data)
+        finally:
+            try:
+                os.unlink(crashed)
+            except (IOError, OSError):
+                pass
+
+    def testCheckpointRecords(self):
+        crashed = self.filename + ".crashed"
+        crashed_urn = rdfvalue.URN.FromFileName(crashed)
+        data = b"".join(b"%010d" % i * 3 for i in range(50))
+        try:
+            with data_store.MemoryDataStore() as resolver:
+                with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn,
+                                            appendmode="append") as zip_file:
+                    image_urn = zip_file.urn.Append("image.dd")
+                    with aff4_image.AFF4Image.NewAFF4Image(
+                            resolver, image_urn, zip_file.urn) as image:
+                        image.chunk_size = 10
+                        image.chunks_per_segment = 3
+                        for i in range(50):
+                            image.Write(data[i * 30:(i + 1) * 30])
+                            zip_file.Checkpoint()
+
+                        # Each record only holds what changed since the one
+                        # before, so they do not grow with the volume.
+                        lengths = [end - start for start, end
+                                   in zip_file._directory_extents[1:]]
+                        self.assertEquals(len(lengths), 50)
+                        self.assertTrue(max(lengths[1:]) < 2 * min(lengths[1:]))
+
+                        zip_file.RemoveSegment(self.segment_name)
+                        zip_file.Checkpoint()
+                        shutil.copyfile(self.filename, crashed)
+
+            resolver = data_store.MemoryDataStore()
+            with zip.ZipFile.NewZipFile(resolver, version.aff4v10, crashed_urn) as zip_file:
+                self.assertEquals(zip_file.urn, self.volume_urn)
+                self.assertNotIn(self.volume_urn.Append(self.segment_name),
+                                 zip_file.members)
+                with zip_file.OpenZipSegment(self.streamed_segment) as segment:
+                    self.assertEquals(segment.Read(100), self.data1)
+
+            # The size in the last record replaces the earlier ones. The last
+            # bevy was not finished.
+            with resolver.AFF4FactoryOpen(image_urn) as image:
+                self.assertEquals(image.Size(), len(data) - 30)
+                self.assertEquals(image.Read(len(data)), data[:-30])
+        finally:
+            try:
+                os.unlink(crashed)
+            except (IOError, OSError):
+                pass
+
+    def testCheckpointFreeSpace(self):
+        crashed = self.filename + ".crashed"
+        crashed_urn = rdfvalue.URN.FromFileName(crashed)
+        with data_store.MemoryDataStore() as resolver:
+            with self._open_random(resolver) as zip_file:
+                for name, data in [("big", b"x" * 10000), ("small", b"y" * 100)]:
+                    with zip_file.CreateMember(self.volume_urn.Append(name)) as segment:
+                        segment.Write(data)
+                        segment.Flush()
+
+        try:
+            with data_store.MemoryDataStore() as resolver:
+                with self._open_random(resolver) as zip_file:
+                    small = zip_file.members[self.volume_urn.Append("small")]
+                    zip_file.RemoveSegment("big")
+
+                    # Once a record no longer references the removed member its
+                    # space is reused, and what is left over marked so readers
+                    # of the record can step over it.
+                    zip_file.Checkpoint()
+                    self.assertEquals(zip_file.pending_extents, [])
+                    with zip_file.CreateMember(self.volume_urn.Append("reused")) as segment:
+                        segment.Write(b"z" * 1000)
+                        segment.Flush()
+                    self.assertTrue(
+                        zip_file.members[self.volume_urn.Append("reused")].file_header_offset <
+                        small.file_header_offset)
+
+                    zip_file.Checkpoint()
+                    shutil.copyfile(self.filename, crashed)
+
+            resolver = data_store.MemoryDataStore()
+            with zip.ZipFile.NewZipFile(resolver, version.aff4v10, crashed_urn) as zip_file:
+                self.assertNotIn(self.volume_urn.Append("big"), zip_file.members)
+                for name, data in [("small", b"y" * 100), ("reused", b"z" * 1000),
+                                   (self.streamed_segment, self.data1)]:
+                    with zip_file.OpenZipSegment(name) as segment:
+                        self.assertEquals(segment.Read(10000), data)
+        finally:
+            try:
+                os.unlink(crashed)
+            except (IOError, OSError):
+                pass
+
+    def _open_random(self, resolver):
+        resolver.Set(lexicon.transient_graph, self.filename_urn, lexicon.AFF4_STREAM_WRITE_MODE,
+                     rdfvalue.XSDString("random"))
+        return zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn)
+
+    def testFreeExtentReuse(self):
+        removed_urn = self.volume_urn.Append(self.segment_name)
+        with data_store.MemoryDataStore() as resolver:
+            with self._open_random(resolver) as zip_file:
+                hole = zip_file.members[removed_urn].local_header_offset
+                zip_file.RemoveMember(removed_urn)
+                self.assertEquals(len(zip_file.pending_extents), 1)
+
+                # The central directory on disk still references the removed
+                # member, so its space is not reused yet.
+                with zip_file.CreateMember(self.volume_urn.Append("appended")) as segment:
+                    segment.Write(b"Hi")
+                    segment.Flush()
+
+                self.assertNotEquals(
+                    zip_file.members[self.volume_urn.Append("appended")].local_header_offset,
+                    hole)
+
+        # The free space is found again when the volume is reopened.
+        with data_store.MemoryDataStore() as resolver:
+            with self._open_random(resolver) as zip_file:
+                self.assertEquals(zip_file.free_extents[0][0], hole)
+                with zip_file.CreateMember(self.volume_urn.Append("reused")) as segment:
+                    segment.Write(b"Hi")
+                    segment.Flush()
+
+                self.assertEquals(
+                    zip_file.members[self.volume_urn.Append("reused")].local_header_offset,
+                    hole)
+
+        resolver = data_store.MemoryDataStore()
+        with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn) as zip_file:
+            self.assertNotIn(removed_urn, zip_file.members)
+            for name in ["appended", "reused"]:
+                with zip_file.OpenZipSegment(name) as segment:
+                    self.assertEquals(segment.Read(100), b"Hi")
+            with zip_file.OpenZipSegment(self.streamed_segment) as segment:
+                self.assertEquals(segment.Read(100), self.data1)
+
+    def testCompact(self):
+        with data_store.MemoryDataStore() as resolver:
+            with self._open_random(resolver) as zip_file:
+                for name, data in [("big", b"x" * 10000), ("small", b"y" * 100)]:
+                    with zip_file.CreateZipSegment(name) as segment:
+                        segment.Write(data)
+
+        size = os.stat(self.filename).st_size
+        snapshots = []
+        with data_store.MemoryDataStore() as resolver:
+            with self._open_random(resolver) as zip_file:
+                # Simulate dying after each member is copied.
+                copy_extent = zip_file._CopyExtent
+                def _CopyExtent(backing_store, *args):
+                    copy_extent(backing_store, *args)
+                    backing_store.Flush()
+                    with open(self.filename, "rb") as fd:
+                        snapshots.append(fd.read())
+                zip_file._CopyExtent = _CopyExtent
+
+                zip_file.RemoveSegment("big")
+                zip_file.Compact()
+
+                # The small member moved into the hole, so the file ends
+                # where it did before the big member was added.
+                small = zip_file.members[self.volume_urn.Append("small")]
+                self.assertTrue(small.file_header_offset < size - 10000)
+                self.assertEquals(zip_file.pending_extents, [])
+
+        self.assertTrue(os.stat(self.filename).st_size < size - 9000)
+        with zipfile.ZipFile(self.filename) as z:
+            self.assertEquals(z.testzip(), None)
+            self.assertNotIn("big", z.namelist())
+
+        resolver = data_store.MemoryDataStore()
+        with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn) as zip_file:
+            self.assertEquals(zip_file.urn, self.volume_urn)
+            with zip_file.OpenZipSegment(self.streamed_segment) as segment:
+                self.assertEquals(segment.Read(100), self.data1)
+            with zip_file.OpenZipSegment("small") as segment:
+                self.assertEquals(segment.Read(1000), b"y" * 100)
+
+        self.assertTrue(snapshots)
+        for snapshot in snapshots:
+            with zipfile.ZipFile(io.BytesIO(snapshot)) as z:
+                self.assertEquals(z.testzip(), None)
+                self.assertEquals(z.read("small"), b"y" * 100)
+
+    def testAppendMetadata(self):
+        images = [self.volume_urn.Append("image%d" % i) for i in range(10)]
+        consolidated = appended = 0
+        for i, image in enumerate(images):
+            with data_store.MemoryDataStore() as resolver:
+                with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn,
+                                            appendmode="append") as zip_file:
+                    with zip_file.CreateZipSegment("member%d" % i) as segment:
+                        segment.Write(b"Hi")
+                    resolver.Set(zip_file.urn, image, lexicon.AFF4_TYPE,
+                                 rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE))
+
+            with zipfile.ZipFile(self.filename) as z:
+                turtle = z.read("information.turtle")
+                deltas = [x for x in z.namelist()
+                          if x.startswith("information.turtle/")]
+                sizes = [z.getinfo(x).file_size for x in deltas]
+                if deltas:
+                    # Each session appends only what it changed, while the
+                    # deltas before it are smaller than information.turtle.
+                    appended += 1
+                    self.assertEquals(
+                        deltas[-1], lexicon.AFF4_CONTAINER_INFO_TURTLE_DELTA % (len(deltas) - 1))
+                    self.assertLess(sum(sizes[:-1]), len(turtle))
+                    delta = z.read(deltas[-1])
+                    self.assertIn(("/image%d>" % i).encode(), delta)
+                    self.assertNotIn(("/image%d>" % (i - 1)).encode(), delta)
+                else:
+                    # Then information.turtle is rewritten with them folded in.
+                    consolidated += 1
+                    for j in range(i + 1):
+                        self.assertIn(("/image%d>" % j).encode(), turtle)
+
+        self.assertTrue(appended and consolidated)
+
+        for store in (data_store.MemoryDataStore, data_store.LazyDataStore):
+            resolver = store()
+            with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn) as zip_file:
+                self.assertEquals(
+                    sorted(resolver.QueryPredicateObject(
+                        zip_file.urn, lexicon.AFF4_TYPE, lexicon.AFF4_IMAGE_TYPE)),
+                    sorted(images))
+
+        # Sessions which change no metadata leave it alone.
+        with zipfile.ZipFile(self.filename) as z:
+            members = [(x.filename, x.header_offset) for x in z.infolist()
+                       if x.filename.startswith("information.turtle")]
+        with data_store.MemoryDataStore() as resolver:
+            with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn,
+                                        appendmode="append") as zip_file:
+                zip_file.MarkDirty()
+        with zipfile.ZipFile(self.filename) as z:
+            self.assertEquals(
+                [(x.filename, x.header_offset) for x in z.infolist()
+                 if x.filename.startswith("information.turtle")], members)
+
+        # Volumes which can be rewritten in place get a whole
+        # information.turtle.
+        with data_store.MemoryDataStore() as resolver:
+            with self._open_random(resolver) as zip_file:
+                with zip_file.CreateZipSegment("member10") as segment:
+                    segment.Write(b"Hi")
+                resolver.Set(zip_file.urn, self.volume_urn.Append("image10"),
+                             lexicon.AFF4_TYPE, rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE))
+
+        with zipfile.ZipFile(self.filename) as z:
+            self.assertEquals(
+                [x for x in z.namelist() if x.startswith("information.turtle")],
+                ["information.turtle"])
+            turtle = z.read("information.turtle")
+            for i in range(11):
+                self.assertIn(("/image%d>" % i).encode(), turtle)
+
+    def testParallelMetadata(self):
+        images = [self.volume_urn.Append("image%d" % i) for i in range(3)]
+        sessions = lexicon.AFF4_NAMESPACE + "sessions"
+        for i in range(3):
+            with data_store.MemoryDataStore() as resolver:
+                with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn,
+                                            appendmode="append") as zip_file:
+                    with zip_file.CreateZipSegment("member%d" % i) as segment:
+                        segment.Write(b"Hi")
+                    for image in images[i:]:
+                        resolver.Set(zip_file.urn, image, lexicon.AFF4_TYPE,
+                                     rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE))
+                        resolver.Add(zip_file.urn, image, sessions,
+                                     rdfvalue.XSDInteger(i))
+
+        def _Load(resolver_type, processes):
+            old = data_store.PARALLEL_TURTLE_SIZE, data_store.TURTLE_PROCESSES
+            data_store.PARALLEL_TURTLE_SIZE = 0
+            data_store.TURTLE_PROCESSES = processes
+            try:
+                resolver = resolver_type()
+                with zip.ZipFile.NewZipFile(resolver, version.aff4v10,
+                                            self.filename_urn) as zip_file:
+                    return zip_file.urn, resolver, dict(
+                        (subject, sorted(
+                            (p, [x.SerializeToString() for x in
+                                 (v if isinstance(v, list) else [v])])
+                            for p, v in resolver.QueryPredicatesBySubject(
+                                zip_file.urn, subject)))
+                        for subject in resolver.QuerySubject(zip_file.urn))
+            finally:
+                data_store.PARALLEL_TURTLE_SIZE, data_store.TURTLE_PROCESSES = old
+
+        volume_urn, _, expected = _Load(data_store.MemoryDataStore, 1)
+        for resolver_type in (data_store.MemoryDataStore,
+                              data_store.SpillingDataStore):
+            _, resolver, triples = _Load(resolver_type, 2)
+            self.assertEquals(triples, expected)
+            self.assertEquals(
+                resolver.Get(volume_urn, images[2], sessions),
+                [0, 1, 2])
+            self.assertEquals(
+                resolver.Get(lexicon.transient_graph, images[1], lexicon.AFF4_STORED),
+                [volume_urn])
+            self.assertEquals(
+                sorted(resolver.QueryPredicateObject(
+                    volume_urn, lexicon.AFF4_TYPE, lexicon.AFF4_IMAGE_TYPE)),
+                images)
+
+        # No pool is started unless asked for.
+        old = data_store.PARALLEL_TURTLE_SIZE
+        data_store.PARALLEL_TURTLE_SIZE = 0
+        try:
+            with zip.ZipFile.NewZipFile(data_store.MemoryDataStore(), version.aff4v10,
+                                        self.filename_urn) as zip_file:
+                self.assertFalse(data_store.MemoryDataStore()._LoadTurtleInParallel(
+                    zip_file, ["information.turtle"]))
+        finally:
+            data_store.PARALLEL_TURTLE_SIZE = old
+
+    def testSpillingResolver(self):
+        with data_store.SpillingDataStore(max_triples=10) as resolver:
+            resolver.Set(lexicon.transient_graph, self.filename_urn, lexicon.AFF4_STREAM_WRITE_MODE,
+                         rdfvalue.XSDString("truncate"))
+
+            with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn) as zip_file:
+                volume_urn = zip_file.urn
+                for i in range(20):
+                    with zip_file.CreateZipSegment("member%d" % i) as segment:
+                        segment.Write(b"Hi %d" % i)
+                    resolver.Set(zip_file.urn, volume_urn.Append("image%d" % i),
+                                 lexicon.AFF4_TYPE, rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE))
+                self.assertGreater(len(resolver.spill), 0)
+        resolver.spill.Close()
+
+        resolver = data_store.MemoryDataStore()
+        with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn) as zip_file:
+            self.assertEquals(
+                sorted(resolver.QueryPredicateObject(
+                    zip_file.urn, lexicon.AFF4_TYPE, lexicon.AFF4_IMAGE_TYPE)),
+                sorted(volume_urn.Append("image%d" % i) for i in range(20)))
+            with zip_file.OpenZipSegment("member7") as segment:
+                self.assertEquals(segment.Read(100), b"Hi 7")
+
+    def testIndexedMetadata(self):
+        cache = tempfile.mkdtemp()
+        old_cache = data_store.INDEX_CACHE_DIR
+        data_store.INDEX_CACHE_DIR = cache
+        image = self.volume_urn.Append("image")
+        try:
+            def _Open():
+                resolver = data_store.IndexedDataStore()
+                zip_file = zip.ZipFile.NewZipFile(
+                    resolver, version.aff4v10, self.filename_urn)
+                return resolver, zip_file
+
+            with data_store.MemoryDataStore() as resolver:
+                with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn,
+                                            appendmode="append") as zip_file:
+                    with zip_file.CreateZipSegment("member") as segment:
+                        segment.Write(b"Hi")
+                    resolver.Set(zip_file.urn, image, lexicon.AFF4_TYPE,
+                                 rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE))
+                    resolver.Set(zip_file.urn, image, lexicon.AFF4_STREAM_SIZE,
+                                 rdfvalue.XSDInteger(2))
+
+            # The first open builds the index, and the second maps it.
+            path = None
+            for _ in range(2):
+                resolver, zip_file = _Open()
+                with zip_file:
+                    self.assertIn(zip_file.urn, resolver.indexes)
+                    path = resolver._IndexPath(zip_file)
+                    self.assertTrue(os.path.exists(path))
+                    self.assertFalse(resolver._InMemory(image.value))
+                    self.assertTrue(resolver.isImageStream(image))
+                    self.assertEquals(
+                        resolver.GetUnique(zip_file.urn, image, lexicon.AFF4_STREAM_SIZE), 2)
+                    self.assertEquals(
+                        list(resolver.QueryPredicateObject(
+                            zip_file.urn, lexicon.AFF4_TYPE, lexicon.AFF4_IMAGE_TYPE)),
+                        [image])
+                    self.assertEquals(
+                        resolver.Get(lexicon.any, image, lexicon.AFF4_STORED),
+                        [zip_file.urn])
+
+                    # Values set and subjects deleted hide the indexed ones.
+                    resolver.Set(zip_file.urn, image, lexicon.AFF4_STREAM_SIZE,
+                                 rdfvalue.XSDInteger(5))
+                    self.assertEquals(
+                        resolver.Get(zip_file.urn, image, lexicon.AFF4_STREAM_SIZE), [5])
+                    resolver.DeleteSubject(image)
+                    self.assertEquals(
+                        resolver.Get(zip_file.urn, image, lexicon.AFF4_TYPE), [None])
+                    self.assertNotIn(image, list(resolver.QuerySubject(zip_file.urn)))
+
+            # Appending metadata changes the turtle members, so the index is
+            # rebuilt. Deltas replace the subjects they hold.
+            with data_store.MemoryDataStore() as resolver:
+                with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn,
+                                            appendmode="append") as zip_file:
+                    with zip_file.CreateZipSegment("member2") as segment:
+                        segment.Write(b"Hi")
+                    resolver.Set(zip_file.urn, image, lexicon.AFF4_STREAM_SIZE,
+                                 rdfvalue.XSDInteger(3))
+
+            resolver, zip_file = _Open()
+            with zip_file:
+                self.assertIn(zip_file.urn, resolver.indexes)
+                self.assertEquals(
+                    resolver.Get(zip_file.urn, image, lexicon.AFF4_STREAM_SIZE), [3])
+        finally:
+            data_store.INDEX_CACHE_DIR = old_cache
+            shutil.rmtree(cache)
+
+    def testLazyMetadata(self):
+        images = [self.volume_urn.Append("image%d" % i) for i in range(3)]
+        other = self.volume_urn.Append("other")
+        with data_store.MemoryDataStore() as resolver:
+            with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn,
+                                        appendmode="append") as zip_file:
+                with zip_file.CreateZipSegment("member") as segment:
+                    segment.Write(b"Hi")
+                for i, image in enumerate(images):
+                    resolver.Set(zip_file.urn, image, lexicon.AFF4_TYPE,
+                                 rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE))
+                    resolver.Set(zip_file.urn, image, lexicon.AFF4_STREAM_SIZE,
+                                 rdfvalue.XSDInteger(i))
+                resolver.Set(zip_file.urn, other, lexicon.AFF4_TYPE,
+                             rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE + "Index"))
+                for i in range(20):
+                    resolver.Set(zip_file.urn, self.volume_urn.Append("filler%d" % i),
+                                 lexicon.AFF4_TYPE, rdfvalue.URN(lexicon.AFF4_IMAGE_TYPE + "Index"))
+
+        resolver = data_store.LazyDataStore()
+        with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn) as zip_file:
+            # Nothing is parsed until it is asked for.
+            self.assertIn(images[0].value, resolver.pending)
+            self.assertEquals(resolver.GetUnique(zip_file.urn, images[1],
+                                                 lexicon.AFF4_STREAM_SIZE), 1)
+            self.assertNotIn(images[1].value, resolver.pending)
+            self.assertIn(images[0].value, resolver.pending)
+
+            # Subjects are listed without parsing them.
+            self.assertEquals(
+                list(resolver.SelectSubjectsByPrefix(zip_file.urn, images[0].value[:-1])),
+                images)
+            self.assertIn(other.value, resolver.pending)
+
+            # Queries by value parse the blocks which mention it, but not
+            # those of similar names.
+            self.assertEquals(
+                sorted(resolver.QueryPredicateObject(
+                    zip_file.urn, lexicon.AFF4_TYPE, lexicon.AFF4_IMAGE_TYPE)),
+                images)
+            self.assertIn(other.value, resolver.pending)
+            self.assertEquals(
+                resolver.Get(lexicon.any, images[2], lexicon.AFF4_STORED),
+                [zip_file.urn])
+
+            resolver.DeleteSubject(other)
+            self.assertEquals(list(resolver.QuerySubject(zip_file.urn, "^.*other")), [])
+
+        # A later session's delta replaces what came before for its subjects.
+        # (The first of these sessions folds the deltas before it in.)
+        for i in (4, 5):
+            with data_store.MemoryDataStore() as resolver:
+                with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn,
+                                            appendmode="append") as zip_file:
+                    with zip_file.CreateZipSegment("member%d" % i) as segment:
+                        segment.Write(b"Hi")
+                    resolver.Set(zip_file.urn, images[0], lexicon.AFF4_STREAM_SIZE,
+                                 rdfvalue.XSDInteger(i))
+
+        resolver = data_store.LazyDataStore()
+        with zip.ZipFile.NewZipFile(resolver, version.aff4v10, self.filename_urn) as zip_file:
+            self.assertTrue(list(resolver._TurtleDeltas(zip_file)))
+            self.assertEquals(
+                resolver.Get(zip_file.urn, images[0], lexicon.AFF4_STREAM_SIZE), [5])
+            self.assertEquals(
+                sorted(resolver.QueryPredicateObject(
+                    zip_file.urn, lexicon.AFF4_TYPE, lexicon.AFF4_IMAGE_TYPE)),
+                images)
+
 
 if __name__ == '__main__':
     unittest.main()